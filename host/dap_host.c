@@ -0,0 +1,13 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// CMSIS-DAP state normally defined in DAP.c, which is not part of the host
+// build. jtag_dp_vdtm.c reads the JTAG chain and clock configuration from
+// here, so callers must set up DAP_Data as the host's DAP_Connect,
+// DAP_SWJ_Clock and DAP_JTAG_Configure commands would.
+
+#include "DAP_config.h"
+#include "DAP.h"
+
+DAP_Data_t DAP_Data;
+volatile uint8_t DAP_TransferAbort;
@@ -0,0 +1,151 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+#include "dmi_capture_file.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "swd_link.h"
+
+static const char magic[4] = {'D', 'M', 'I', 'C'};
+
+static void put_u32(uint8_t *p, uint32_t x) {
+	for (uint i = 0; i < 4; ++i)
+		p[i] = x >> 8 * i;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_rec(uint8_t *p, const dmi_capture_rec_t *rec) {
+	put_u32(p, rec->timestamp);
+	put_u32(p + 4, rec->data);
+	p[8] = rec->type;
+	p[9] = rec->tap;
+	p[10] = rec->a;
+	p[11] = rec->b;
+}
+
+static void get_rec(const uint8_t *p, dmi_capture_rec_t *rec) {
+	rec->timestamp = get_u32(p);
+	rec->data = get_u32(p + 4);
+	rec->type = p[8];
+	rec->tap = p[9];
+	rec->a = p[10];
+	rec->b = p[11];
+}
+
+bool dmi_capture_save(const char *path, dmi_capture_rec_t *const *recs, const uint32_t *n, uint n_cores) {
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+	uint32_t total = 0;
+	for (uint core = 0; core < n_cores; ++core)
+		total += n[core];
+	uint8_t buf[sizeof(dmi_capture_rec_t)];
+	memcpy(buf, magic, 4);
+	put_u32(buf + 4, total);
+	bool ok = fwrite(buf, 8, 1, f) == 1;
+	// Merge by timestamp, which may have wrapped, so compare differences
+	uint32_t pos[DMI_CAPTURE_CORES] = {0};
+	for (uint32_t i = 0; ok && i < total; ++i) {
+		uint oldest = n_cores;
+		for (uint core = 0; core < n_cores; ++core) {
+			if (pos[core] == n[core])
+				continue;
+			if (oldest == n_cores || (int32_t)(recs[core][pos[core]].timestamp -
+					recs[oldest][pos[oldest]].timestamp) < 0) {
+				oldest = core;
+			}
+		}
+		dmi_capture_rec_t rec = recs[oldest][pos[oldest]++];
+		rec.type = (rec.type & CAPTURE_TYPE_MASK) | oldest << CAPTURE_TYPE_CORE_LSB;
+		put_rec(buf, &rec);
+		ok = fwrite(buf, sizeof(buf), 1, f) == 1;
+	}
+	ok = fclose(f) == 0 && ok;
+	if (!ok)
+		fprintf(stderr, "%s: write failed\n", path);
+	return ok;
+}
+
+dmi_capture_rec_t *dmi_capture_load(const char *path, uint32_t *n) {
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	uint8_t buf[sizeof(dmi_capture_rec_t)];
+	if (fread(buf, 8, 1, f) != 1 || memcmp(buf, magic, 4)) {
+		fprintf(stderr, "%s: not a DMI capture\n", path);
+		fclose(f);
+		return NULL;
+	}
+	*n = get_u32(buf + 4);
+	dmi_capture_rec_t *recs = malloc((*n ? *n : 1) * sizeof(dmi_capture_rec_t));
+	if (!recs) {
+		fprintf(stderr, "Out of memory\n");
+		fclose(f);
+		return NULL;
+	}
+	for (uint32_t i = 0; i < *n; ++i) {
+		if (fread(buf, sizeof(buf), 1, f) != 1) {
+			fprintf(stderr, "%s: truncated after %lu records\n", path, (unsigned long)i);
+			free(recs);
+			fclose(f);
+			return NULL;
+		}
+		get_rec(buf, &recs[i]);
+	}
+	fclose(f);
+	return recs;
+}
+
+static const char *ack_name(uint ack) {
+	switch (ack) {
+	case 1:                     return "OK";
+	case 2:                     return "WAIT";
+	case 4:                     return "FAULT";
+	case 7:                     return "no response";
+	case SWD_LINK_PARITY_ERROR: return "parity error";
+	default:                    return "bad ACK";
+	}
+}
+
+void dmi_capture_print(FILE *f, const dmi_capture_rec_t *rec) {
+	fprintf(f, "%10lu c%u ", (unsigned long)rec->timestamp, rec->type >> CAPTURE_TYPE_CORE_LSB);
+	switch (rec->type & CAPTURE_TYPE_MASK) {
+	case CAPTURE_BATCH:
+		fprintf(f, "BATCH tap %u, %lu accesses\n", rec->tap, (unsigned long)rec->data);
+		break;
+	case CAPTURE_DMI: {
+		static const char *const status[4] = {"OK", "?", "FAILED", "BUSY"};
+		uint op = rec->b & 0x3u;
+		fprintf(f, "DMI   tap %u %c %02x %s %08lx %s\n", rec->tap, "NRW?"[op], rec->a,
+			op == 1 ? "->" : "<-", (unsigned long)rec->data, status[(rec->b >> 4) & 0x3u]);
+		break;
+	}
+	case CAPTURE_SWD: {
+		bool read = rec->a & 0x4u;
+		fprintf(f, "  SWD %c %cP:%x %s %08lx %s", "WR"[read], "DA"[(rec->a >> 1) & 1u],
+			(rec->a >> 1) & 0xcu, read ? "->" : "<-", (unsigned long)rec->data,
+			ack_name(rec->b & 0xfu));
+		if (rec->b >> 4)
+			fprintf(f, " (retry %u)", rec->b >> 4);
+		fprintf(f, "\n");
+		break;
+	}
+	case CAPTURE_SWD_BURST:
+		fprintf(f, "  SWD W %cP:%x <- burst of %lu, %lu OK\n", "DA"[(rec->a >> 1) & 1u],
+			(rec->a >> 1) & 0xcu, (unsigned long)(rec->data & 0xffffu),
+			(unsigned long)(rec->data >> 16));
+		break;
+	default:
+		fprintf(f, "unknown record type %02x\n", rec->type);
+		break;
+	}
+}
@@ -0,0 +1,31 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Files of DMI capture records (src/dmi_capture.h), as written by dmi_capture
+// and vdtm_bench -c:
+//
+//   "DMIC", record count (u32), records
+//
+// Records are 12 bytes, little-endian, with the records of all cores merged
+// in timestamp order, and the core number in bit 7 of the type.
+
+#ifndef _DMI_CAPTURE_FILE_H
+#define _DMI_CAPTURE_FILE_H
+
+#include <stdio.h>
+
+#include "dmi_capture.h"
+
+// Merge the records of n_cores cores (recs[i] has n[i] records, oldest
+// first) and write them to path. Returns false on failure, after printing an
+// error.
+bool dmi_capture_save(const char *path, dmi_capture_rec_t *const *recs, const uint32_t *n, uint n_cores);
+
+// Load a file. Returns the records, to be freed by the caller, or NULL on
+// failure, after printing an error.
+dmi_capture_rec_t *dmi_capture_load(const char *path, uint32_t *n);
+
+// Print one record as a line of text
+void dmi_capture_print(FILE *f, const dmi_capture_rec_t *rec);
+
+#endif
@@ -0,0 +1,134 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Download and decode the probe's DMI capture buffer (src/dmi_capture.h).
+//
+// Usage: dmi_capture fetch [-k] file
+//        dmi_capture print file
+//
+// fetch freezes recording, downloads every core's ring over the CMSIS-DAP v2
+// bulk interface with the DAP_VENDOR_CAPTURE command, and writes them to file
+// (see dmi_capture_file.h). Recording then restarts, from empty unless -k is
+// given. Only built if libusb-1.0 is found. Don't run it while OpenOCD has
+// the probe open.
+//
+// print decodes a file as text. To replay one against the simulated target,
+// use vdtm_bench -r file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dap_vendor.h"
+#include "dmi_capture_file.h"
+
+#if HAVE_LIBUSB
+
+#include "probe_usb.h"
+
+// Download the records of one core, from index first up to head
+static dmi_capture_rec_t *fetch_core(uint core, uint32_t first, uint32_t head) {
+	dmi_capture_rec_t *recs = malloc((head - first + 1) * sizeof(dmi_capture_rec_t));
+	if (!recs) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+	for (uint32_t i = first; i < head;) {
+		uint8_t req[7] = {ID_DAP_VENDOR_CAPTURE, CAPTURE_READ, core,
+			i & 0xffu, i >> 8 & 0xffu, i >> 16 & 0xffu, i >> 24};
+		uint8_t resp[PROBE_PACKET_SIZE];
+		int n = probe_command(req, sizeof(req), resp);
+		if (!n)
+			break;
+		if (resp[1] != 0 || n < 3 + resp[2] * 12) {
+			fprintf(stderr, "Core %u record %lu not available\n", core, (unsigned long)i);
+			break;
+		}
+		for (uint j = 0; j < resp[2]; ++j, ++i) {
+			const uint8_t *p = resp + 3 + j * 12;
+			dmi_capture_rec_t *rec = &recs[i - first];
+			rec->timestamp = probe_get_u32(p);
+			rec->data = probe_get_u32(p + 4);
+			rec->type = p[8];
+			rec->tap = p[9];
+			rec->a = p[10];
+			rec->b = p[11];
+		}
+		if (i == head)
+			return recs;
+	}
+	free(recs);
+	return NULL;
+}
+
+static int fetch(const char *path, bool keep) {
+	if (!probe_open())
+		return 1;
+
+	bool ok = false;
+	uint8_t resp[PROBE_PACKET_SIZE];
+	const uint8_t info[2] = {ID_DAP_VENDOR_CAPTURE, CAPTURE_INFO};
+	int n = probe_command(info, sizeof(info), resp);
+	dmi_capture_rec_t *recs[DMI_CAPTURE_CORES] = {NULL};
+	uint32_t counts[DMI_CAPTURE_CORES] = {0};
+	uint n_cores = n >= 6 ? resp[2] : 0;
+	if (n && (n_cores > DMI_CAPTURE_CORES || resp[3] != 12 || n < 6 + 4 * (int)n_cores)) {
+		fprintf(stderr, "Unexpected capture format\n");
+	} else if (n) {
+		uint32_t ring_size = resp[4] | resp[5] << 8;
+		ok = true;
+		for (uint core = 0; ok && core < n_cores; ++core) {
+			uint32_t head = probe_get_u32(resp + 6 + 4 * core);
+			uint32_t first = head > ring_size ? head - ring_size : 0;
+			recs[core] = fetch_core(core, first, head);
+			counts[core] = head - first;
+			ok = recs[core] != NULL;
+		}
+		if (ok) {
+			ok = dmi_capture_save(path, recs, counts, n_cores);
+			for (uint core = 0; core < n_cores; ++core)
+				printf("Core %u: %lu records\n", core, (unsigned long)counts[core]);
+		}
+		for (uint core = 0; core < n_cores; ++core)
+			free(recs[core]);
+	}
+	const uint8_t resume[3] = {ID_DAP_VENDOR_CAPTURE, CAPTURE_RESUME, !keep};
+	if (n)
+		(void)probe_command(resume, sizeof(resume), resp);
+
+	probe_close();
+	return ok ? 0 : 1;
+}
+
+#else
+
+static int fetch(const char *path, bool keep) {
+	(void)path;
+	(void)keep;
+	fprintf(stderr, "Built without libusb-1.0, so can't talk to the probe\n");
+	return 1;
+}
+
+#endif
+
+static int print(const char *path) {
+	uint32_t n;
+	dmi_capture_rec_t *recs = dmi_capture_load(path, &n);
+	if (!recs)
+		return 1;
+	for (uint32_t i = 0; i < n; ++i)
+		dmi_capture_print(stdout, &recs[i]);
+	free(recs);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc == 3 && !strcmp(argv[1], "print"))
+		return print(argv[2]);
+	if (argc == 3 && !strcmp(argv[1], "fetch"))
+		return fetch(argv[2], false);
+	if (argc == 4 && !strcmp(argv[1], "fetch") && !strcmp(argv[2], "-k"))
+		return fetch(argv[3], true);
+	fprintf(stderr, "Usage: %s fetch [-k] file\n       %s print file\n", argv[0], argv[0]);
+	return 1;
+}
@@ -0,0 +1,19 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Host stand-in for CMSIS-Core's compiler abstraction, which is Arm-only.
+// Just the macros used by DAP.h and DAP_config.h.
+
+#ifndef _CMSIS_COMPILER_H
+#define _CMSIS_COMPILER_H
+
+#define __INLINE             inline
+#define __STATIC_INLINE      static inline
+#define __STATIC_FORCEINLINE __attribute__((always_inline)) static inline
+#define __NO_RETURN          __attribute__((__noreturn__))
+#define __USED               __attribute__((used))
+#define __WEAK               __attribute__((weak))
+#define __PACKED             __attribute__((packed, aligned(1)))
+#define __ALIGNED(x)         __attribute__((aligned(x)))
+
+#endif
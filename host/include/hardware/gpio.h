@@ -0,0 +1,20 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Host stand-in for the pico-sdk GPIO API used by swd_dmi.c. The pins are
+// connected to simulated SW-DPs, see sim_swd.h.
+
+#ifndef _HARDWARE_GPIO_H
+#define _HARDWARE_GPIO_H
+
+#include "pico/stdlib.h"
+
+void gpio_init(uint gpio);
+
+void gpio_set_dir(uint gpio, bool out);
+
+void gpio_put(uint gpio, bool value);
+
+bool gpio_get(uint gpio);
+
+#endif
@@ -0,0 +1,26 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Host stand-in for the pico-sdk synchronisation primitives. The host build is
+// single threaded, so there is nothing to exclude.
+
+#ifndef _HARDWARE_SYNC_H
+#define _HARDWARE_SYNC_H
+
+#include "pico/stdlib.h"
+
+static inline uint32_t save_and_disable_interrupts(void) {
+	return 0;
+}
+
+static inline void restore_interrupts(uint32_t status) {
+	(void)status;
+}
+
+static inline void __dmb(void) {
+}
+
+static inline void __wfe(void) {
+}
+
+#endif
@@ -0,0 +1,12 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Host stand-in for the pico-sdk timer header: time_us_32() is in
+// pico/stdlib.h.
+
+#ifndef _HARDWARE_TIMER_H
+#define _HARDWARE_TIMER_H
+
+#include "pico/stdlib.h"
+
+#endif
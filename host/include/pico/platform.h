@@ -0,0 +1,18 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Host stand-in for the pico-sdk platform header. The host build is single
+// threaded, so everything runs on "core 0".
+
+#ifndef _PICO_PLATFORM_H
+#define _PICO_PLATFORM_H
+
+#include "pico/stdlib.h"
+
+#define NUM_CORES 2
+
+static inline uint get_core_num(void) {
+	return 0;
+}
+
+#endif
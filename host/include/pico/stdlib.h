@@ -0,0 +1,26 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Host stand-in for the parts of the pico-sdk base headers used by the
+// virtual DTM sources.
+
+#ifndef _PICO_STDLIB_H
+#define _PICO_STDLIB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+typedef unsigned int uint;
+
+static inline uint32_t time_us_32(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000u + ts.tv_nsec / 1000u);
+}
+
+// Required by picoprobe_config.h, but there is no LED here
+#define PICO_DEFAULT_LED_PIN 25
+
+#endif
@@ -0,0 +1,103 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Print the probe's per-stage latency histograms (src/latency.h), read over
+// USB with the DAP_VENDOR_LATENCY command.
+//
+// Usage: probe_latency [-c]
+//
+// -c empties the histograms after reading them, so that the next run only
+// sees what happened in between. Only built if libusb-1.0 is found.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "dap_vendor.h"
+#include "latency.h"
+#include "probe_usb.h"
+
+static const char *const stage_names[] = {
+	[LATENCY_HOST]         = "host turnaround",
+	[LATENCY_USB_READ]     = "USB read",
+	[LATENCY_COMMAND]      = "command",
+	[LATENCY_DMI_CALLBACK] = "DMI callback",
+	[LATENCY_SWD_WIRE]     = "SWD wire",
+	[LATENCY_USB_WRITE]    = "USB write",
+	[LATENCY_TOTAL]        = "total",
+};
+
+_Static_assert(sizeof(stage_names) / sizeof(stage_names[0]) == LATENCY_N_STAGES,
+	"stage names out of step with latency.h");
+
+#define BAR_WIDTH 50
+
+static bool print_stage(uint stage, uint *n_stages) {
+	uint8_t resp[PROBE_PACKET_SIZE];
+	const uint8_t summary[3] = {ID_DAP_VENDOR_LATENCY, LATENCY_SUMMARY, stage};
+	int n = probe_command(summary, sizeof(summary), resp);
+	if (!n || resp[1] != 0 || n < 24) {
+		if (n)
+			fprintf(stderr, "Stage %u not available\n", stage);
+		return false;
+	}
+	*n_stages = resp[2];
+	double mhz = resp[3] ? resp[3] : 1;
+	uint32_t count = probe_get_u32(resp + 4);
+	uint64_t sum = probe_get_u32(resp + 8) | (uint64_t)probe_get_u32(resp + 12) << 32;
+	uint32_t min = probe_get_u32(resp + 16);
+	uint32_t max = probe_get_u32(resp + 20);
+	const char *name = stage < LATENCY_N_STAGES ? stage_names[stage] : "?";
+	printf("%u %s: %lu samples", stage, name, (unsigned long)count);
+	if (!count) {
+		printf("\n\n");
+		return true;
+	}
+	printf(", min %.2f us, mean %.2f us, max %.2f us\n", min / mhz,
+		(double)sum / count / mhz, max / mhz);
+
+	uint32_t buckets[LATENCY_N_BUCKETS] = {0};
+	for (uint first = 0; first < LATENCY_N_BUCKETS;) {
+		const uint8_t req[4] = {ID_DAP_VENDOR_LATENCY, LATENCY_BUCKETS, stage, first};
+		n = probe_command(req, sizeof(req), resp);
+		if (!n || resp[1] != 0 || !resp[2] || n < 3 + 4 * resp[2])
+			return false;
+		for (uint i = 0; i < resp[2] && first < LATENCY_N_BUCKETS; ++i)
+			buckets[first++] = probe_get_u32(resp + 3 + 4 * i);
+	}
+	uint32_t most = 0;
+	for (uint i = 0; i < LATENCY_N_BUCKETS; ++i)
+		most = buckets[i] > most ? buckets[i] : most;
+	for (uint i = 0; i < LATENCY_N_BUCKETS; ++i) {
+		if (!buckets[i])
+			continue;
+		char bar[BAR_WIDTH + 1];
+		uint len = (uint)((uint64_t)buckets[i] * BAR_WIDTH / most);
+		memset(bar, '#', len);
+		bar[len] = '\0';
+		printf("  >= %10.2f us %10lu %s\n", (double)((uint64_t)1 << i) / mhz,
+			(unsigned long)buckets[i], bar);
+	}
+	printf("\n");
+	return true;
+}
+
+int main(int argc, char **argv) {
+	bool clear = argc == 2 && !strcmp(argv[1], "-c");
+	if (argc > 2 || (argc == 2 && !clear)) {
+		fprintf(stderr, "Usage: %s [-c]\n", argv[0]);
+		return 1;
+	}
+	if (!probe_open())
+		return 1;
+	bool ok = true;
+	uint n_stages = 1;
+	for (uint stage = 0; ok && stage < n_stages; ++stage)
+		ok = print_stage(stage, &n_stages);
+	if (ok && clear) {
+		uint8_t resp[PROBE_PACKET_SIZE];
+		const uint8_t req[2] = {ID_DAP_VENDOR_LATENCY, LATENCY_CLEAR};
+		ok = probe_command(req, sizeof(req), resp) != 0;
+	}
+	probe_close();
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,65 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+#include "probe_usb.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <libusb.h>
+
+// See usb_descriptors.c
+#define PROBE_VID          0x2e8au
+#define PROBE_PID          0x000cu
+#define PROBE_ITF          0
+#define PROBE_OUT_EP       0x04u
+#define PROBE_IN_EP        0x85u
+#define PROBE_TIMEOUT_MS   1000
+
+static libusb_device_handle *probe;
+
+bool probe_open(void) {
+	int rc = libusb_init(NULL);
+	if (rc) {
+		fprintf(stderr, "libusb_init: %s\n", libusb_strerror(rc));
+		return false;
+	}
+	probe = libusb_open_device_with_vid_pid(NULL, PROBE_VID, PROBE_PID);
+	if (!probe) {
+		fprintf(stderr, "No probe found (%04x:%04x)\n", PROBE_VID, PROBE_PID);
+		libusb_exit(NULL);
+		return false;
+	}
+	rc = libusb_claim_interface(probe, PROBE_ITF);
+	if (rc) {
+		fprintf(stderr, "Can't claim the CMSIS-DAP interface: %s\n", libusb_strerror(rc));
+		libusb_close(probe);
+		libusb_exit(NULL);
+		return false;
+	}
+	return true;
+}
+
+void probe_close(void) {
+	libusb_release_interface(probe, PROBE_ITF);
+	libusb_close(probe);
+	libusb_exit(NULL);
+}
+
+int probe_command(const uint8_t *req, int req_len, uint8_t *resp) {
+	uint8_t buf[PROBE_PACKET_SIZE] = {0};
+	memcpy(buf, req, req_len);
+	int n;
+	int rc = libusb_bulk_transfer(probe, PROBE_OUT_EP, buf, req_len, &n, PROBE_TIMEOUT_MS);
+	if (rc == 0)
+		rc = libusb_bulk_transfer(probe, PROBE_IN_EP, resp, PROBE_PACKET_SIZE, &n, PROBE_TIMEOUT_MS);
+	if (rc) {
+		fprintf(stderr, "USB transfer failed: %s\n", libusb_strerror(rc));
+		return 0;
+	}
+	if (n < 2 || resp[0] != req[0]) {
+		fprintf(stderr, "Command %02x not supported by the probe firmware\n", req[0]);
+		return 0;
+	}
+	return n;
+}
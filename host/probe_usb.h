@@ -0,0 +1,30 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Vendor commands (src/dap_vendor.h) sent to the probe over its CMSIS-DAP v2
+// bulk interface, using libusb-1.0. Don't use while OpenOCD has the probe
+// open.
+
+#ifndef _PROBE_USB_H
+#define _PROBE_USB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PROBE_PACKET_SIZE 64
+
+// Find the probe and claim its interface. Returns false on failure, after
+// printing an error.
+bool probe_open(void);
+
+void probe_close(void);
+
+// One command and its response. Returns the response length, or 0 on
+// failure, after printing an error.
+int probe_command(const uint8_t *req, int req_len, uint8_t *resp);
+
+static inline uint32_t probe_get_u32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+#endif
@@ -0,0 +1,313 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+#include "sim_dm.h"
+#include "dm_regs.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DATACOUNT 2
+#define N_GPRS    32
+#define N_CSRS    4096
+
+#define CMDERR_UNSUPPORTED 2
+#define CMDERR_EXCEPTION   3
+#define CMDERR_HALTRESUME  4
+
+#define SBERROR_BADADDR    2
+#define SBERROR_ALIGN      3
+#define SBERROR_SIZE       4
+
+#define REGNO_GPR_BASE     0x1000
+
+#define CSR_MISA           0x301
+#define CSR_DCSR           0x7b0
+
+// xdebugver=4 (external debug support), prv=M
+#define DCSR_RESET         0x40000003u
+#define DCSR_CAUSE_BITS    (0x7u << 6)
+#define DCSR_CAUSE_HALTREQ (0x3u << 6)
+// RV32IMC
+#define MISA_RESET         0x40001104u
+
+struct sim_dm {
+	uint32_t dmcontrol;
+	uint32_t data[DATACOUNT];
+	uint32_t cmderr;
+	uint32_t command;
+	uint32_t abstractauto;
+	// RW fields and error flags only; the rest are generated on read
+	uint32_t sbcs;
+	uint32_t sbaddress;
+	uint32_t sbdata;
+	bool halted;
+	bool resumeack;
+	uint32_t gpr[N_GPRS];
+	uint32_t csr[N_CSRS];
+	uint32_t mem_base;
+	uint32_t mem_size;
+	uint8_t *mem;
+	uint32_t access_count;
+};
+
+static void reset_dm(sim_dm_t *dm) {
+	dm->dmcontrol = 0;
+	memset(dm->data, 0, sizeof(dm->data));
+	dm->cmderr = 0;
+	dm->command = 0;
+	dm->abstractauto = 0;
+	dm->sbcs = 2u << DM_SBCS_SBACCESS_LSB;
+	dm->sbaddress = 0;
+	dm->sbdata = 0;
+}
+
+static void reset_hart(sim_dm_t *dm) {
+	dm->halted = false;
+	dm->resumeack = false;
+	memset(dm->gpr, 0, sizeof(dm->gpr));
+	memset(dm->csr, 0, sizeof(dm->csr));
+	dm->csr[CSR_MISA] = MISA_RESET;
+	dm->csr[CSR_DCSR] = DCSR_RESET;
+}
+
+sim_dm_t *sim_dm_create(uint32_t mem_base, uint32_t mem_size) {
+	sim_dm_t *dm = malloc(sizeof(sim_dm_t));
+	if (!dm)
+		return dm;
+	memset(dm, 0, sizeof(*dm));
+	dm->mem = calloc(mem_size, 1);
+	if (!dm->mem) {
+		free(dm);
+		return NULL;
+	}
+	dm->mem_base = mem_base;
+	dm->mem_size = mem_size;
+	reset_dm(dm);
+	reset_hart(dm);
+	return dm;
+}
+
+void sim_dm_destroy(sim_dm_t *dm) {
+	free(dm->mem);
+	free(dm);
+}
+
+uint8_t *sim_dm_get_mem(sim_dm_t *dm) {
+	return dm->mem;
+}
+
+uint32_t sim_dm_get_access_count(sim_dm_t *dm) {
+	return dm->access_count;
+}
+
+// ----------------------------------------------------------------------------
+// Abstract commands
+
+// Only Access Register commands are supported, and only with 32-bit size.
+// postexec is not supported as there is no program buffer.
+static void execute_command(sim_dm_t *dm) {
+	uint32_t cmd = dm->command;
+	if ((cmd >> DM_COMMAND_CMDTYPE_LSB) != 0 || (cmd & DM_COMMAND_POSTEXEC)) {
+		dm->cmderr = CMDERR_UNSUPPORTED;
+		return;
+	}
+	uint aarsize = (cmd & DM_COMMAND_AARSIZE_BITS) >> DM_COMMAND_AARSIZE_LSB;
+	if ((cmd & DM_COMMAND_TRANSFER) && aarsize != 2) {
+		dm->cmderr = CMDERR_UNSUPPORTED;
+		return;
+	}
+	if (!dm->halted) {
+		dm->cmderr = CMDERR_HALTRESUME;
+		return;
+	}
+	uint regno = cmd & DM_COMMAND_REGNO_BITS;
+	if (cmd & DM_COMMAND_TRANSFER) {
+		uint32_t *reg;
+		if (regno < N_CSRS) {
+			reg = &dm->csr[regno];
+		} else if (regno - REGNO_GPR_BASE < N_GPRS) {
+			reg = &dm->gpr[regno - REGNO_GPR_BASE];
+		} else {
+			dm->cmderr = CMDERR_EXCEPTION;
+			return;
+		}
+		if (!(cmd & DM_COMMAND_WRITE))
+			dm->data[0] = *reg;
+		else if (reg != &dm->gpr[0])
+			*reg = dm->data[0];
+	}
+	if (cmd & DM_COMMAND_AARPOSTINCREMENT)
+		dm->command = (cmd & ~DM_COMMAND_REGNO_BITS) | ((regno + 1) & DM_COMMAND_REGNO_BITS);
+}
+
+static void autoexec_data(sim_dm_t *dm, uint i) {
+	if ((dm->abstractauto & (1u << i)) && dm->cmderr == 0)
+		execute_command(dm);
+}
+
+// ----------------------------------------------------------------------------
+// System Bus Access
+
+static void set_sberror(sim_dm_t *dm, uint32_t err) {
+	dm->sbcs = (dm->sbcs & ~DM_SBCS_SBERROR_BITS) | (err << DM_SBCS_SBERROR_LSB);
+}
+
+// Accesses complete instantly, so sbbusy and sbbusyerror are never set
+static void sb_access(sim_dm_t *dm, bool write) {
+	if (dm->sbcs & (DM_SBCS_SBERROR_BITS | DM_SBCS_SBBUSYERROR))
+		return;
+	uint size_log2 = (dm->sbcs & DM_SBCS_SBACCESS_BITS) >> DM_SBCS_SBACCESS_LSB;
+	if (size_log2 > 2) {
+		set_sberror(dm, SBERROR_SIZE);
+		return;
+	}
+	uint32_t size = 1u << size_log2;
+	uint32_t addr = dm->sbaddress;
+	if (addr & (size - 1)) {
+		set_sberror(dm, SBERROR_ALIGN);
+		return;
+	}
+	if (addr < dm->mem_base || addr - dm->mem_base > dm->mem_size - size) {
+		set_sberror(dm, SBERROR_BADADDR);
+		return;
+	}
+	uint8_t *p = dm->mem + (addr - dm->mem_base);
+	if (write) {
+		for (uint i = 0; i < size; ++i)
+			p[i] = (dm->sbdata >> (8 * i)) & 0xffu;
+	} else {
+		dm->sbdata = 0;
+		for (uint i = 0; i < size; ++i)
+			dm->sbdata |= (uint32_t)p[i] << (8 * i);
+	}
+	if (dm->sbcs & DM_SBCS_SBAUTOINCREMENT)
+		dm->sbaddress += size;
+}
+
+// ----------------------------------------------------------------------------
+// DMI access
+
+void sim_dm_write(sim_dm_t *dm, uint32_t addr, uint32_t data) {
+	++dm->access_count;
+	switch (addr) {
+	case DM_DMCONTROL:
+		if (!(data & DM_DMCONTROL_DMACTIVE)) {
+			reset_dm(dm);
+			break;
+		}
+		// With only one hart, no hartsel bits are implemented
+		dm->dmcontrol = data & (DM_DMCONTROL_DMACTIVE | DM_DMCONTROL_NDMRESET);
+		if (data & DM_DMCONTROL_NDMRESET)
+			reset_hart(dm);
+		if (data & DM_DMCONTROL_HALTREQ) {
+			if (!dm->halted) {
+				dm->halted = true;
+				dm->csr[CSR_DCSR] = (dm->csr[CSR_DCSR] & ~DCSR_CAUSE_BITS) | DCSR_CAUSE_HALTREQ;
+			}
+		} else if (data & DM_DMCONTROL_RESUMEREQ) {
+			dm->halted = false;
+			dm->resumeack = true;
+		}
+		break;
+	case DM_DATA0:
+	case DM_DATA1:
+		dm->data[addr - DM_DATA0] = data;
+		autoexec_data(dm, addr - DM_DATA0);
+		break;
+	case DM_ABSTRACTCS:
+		dm->cmderr &= ~((data & DM_ABSTRACTCS_CMDERR_BITS) >> DM_ABSTRACTCS_CMDERR_LSB);
+		break;
+	case DM_COMMAND:
+		if (dm->cmderr == 0) {
+			dm->command = data;
+			execute_command(dm);
+		}
+		break;
+	case DM_ABSTRACTAUTO:
+		dm->abstractauto = data & ((1u << DATACOUNT) - 1);
+		break;
+	case DM_SBCS: {
+		uint32_t errors = dm->sbcs & ~data & (DM_SBCS_SBERROR_BITS | DM_SBCS_SBBUSYERROR);
+		dm->sbcs = errors | (data & (DM_SBCS_SBREADONADDR | DM_SBCS_SBACCESS_BITS |
+			DM_SBCS_SBAUTOINCREMENT | DM_SBCS_SBREADONDATA));
+		break;
+	}
+	case DM_SBADDRESS0:
+		dm->sbaddress = data;
+		if (dm->sbcs & DM_SBCS_SBREADONADDR)
+			sb_access(dm, false);
+		break;
+	case DM_SBDATA0:
+		if (dm->sbcs & (DM_SBCS_SBERROR_BITS | DM_SBCS_SBBUSYERROR))
+			break;
+		dm->sbdata = data;
+		sb_access(dm, true);
+		break;
+	default:
+		break;
+	}
+}
+
+uint32_t sim_dm_read(sim_dm_t *dm, uint32_t addr) {
+	++dm->access_count;
+	uint32_t data = 0;
+	switch (addr) {
+	case DM_DMCONTROL:
+		data = dm->dmcontrol;
+		break;
+	case DM_DMSTATUS:
+		data = DM_DMSTATUS_VERSION_0_13 | DM_DMSTATUS_AUTHENTICATED;
+		if (dm->halted)
+			data |= DM_DMSTATUS_ANYHALTED | DM_DMSTATUS_ALLHALTED;
+		else
+			data |= DM_DMSTATUS_ANYRUNNING | DM_DMSTATUS_ALLRUNNING;
+		if (dm->resumeack)
+			data |= DM_DMSTATUS_ANYRESUMEACK | DM_DMSTATUS_ALLRESUMEACK;
+		break;
+	case DM_HALTSUM0:
+		data = dm->halted;
+		break;
+	case DM_DATA0:
+	case DM_DATA1:
+		data = dm->data[addr - DM_DATA0];
+		autoexec_data(dm, addr - DM_DATA0);
+		break;
+	case DM_ABSTRACTCS:
+		data = DATACOUNT << DM_ABSTRACTCS_DATACOUNT_LSB |
+			dm->cmderr << DM_ABSTRACTCS_CMDERR_LSB;
+		break;
+	case DM_ABSTRACTAUTO:
+		data = dm->abstractauto;
+		break;
+	case DM_SBCS:
+		data = dm->sbcs |
+			1u << DM_SBCS_SBVERSION_LSB |
+			32u << DM_SBCS_SBASIZE_LSB |
+			DM_SBCS_SBACCESS8 | DM_SBCS_SBACCESS16 | DM_SBCS_SBACCESS32;
+		break;
+	case DM_SBADDRESS0:
+		data = dm->sbaddress;
+		break;
+	case DM_SBDATA0:
+		data = dm->sbdata;
+		if (dm->sbcs & DM_SBCS_SBREADONDATA)
+			sb_access(dm, false);
+		break;
+	default:
+		break;
+	}
+	return data;
+}
+
+void sim_dm_dmi_callback(void *user, jtag_vdtm_dmi_access_t *accesses, uint n) {
+	sim_dm_t *dm = (sim_dm_t *)user;
+	for (uint i = 0; i < n; ++i) {
+		jtag_vdtm_dmi_access_t *a = &accesses[i];
+		if (a->op == DMI_OP_WRITE)
+			sim_dm_write(dm, a->addr, a->data);
+		else
+			a->data = sim_dm_read(dm, a->addr);
+		a->status = DMI_STATUS_OK;
+	}
+}
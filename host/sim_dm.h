@@ -0,0 +1,42 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Simulated RISC-V Debug Module (debug spec 0.13.2) with a single RV32 hart
+// and a block of system memory, for exercising the DTM/DMI code on a host
+// machine. Implements enough for OpenOCD: run control, abstract register
+// access (GPRs and CSRs, with autoexecdata), and System Bus Access. There is
+// no program buffer, and the hart does not execute instructions.
+
+#ifndef _SIM_DM_H
+#define _SIM_DM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "jtag_vdtm.h"
+
+struct sim_dm;
+typedef struct sim_dm sim_dm_t;
+
+// Memory is mem_size bytes starting at mem_base, and is initially zero.
+// System bus accesses outside of it fail with sberror=2.
+sim_dm_t *sim_dm_create(uint32_t mem_base, uint32_t mem_size);
+
+void sim_dm_destroy(sim_dm_t *dm);
+
+// DMI accesses. addr is the DM register (word) address.
+void sim_dm_write(sim_dm_t *dm, uint32_t addr, uint32_t data);
+
+uint32_t sim_dm_read(sim_dm_t *dm, uint32_t addr);
+
+// A jtag_vdtm DMI callback which performs accesses directly on the simulated
+// DM, bypassing SWD. user must be a sim_dm_t *. Accesses never fail.
+void sim_dm_dmi_callback(void *user, jtag_vdtm_dmi_access_t *accesses, uint n);
+
+// Direct access to system memory, e.g. to preload or check test data
+uint8_t *sim_dm_get_mem(sim_dm_t *dm);
+
+// Number of DMI accesses performed so far
+uint32_t sim_dm_get_access_count(sim_dm_t *dm);
+
+#endif
@@ -0,0 +1,571 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+#include "sim_swd.h"
+#include "hardware/gpio.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE_RESET_LEN     50
+// Sequences in transmission order, LSB first
+#define SWD_TO_DORMANT     0xe3bcu
+#define SWD_TO_DORMANT_LEN 16
+// Four zero bits followed by the SWD activation code 0x1a, as the last 12
+// bits shifted in MSB-first. (The preceding selection alert is not checked.)
+#define SWD_ACTIVATION     0x058u
+#define SWD_ACTIVATION_MASK 0xfffu
+
+#define ACK_OK             1
+#define ACK_WAIT           2
+#define ACK_FAULT          4
+
+#define DPIDR_VALUE        0x0bc12477u
+// Mem-AP (class 8), APB (type 2)
+#define APIDR_VALUE        0x04770002u
+
+#define CTRL_STAT_ORUNDETECT   (1u << 0)
+#define CTRL_STAT_STICKYORUN   (1u << 1)
+#define CTRL_STAT_STICKYERR    (1u << 5)
+#define CTRL_STAT_WDATAERR     (1u << 7)
+#define CTRL_STAT_CDBGPWRUPREQ (1u << 28)
+#define CTRL_STAT_CDBGPWRUPACK (1u << 29)
+#define CTRL_STAT_CSYSPWRUPREQ (1u << 30)
+#define CTRL_STAT_CSYSPWRUPACK (1u << 31)
+#define CTRL_STAT_STICKY       (CTRL_STAT_STICKYORUN | CTRL_STAT_STICKYERR | CTRL_STAT_WDATAERR)
+
+#define CSW_SIZE_32            (2u << 0)
+#define CSW_ADDRINC_BITS       (3u << 4)
+#define CSW_ADDRINC_SINGLE     (1u << 4)
+
+// TAR auto-increment is only guaranteed within a 1 kB block
+#define TAR_INC_MASK           0x3ffu
+
+typedef enum phase {
+	PH_DORMANT,
+	PH_LOCKOUT, // Protocol error or deselected: wait for line reset
+	PH_IDLE,
+	PH_HEADER,
+	PH_TURN,
+	PH_ACK,
+	PH_RDATA,
+	PH_WDATA
+} phase_t;
+
+struct sim_swd {
+	sim_dm_t *dm;
+	uint32_t targetsel;
+
+	// Link layer
+	phase_t phase;
+	phase_t after_turn;
+	uint count;
+	uint turn_len;
+	uint8_t header;
+	uint8_t ack;
+	bool targetsel_pending;
+	uint32_t shift;
+	uint ones;
+	bool dormant_det;
+	uint dormant_det_len;
+	uint32_t activation_shift;
+	// Line reset seen, and DPIDR not yet read
+	bool reset_state;
+	bool drive;
+	bool drive_value;
+	uint64_t swclk_count;
+	uint64_t packet_count;
+
+	// DP and AP registers
+	uint32_t ctrl_stat;
+	uint32_t select;
+	uint32_t rdbuff;
+	uint32_t csw;
+	uint32_t tar;
+	// The AP is busy with a DRW access until swclk_count reaches this
+	uint64_t ap_busy_until;
+	uint ap_latency;
+	// Injected faults: countdowns of DRW accesses, or 0 if none pending
+	uint inject_wait;
+	uint inject_wait_cycles;
+	uint inject_wdataerr;
+
+	// Which wire the DP is attached to
+	uint pin_swclk;
+	uint pin_swdio;
+};
+
+sim_swd_t *sim_swd_create(sim_dm_t *dm, uint32_t targetsel) {
+	sim_swd_t *swd = malloc(sizeof(sim_swd_t));
+	if (!swd)
+		return swd;
+	memset(swd, 0, sizeof(*swd));
+	swd->dm = dm;
+	swd->targetsel = targetsel;
+	swd->phase = PH_DORMANT;
+	swd->activation_shift = SWD_ACTIVATION_MASK;
+	swd->csw = CSW_SIZE_32;
+	return swd;
+}
+
+void sim_swd_destroy(sim_swd_t *swd) {
+	sim_swd_detach(swd);
+	free(swd);
+}
+
+uint64_t sim_swd_get_swclk_count(sim_swd_t *swd) {
+	return swd->swclk_count;
+}
+
+uint64_t sim_swd_get_packet_count(sim_swd_t *swd) {
+	return swd->packet_count;
+}
+
+void sim_swd_set_ap_latency(sim_swd_t *swd, uint cycles) {
+	swd->ap_latency = cycles;
+}
+
+void sim_swd_inject_wait(sim_swd_t *swd, uint n, uint cycles) {
+	swd->inject_wait = n;
+	swd->inject_wait_cycles = cycles;
+}
+
+void sim_swd_inject_wdataerr(sim_swd_t *swd, uint n) {
+	swd->inject_wdataerr = n;
+}
+
+static inline bool parity32(uint32_t x) {
+	return __builtin_parity(x);
+}
+
+// ----------------------------------------------------------------------------
+// DP and AP register access
+
+// Called on every DRW access, after the AP has been made busy for it
+static void drw_accessed(sim_swd_t *swd) {
+	swd->ap_busy_until = swd->swclk_count + swd->ap_latency;
+	if (swd->inject_wait && --swd->inject_wait == 0)
+		swd->ap_busy_until = swd->swclk_count + swd->inject_wait_cycles;
+}
+
+// ADI leaves it to the AP whether TAR wraps or carries at the end of a 1 kB
+// block. This one carries, so that anything relying on a wrap goes wrong.
+static void tar_increment(sim_swd_t *swd) {
+	if ((swd->csw & CSW_ADDRINC_BITS) == CSW_ADDRINC_SINGLE)
+		swd->tar += 4;
+}
+
+static uint32_t ap_read(sim_swd_t *swd, uint a) {
+	if (swd->select >> 24 != 0)
+		return 0;
+	uint32_t data = 0;
+	switch ((swd->select & 0xf0u) | a << 2) {
+	case 0x00:
+		data = swd->csw;
+		break;
+	case 0x04:
+		data = swd->tar;
+		break;
+	case 0x0c:
+		data = sim_dm_read(swd->dm, swd->tar >> 2);
+		tar_increment(swd);
+		drw_accessed(swd);
+		break;
+	case 0xfc:
+		data = APIDR_VALUE;
+		break;
+	default:
+		break;
+	}
+	return data;
+}
+
+static void ap_write(sim_swd_t *swd, uint a, uint32_t data) {
+	if (swd->select >> 24 != 0)
+		return;
+	switch ((swd->select & 0xf0u) | a << 2) {
+	case 0x00:
+		swd->csw = CSW_SIZE_32 | (data & CSW_ADDRINC_BITS);
+		break;
+	case 0x04:
+		swd->tar = data;
+		break;
+	case 0x0c:
+		sim_dm_write(swd->dm, swd->tar >> 2, data);
+		tar_increment(swd);
+		drw_accessed(swd);
+		break;
+	default:
+		break;
+	}
+}
+
+static uint32_t dp_read(sim_swd_t *swd, uint a) {
+	switch (a) {
+	case 0:
+		swd->reset_state = false;
+		return DPIDR_VALUE;
+	case 1:
+		if (swd->select & 0xfu)
+			return 0;
+		return swd->ctrl_stat |
+			(swd->ctrl_stat & CTRL_STAT_CDBGPWRUPREQ ? CTRL_STAT_CDBGPWRUPACK : 0) |
+			(swd->ctrl_stat & CTRL_STAT_CSYSPWRUPREQ ? CTRL_STAT_CSYSPWRUPACK : 0);
+	default:
+		// RESEND and RDBUFF
+		return swd->rdbuff;
+	}
+}
+
+static void dp_write(sim_swd_t *swd, uint a, uint32_t data) {
+	switch (a) {
+	case 0:
+		// ABORT: any of the clear bits clears all sticky flags
+		if (data & 0x1eu)
+			swd->ctrl_stat &= ~CTRL_STAT_STICKY;
+		break;
+	case 1:
+		if ((swd->select & 0xfu) == 0) {
+			swd->ctrl_stat = (swd->ctrl_stat & CTRL_STAT_STICKY) | (data &
+				(CTRL_STAT_ORUNDETECT | CTRL_STAT_CDBGPWRUPREQ | CTRL_STAT_CSYSPWRUPREQ));
+		}
+		break;
+	case 2:
+		swd->select = data;
+		break;
+	default:
+		break;
+	}
+}
+
+// ----------------------------------------------------------------------------
+// Link layer
+
+static void start_turn(sim_swd_t *swd, uint len, phase_t next) {
+	swd->phase = PH_TURN;
+	swd->turn_len = len;
+	swd->after_turn = next;
+	swd->count = 0;
+}
+
+static void line_reset(sim_swd_t *swd) {
+	swd->phase = PH_IDLE;
+	swd->reset_state = true;
+	swd->targetsel_pending = false;
+	swd->dormant_det = true;
+	swd->dormant_det_len = 0;
+}
+
+static void header_done(sim_swd_t *swd) {
+	uint8_t h = swd->header;
+	bool ap = h & 0x2u;
+	bool read = h & 0x4u;
+	uint a = (h >> 3) & 0x3u;
+	bool parity = (h >> 5) & 0x1u;
+	if ((h & 0xc0u) != 0x80u || parity != (ap ^ read ^ (a & 1) ^ (a >> 1))) {
+		swd->phase = PH_LOCKOUT;
+		return;
+	}
+	++swd->packet_count;
+	// TARGETSEL: no response, just 5 undriven cycles before the data
+	if (swd->reset_state && !ap && !read && a == 3) {
+		swd->targetsel_pending = true;
+		start_turn(swd, 5, PH_WDATA);
+		return;
+	}
+	// Only DPIDR reads are accepted straight after a line reset
+	if (swd->reset_state && !(!ap && read && a == 0)) {
+		swd->phase = PH_LOCKOUT;
+		return;
+	}
+	swd->ack = ACK_OK;
+	if (ap && (swd->ctrl_stat & CTRL_STAT_STICKY)) {
+		swd->ack = ACK_FAULT;
+	} else if ((ap || (read && a == 3)) && swd->swclk_count < swd->ap_busy_until) {
+		// AP accesses, and RDBUFF reads, wait for the previous DRW access
+		swd->ack = ACK_WAIT;
+		if (swd->ctrl_stat & CTRL_STAT_ORUNDETECT)
+			swd->ctrl_stat |= CTRL_STAT_STICKYORUN;
+	}
+	if (read && swd->ack == ACK_OK) {
+		if (ap) {
+			// AP reads are posted: return the previous result
+			swd->shift = swd->rdbuff;
+			swd->rdbuff = ap_read(swd, a);
+		} else {
+			swd->shift = dp_read(swd, a);
+		}
+	}
+	start_turn(swd, 1, PH_ACK);
+}
+
+static void wdata_done(sim_swd_t *swd, bool parity) {
+	uint32_t data = swd->shift;
+	if (swd->targetsel_pending) {
+		swd->targetsel_pending = false;
+		if (swd->targetsel && (parity != parity32(data) || data != swd->targetsel))
+			swd->phase = PH_LOCKOUT;
+		return;
+	}
+	if (swd->ack != ACK_OK)
+		return;
+	bool drw = (swd->header & 0x2u) && ((swd->header >> 3) & 0x3u) == 3;
+	if (drw && swd->inject_wdataerr && --swd->inject_wdataerr == 0)
+		parity = !parity32(data);
+	if (parity != parity32(data)) {
+		swd->ctrl_stat |= CTRL_STAT_WDATAERR;
+		return;
+	}
+	if (swd->header & 0x2u)
+		ap_write(swd, (swd->header >> 3) & 0x3u, data);
+	else
+		dp_write(swd, (swd->header >> 3) & 0x3u, data);
+}
+
+static void clock_posedge(sim_swd_t *swd, bool host_drives, bool bit) {
+	++swd->swclk_count;
+	if (host_drives && swd->phase != PH_DORMANT) {
+		swd->ones = bit ? swd->ones + 1 : 0;
+		if (swd->ones >= LINE_RESET_LEN) {
+			line_reset(swd);
+			swd->drive = false;
+			return;
+		}
+		if (swd->dormant_det) {
+			if (bit != ((SWD_TO_DORMANT >> swd->dormant_det_len) & 1u)) {
+				swd->dormant_det = false;
+			} else if (++swd->dormant_det_len == SWD_TO_DORMANT_LEN) {
+				swd->dormant_det = false;
+				swd->phase = PH_DORMANT;
+				swd->activation_shift = SWD_ACTIVATION_MASK;
+				swd->drive = false;
+				return;
+			}
+		}
+	}
+
+	switch (swd->phase) {
+	case PH_DORMANT:
+		if (host_drives) {
+			swd->activation_shift = ((swd->activation_shift << 1) | bit) & SWD_ACTIVATION_MASK;
+			// A line reset is needed before the first packet
+			if (swd->activation_shift == SWD_ACTIVATION)
+				swd->phase = PH_LOCKOUT;
+		}
+		break;
+	case PH_LOCKOUT:
+		break;
+	case PH_IDLE:
+		if (host_drives && bit) {
+			swd->header = 1;
+			swd->count = 1;
+			swd->phase = PH_HEADER;
+		}
+		break;
+	case PH_HEADER:
+		swd->header |= (uint8_t)bit << swd->count;
+		if (++swd->count == 8)
+			header_done(swd);
+		break;
+	case PH_TURN:
+		if (++swd->count == swd->turn_len) {
+			swd->phase = swd->after_turn;
+			swd->count = 0;
+			if (swd->phase == PH_WDATA)
+				swd->shift = 0;
+		}
+		break;
+	case PH_ACK:
+		if (++swd->count == 3) {
+			bool read = swd->header & 0x4u;
+			bool data_phase = swd->ack == ACK_OK || (swd->ctrl_stat & CTRL_STAT_ORUNDETECT);
+			if (!data_phase)
+				start_turn(swd, 1, PH_IDLE);
+			else if (read)
+				swd->phase = PH_RDATA;
+			else
+				start_turn(swd, 1, PH_WDATA);
+			swd->count = 0;
+		}
+		break;
+	case PH_RDATA:
+		if (++swd->count == 33)
+			start_turn(swd, 1, PH_IDLE);
+		break;
+	case PH_WDATA:
+		if (swd->count < 32) {
+			swd->shift |= (uint32_t)bit << swd->count;
+			++swd->count;
+		} else {
+			swd->phase = PH_IDLE;
+			wdata_done(swd, bit);
+		}
+		break;
+	}
+
+	// What we drive during the next cycle, for the host to sample before
+	// the next rising edge
+	swd->drive = false;
+	if (swd->phase == PH_ACK) {
+		swd->drive = true;
+		swd->drive_value = (swd->ack >> swd->count) & 1u;
+	} else if (swd->phase == PH_RDATA) {
+		swd->drive = true;
+		swd->drive_value = swd->count < 32 ?
+			(swd->shift >> swd->count) & 1u : parity32(swd->shift);
+	}
+}
+
+// ----------------------------------------------------------------------------
+// Host GPIO implementation
+
+#define MAX_ATTACHED 8
+#define N_GPIOS      32
+
+static sim_swd_t *attached[MAX_ATTACHED];
+static bool gpio_out[N_GPIOS];
+static bool gpio_oe[N_GPIOS];
+
+void sim_swd_attach(sim_swd_t *swd, uint pin_swclk, uint pin_swdio) {
+	swd->pin_swclk = pin_swclk;
+	swd->pin_swdio = pin_swdio;
+	for (int i = 0; i < MAX_ATTACHED; ++i) {
+		if (!attached[i]) {
+			attached[i] = swd;
+			return;
+		}
+	}
+}
+
+void sim_swd_detach(sim_swd_t *swd) {
+	for (int i = 0; i < MAX_ATTACHED; ++i) {
+		if (attached[i] == swd)
+			attached[i] = NULL;
+	}
+}
+
+void gpio_init(uint gpio) {
+	gpio_out[gpio] = false;
+	gpio_oe[gpio] = false;
+}
+
+void gpio_set_dir(uint gpio, bool out) {
+	gpio_oe[gpio] = out;
+}
+
+// A wire is identified by its SWCLK pin, with ANY_WIRE matching every
+// attached DP. All DPs on a wire see the same edge.
+#define ANY_WIRE (~0u)
+
+static inline bool on_wire(const sim_swd_t *swd, uint pin_swclk) {
+	return swd && (pin_swclk == ANY_WIRE || swd->pin_swclk == pin_swclk);
+}
+
+static void wire_clock(uint pin_swclk, bool host_drives, bool bit) {
+	for (int i = 0; i < MAX_ATTACHED; ++i) {
+		if (on_wire(attached[i], pin_swclk))
+			clock_posedge(attached[i], host_drives, bit);
+	}
+}
+
+static bool wire_get(uint pin_swclk) {
+	for (int i = 0; i < MAX_ATTACHED; ++i) {
+		if (on_wire(attached[i], pin_swclk) && attached[i]->drive)
+			return attached[i]->drive_value;
+	}
+	// Pulled up
+	return true;
+}
+
+// The SWDIO pin of the wire with this SWCLK pin, if any DP is attached
+static bool find_swdio(uint pin_swclk, uint *pin_swdio) {
+	for (int i = 0; i < MAX_ATTACHED; ++i) {
+		if (on_wire(attached[i], pin_swclk)) {
+			*pin_swdio = attached[i]->pin_swdio;
+			return true;
+		}
+	}
+	return false;
+}
+
+void gpio_put(uint gpio, bool value) {
+	bool rising = gpio_oe[gpio] && value && !gpio_out[gpio];
+	gpio_out[gpio] = value;
+	uint swdio;
+	if (rising && find_swdio(gpio, &swdio))
+		wire_clock(gpio, gpio_oe[swdio], gpio_out[swdio]);
+}
+
+bool gpio_get(uint gpio) {
+	if (gpio_oe[gpio])
+		return gpio_out[gpio];
+	for (int i = 0; i < MAX_ATTACHED; ++i) {
+		if (attached[i] && attached[i]->pin_swdio == gpio)
+			return wire_get(attached[i]->pin_swclk);
+	}
+	return true;
+}
+
+// ----------------------------------------------------------------------------
+// Link backend
+
+static inline uint link_wire(void *ctx) {
+	return ctx ? ((const swd_link_port_t *)ctx)->pin_swclk : ANY_WIRE;
+}
+
+static void link_init(void *ctx) {
+	(void)ctx;
+}
+
+static void link_put_bits(void *ctx, const uint8_t *tx, uint n_bits) {
+	uint wire = link_wire(ctx);
+	for (uint i = 0; i < n_bits; ++i)
+		wire_clock(wire, true, (tx[i / 8] >> (i % 8)) & 1u);
+}
+
+static void link_get_bits(void *ctx, uint8_t *rx, uint n_bits) {
+	uint wire = link_wire(ctx);
+	memset(rx, 0, (n_bits + 7) / 8);
+	for (uint i = 0; i < n_bits; ++i) {
+		rx[i / 8] |= (uint8_t)wire_get(wire) << (i % 8);
+		wire_clock(wire, false, false);
+	}
+}
+
+static void link_hiz_clocks(void *ctx, uint n_bits) {
+	uint wire = link_wire(ctx);
+	for (uint i = 0; i < n_bits; ++i)
+		wire_clock(wire, false, false);
+}
+
+// Write packets back to back, without stopping at a bad ACK, as the probe's
+// PIO link does. The DP must have ORUNDETECT set.
+static uint link_write_burst(void *ctx, uint8_t header, const uint32_t *data, uint n) {
+	uint first_bad = n;
+	for (uint i = 0; i < n; ++i) {
+		uint8_t ack;
+		link_put_bits(ctx, &header, 8);
+		link_hiz_clocks(ctx, 1);
+		link_get_bits(ctx, &ack, 3);
+		link_hiz_clocks(ctx, 1);
+		uint8_t tx[5];
+		for (uint j = 0; j < 4; ++j)
+			tx[j] = (uint8_t)(data[i] >> 8 * j);
+		tx[4] = parity32(data[i]);
+		link_put_bits(ctx, tx, 33);
+		if (ack != ACK_OK && first_bad == n)
+			first_bad = i;
+	}
+	return first_bad;
+}
+
+const swd_link_ops_t sim_swd_link = {
+	.init        = link_init,
+	.put_bits    = link_put_bits,
+	.get_bits    = link_get_bits,
+	.hiz_clocks  = link_hiz_clocks,
+	.transfer    = NULL,
+	.write_burst = link_write_burst,
+	.swclk_khz   = SIM_SWD_LINK_SWCLK_KHZ,
+	.name        = "sim"
+};
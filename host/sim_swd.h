@@ -0,0 +1,69 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Simulated SW-DP (ADIv5.2, with dormant state and optional multi-drop
+// TARGETSEL) and a single APB Mem-AP in front of a simulated Debug Module.
+//
+// The DP is clocked on every rising edge of SWCLK, so the whole link is
+// exercised bit by bit, including the connect sequence. It can be driven
+// either by the bitbang link (swd_link_bitbang.c) through host versions of
+// the RP2040 gpio_*() functions, or by sim_swd_link, which clocks the
+// attached DPs directly.
+
+#ifndef _SIM_SWD_H
+#define _SIM_SWD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sim_dm.h"
+#include "swd_link.h"
+
+// Nominal SWCLK frequency reported by sim_swd_link, the same as the PIO link
+// on the probe. Only used to convert cycle counts to time.
+#define SIM_SWD_LINK_SWCLK_KHZ 12500
+
+struct sim_swd;
+typedef struct sim_swd sim_swd_t;
+
+// targetsel is the TARGETSEL value this DP responds to, or 0 if it does not
+// support multi-drop (in which case TARGETSEL is accepted but has no
+// effect). The DP starts out in the dormant state, like an RP2040.
+sim_swd_t *sim_swd_create(sim_dm_t *dm, uint32_t targetsel);
+
+void sim_swd_destroy(sim_swd_t *swd);
+
+// Connect the DP to the host GPIOs, and to sim_swd_link. Several DPs may share
+// the same pair of pins (multi-drop), and DPs on different pins are on
+// separate wires.
+void sim_swd_attach(sim_swd_t *swd, uint pin_swclk, uint pin_swdio);
+
+void sim_swd_detach(sim_swd_t *swd);
+
+// Number of SWCLK rising edges seen by this DP
+uint64_t sim_swd_get_swclk_count(sim_swd_t *swd);
+
+// Number of well-formed SWD packet headers seen by this DP (including ones
+// addressed to another DP on the same wire)
+uint64_t sim_swd_get_packet_count(sim_swd_t *swd);
+
+// Keep the AP busy for this many SWCLK cycles after each DRW access, as for a
+// Debug Module on a slow clock. AP accesses and RDBUFF reads get a WAIT
+// response until then. Defaults to 0.
+void sim_swd_set_ap_latency(sim_swd_t *swd, uint cycles);
+
+// Fault injection, for one DRW access only. n counts DRW accesses from now,
+// with 1 being the next one. After the nth, keep the AP busy for this many
+// SWCLK cycles, so that following AP accesses get a WAIT.
+void sim_swd_inject_wait(sim_swd_t *swd, uint n, uint cycles);
+
+// Take the nth DRW write from now as having bad write data parity: it is
+// dropped and WDATAERR is set, so following AP accesses get a FAULT.
+void sim_swd_inject_wdataerr(sim_swd_t *swd, uint n);
+
+// SWD link backend that drives attached DPs without going through the GPIO
+// functions. The context is a swd_link_port_t, whose SWCLK pin selects the
+// wire, or NULL to drive every attached DP as if they shared one wire.
+extern const swd_link_ops_t sim_swd_link;
+
+#endif
@@ -0,0 +1,820 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Replay CMSIS-DAP JTAG sessions through the whole virtual DTM stack, and
+// report how much work each layer did:
+//
+//   JTAG_Sequence packets -> jtag_dp_vdtm.c (DMI scan recogniser, or the
+//   bit-accurate JTAG_Sequence) -> jtag_vdtm -> DMI callback -> swd_dmi
+//   -> SWD link -> simulated SW-DP -> simulated Debug Module
+//
+// Usage: vdtm_bench [-l sim|bitbang] [-w cycles] [-t taps] [-p ports]
+//                   [-r dmi_capture] [-c dmi_capture] [capture...]
+//
+// -l selects the SWD link backend: sim (the default) clocks the simulated DP
+// directly, and bitbang runs the firmware's GPIO bitbang code against host
+// GPIO functions.
+//
+// -w makes the simulated AP busy for this many SWCLK cycles after each DRW
+// access, so that the DP responds WAIT, as for a Debug Module on a slow clock.
+//
+// -t puts this many DPs on one multi-drop SWD link, each with its own Debug
+// Module and virtual TAP. The built-in sessions talk to TAP 0 (nearest TDO)
+// with the others in BYPASS, apart from poll_all, which takes turns, and
+// poll_par, which selects the DMI in every TAP at once.
+//
+// -p spreads the DPs over this many separate SWD ports (wires), which must
+// divide the number of TAPs. Time on the wire is then that of the busiest
+// port, as the firmware can drive different ports at the same time.
+//
+// -r replays the DMI accesses recorded in a DMI capture file, as fetched
+// from a probe with dmi_capture, instead of the sessions below. -c writes a
+// DMI capture of everything this run did (connection included).
+//
+// With no arguments, replays built-in sessions, synthesised in the same
+// shape as OpenOCD's riscv-013 and cmsis-dap drivers generate them. A
+// capture file is a sequence of CMSIS-DAP request packets, each preceded by
+// its length as a 16-bit little-endian value, e.g. extracted from a usbmon
+// trace of a real OpenOCD session. Only JTAG_Sequence commands are replayed;
+// other commands are counted and skipped, so DAP_Data is set up here as if
+// the host had already connected in JTAG mode.
+//
+// This is a benchmark, not a test: the responses are not checked.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "DAP_config.h"
+#include "DAP.h"
+
+#include "dm_regs.h"
+#include "dmi_capture_file.h"
+#include "jtag_dp_vdtm.h"
+#include "sim_dm.h"
+#include "sim_swd.h"
+
+// Must match the pins used by swd_link_bitbang.c. Further SWD ports use the
+// next pairs of pins up.
+#define PIN_SWCLK 2
+#define PIN_SWDIO 3
+
+#define MEM_BASE  0x20000000u
+#define MEM_SIZE  (64u * 1024u)
+
+// TCK clock_delay, about 10 MHz. Only used for the DTM's idle hint.
+#define BENCH_CLOCK_DELAY 5u
+
+// Run-Test/Idle cycles after each DMI scan, as OpenOCD would use for
+// dtmcs.idle = 7
+#define SCAN_IDLE 6u
+
+// sbdata0 reads or writes queued by OpenOCD before checking sbcs
+#define SBA_BATCH 256u
+
+#define IR_IDCODE 0x01u
+#define IR_DTMCS  0x10u
+#define IR_DMI    0x11u
+#define IR_BYPASS 0x1fu
+#define IR_LEN    5u
+
+#define MAX_TAPS  4u
+// Multi-drop TARGETSEL for DP i, in the style of RP2040's
+#define BENCH_TARGETSEL(i) (0x01002927u | (uint32_t)(i) << 28)
+
+#define DTMCS_DMIRESET (1u << 16)
+
+// ----------------------------------------------------------------------------
+// Sessions, stored in the same format as capture files
+
+// Virtual TAPs in the chain, and the one the session is currently talking to
+// (or ALL_TAPS). Scans put the others in BYPASS, and shift one bit through
+// each of them.
+static uint n_taps = 1;
+static uint cur_tap = 0;
+
+#define ALL_TAPS (~0u)
+
+static inline bool is_cur_tap(uint t) {
+	return cur_tap == ALL_TAPS || t == cur_tap;
+}
+
+typedef struct {
+	const char *name;
+	uint8_t *buf;
+	size_t len;
+	size_t cap;
+	// JTAG_Sequence packet under construction, if cur_len is nonzero
+	uint8_t cur[DAP_PACKET_SIZE];
+	uint cur_len;
+} session_t;
+
+static void session_append(session_t *s, const uint8_t *data, size_t n) {
+	if (s->len + n > s->cap) {
+		s->cap = 2 * (s->len + n);
+		s->buf = realloc(s->buf, s->cap);
+		if (!s->buf) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	memcpy(s->buf + s->len, data, n);
+	s->len += n;
+}
+
+// End the current packet. OpenOCD does this whenever it needs the results of
+// the scans queued so far, so each flush is one USB round trip.
+static void session_flush(session_t *s) {
+	if (!s->cur_len)
+		return;
+	uint8_t hdr[2] = {s->cur_len & 0xffu, s->cur_len >> 8};
+	session_append(s, hdr, 2);
+	session_append(s, s->cur, s->cur_len);
+	s->cur_len = 0;
+}
+
+// Make room for sequences totalling nbytes (including info bytes) in the
+// current packet, so that a scan is never split across two packets
+static void seq_reserve(session_t *s, uint nbytes) {
+	if (s->cur_len && (s->cur_len + nbytes > DAP_PACKET_SIZE || s->cur[1] == 0xffu))
+		session_flush(s);
+	if (!s->cur_len) {
+		s->cur[0] = ID_DAP_JTAG_Sequence;
+		s->cur[1] = 0;
+		s->cur_len = 2;
+	}
+}
+
+static inline uint seq_bytes(uint n) {
+	return 1 + (n + 7) / 8;
+}
+
+static void seq_put(session_t *s, uint n, uint8_t flags, uint64_t tdi) {
+	s->cur[s->cur_len++] = (n & JTAG_SEQUENCE_TCK) | flags;
+	for (uint i = 0; i < (n + 7) / 8; ++i)
+		s->cur[s->cur_len++] = (tdi >> (8 * i)) & 0xffu;
+	++s->cur[1];
+}
+
+// Test-Logic-Reset, then Run-Test/Idle
+static void jtag_reset(session_t *s) {
+	seq_reserve(s, seq_bytes(5) + seq_bytes(1));
+	seq_put(s, 5, JTAG_SEQUENCE_TMS, 0);
+	seq_put(s, 1, 0, 0);
+}
+
+// IR scan from Run-Test/Idle, back to Run-Test/Idle, loading ir into the
+// current TAP and BYPASS into the others
+static void jtag_ir(session_t *s, uint32_t ir) {
+	uint n = n_taps * IR_LEN;
+	uint64_t irs = 0;
+	for (uint i = 0; i < n_taps; ++i)
+		irs |= (uint64_t)(is_cur_tap(i) ? ir : IR_BYPASS) << (i * IR_LEN);
+	seq_reserve(s, seq_bytes(2) + seq_bytes(2) + seq_bytes(n - 1) + 3 * seq_bytes(1));
+	seq_put(s, 2, JTAG_SEQUENCE_TMS, 0);
+	seq_put(s, 2, 0, 0);
+	seq_put(s, n - 1, 0, irs);
+	seq_put(s, 1, JTAG_SEQUENCE_TMS, irs >> (n - 1));
+	seq_put(s, 1, JTAG_SEQUENCE_TMS, 0);
+	seq_put(s, 1, 0, 0);
+}
+
+// 32-bit DR scan from Run-Test/Idle, back to Run-Test/Idle
+static void jtag_dr32(session_t *s, uint32_t dr) {
+	uint n = 32 + n_taps - 1;
+	uint64_t drs = (uint64_t)dr << cur_tap;
+	seq_reserve(s, seq_bytes(1) + seq_bytes(2) + seq_bytes(n - 1) + 3 * seq_bytes(1));
+	seq_put(s, 1, JTAG_SEQUENCE_TMS, 0);
+	seq_put(s, 2, 0, 0);
+	seq_put(s, n - 1, JTAG_SEQUENCE_TDO, drs);
+	seq_put(s, 1, JTAG_SEQUENCE_TMS | JTAG_SEQUENCE_TDO, drs >> (n - 1));
+	seq_put(s, 1, JTAG_SEQUENCE_TMS, 0);
+	seq_put(s, 1, 0, 0);
+}
+
+static void bits_put(uint8_t *v, uint offset, uint64_t x, uint n) {
+	for (uint i = 0; i < n; ++i)
+		v[(offset + i) / 8] |= ((x >> i) & 1u) << ((offset + i) % 8);
+}
+
+static uint64_t bits_get(const uint8_t *v, uint offset, uint n) {
+	uint64_t x = 0;
+	for (uint i = 0; i < n; ++i)
+		x |= (uint64_t)((v[(offset + i) / 8] >> ((offset + i) % 8)) & 1u) << i;
+	return x;
+}
+
+// DMI scan followed by SCAN_IDLE cycles in Run-Test/Idle, with the same
+// access for every current TAP. OpenOCD merges consecutive bits with the
+// same TMS value into one sequence (of at most 64 bits), so the capture/shift
+// entry bits share a sequence with the first DR bits, and the last DR bit
+// shares one with Update-DR.
+static void dmi_scan(session_t *s, uint op, uint32_t addr, uint32_t data) {
+	uint64_t dmi = (uint64_t)addr << 34 | (uint64_t)data << 2 | op;
+	// Two entry bits, then the DR of each TAP from the one nearest TDO
+	uint8_t v[(2 + 42 * MAX_TAPS + 7) / 8] = {0};
+	uint n = 2;
+	for (uint t = 0; t < n_taps; ++t) {
+		if (is_cur_tap(t)) {
+			bits_put(v, n, dmi, 42);
+			n += 42;
+		} else {
+			n += 1;
+		}
+	}
+	uint nbytes = seq_bytes(1) + seq_bytes(2) + seq_bytes(1 + SCAN_IDLE);
+	for (uint i = 0; i < n - 1; i += 64)
+		nbytes += seq_bytes(n - 1 - i < 64 ? n - 1 - i : 64);
+	seq_reserve(s, nbytes);
+	seq_put(s, 1, JTAG_SEQUENCE_TMS, 0);
+	for (uint i = 0; i < n - 1; i += 64) {
+		uint k = n - 1 - i < 64 ? n - 1 - i : 64;
+		seq_put(s, k, JTAG_SEQUENCE_TDO, bits_get(v, i, k));
+	}
+	seq_put(s, 2, JTAG_SEQUENCE_TMS | JTAG_SEQUENCE_TDO, bits_get(v, n - 1, 1));
+	seq_put(s, 1 + SCAN_IDLE, 0, 0);
+}
+
+// Non-batched accesses: the result (and status) of each op is collected by a
+// following nop scan, and waited for before the next op.
+static void dmi_read_sync(session_t *s, uint32_t addr) {
+	dmi_scan(s, DMI_OP_READ, addr, 0);
+	dmi_scan(s, DMI_OP_NONE, 0, 0);
+	session_flush(s);
+}
+
+static void dmi_write_sync(session_t *s, uint32_t addr, uint32_t data) {
+	dmi_scan(s, DMI_OP_WRITE, addr, data);
+	dmi_scan(s, DMI_OP_NONE, 0, 0);
+	session_flush(s);
+}
+
+// Access Register command, waiting for completion
+static void abstract_reg_read(session_t *s, uint regno) {
+	dmi_write_sync(s, DM_COMMAND, DM_COMMAND_TRANSFER | 2u << DM_COMMAND_AARSIZE_LSB | regno);
+	dmi_read_sync(s, DM_ABSTRACTCS);
+	dmi_read_sync(s, DM_DATA0);
+}
+
+#define REGNO_GPR(n) (0x1000u + (n))
+#define CSR_MSTATUS  0x300u
+#define CSR_MISA     0x301u
+#define CSR_MIE      0x304u
+#define CSR_MTVEC    0x305u
+#define CSR_MSCRATCH 0x340u
+#define CSR_MEPC     0x341u
+#define CSR_MCAUSE   0x342u
+#define CSR_MTVAL    0x343u
+#define CSR_MIP      0x344u
+#define CSR_DCSR     0x7b0u
+#define CSR_DPC      0x7b1u
+
+// OpenOCD "init; halt": TAP examination, DM activation and hart discovery,
+// then halting and reading the registers OpenOCD needs to examine the hart.
+static void build_init_halt(session_t *s) {
+	cur_tap = 0;
+	jtag_reset(s);
+	jtag_ir(s, IR_IDCODE);
+	jtag_dr32(s, 0);
+	session_flush(s);
+	jtag_ir(s, IR_DTMCS);
+	jtag_dr32(s, 0);
+	session_flush(s);
+	jtag_dr32(s, DTMCS_DMIRESET);
+	jtag_ir(s, IR_DMI);
+	session_flush(s);
+
+	dmi_write_sync(s, DM_DMCONTROL, 0);
+	dmi_write_sync(s, DM_DMCONTROL, DM_DMCONTROL_DMACTIVE);
+	dmi_read_sync(s, DM_DMCONTROL);
+	dmi_read_sync(s, DM_DMSTATUS);
+	// Find the number of hartsel bits
+	dmi_write_sync(s, DM_DMCONTROL, DM_DMCONTROL_DMACTIVE | 0x3ffu << 16 | 0x3ffu << 6);
+	dmi_read_sync(s, DM_DMCONTROL);
+	dmi_write_sync(s, DM_DMCONTROL, DM_DMCONTROL_DMACTIVE);
+	dmi_read_sync(s, DM_HARTINFO);
+	dmi_read_sync(s, DM_ABSTRACTCS);
+	dmi_read_sync(s, DM_SBCS);
+	dmi_read_sync(s, DM_DMSTATUS);
+	dmi_read_sync(s, DM_HALTSUM0);
+
+	dmi_write_sync(s, DM_DMCONTROL, DM_DMCONTROL_DMACTIVE | DM_DMCONTROL_HALTREQ);
+	dmi_read_sync(s, DM_DMSTATUS);
+	dmi_write_sync(s, DM_DMCONTROL, DM_DMCONTROL_DMACTIVE);
+	static const uint regs[] = {CSR_MISA, CSR_DCSR, CSR_DPC, REGNO_GPR(8), REGNO_GPR(9)};
+	for (uint i = 0; i < sizeof(regs) / sizeof(regs[0]); ++i)
+		abstract_reg_read(s, regs[i]);
+	session_flush(s);
+}
+
+// Read all GPRs and the commonly displayed CSRs ("reg" with no arguments)
+static void build_reg_read_all(session_t *s) {
+	for (uint i = 0; i < 32; ++i)
+		abstract_reg_read(s, REGNO_GPR(i));
+	static const uint csrs[] = {CSR_DPC, CSR_MSTATUS, CSR_MISA, CSR_MIE, CSR_MTVEC,
+		CSR_MSCRATCH, CSR_MEPC, CSR_MCAUSE, CSR_MTVAL, CSR_MIP, CSR_DCSR};
+	for (uint i = 0; i < sizeof(csrs) / sizeof(csrs[0]); ++i)
+		abstract_reg_read(s, csrs[i]);
+	session_flush(s);
+}
+
+// Running short programs from the program buffer, as OpenOCD does for CSRs
+// that abstract commands can't reach: upload the program, execute it with a
+// register transfer, then read back 64 bits of data. (The simulated DM has no
+// program buffer, so the uploads and commands fail, but the DMI traffic is
+// the same.)
+#define PROGBUF_WORDS 4u
+#define INSN_NOP      0x00000013u
+#define INSN_EBREAK   0x00100073u
+
+static void build_progbuf_exec(session_t *s) {
+	for (uint i = 0; i < 64; ++i) {
+		for (uint j = 0; j < PROGBUF_WORDS; ++j)
+			dmi_write_sync(s, DM_PROGBUF0 + j, j == PROGBUF_WORDS - 1 ? INSN_EBREAK : INSN_NOP);
+		dmi_write_sync(s, DM_COMMAND, DM_COMMAND_TRANSFER | DM_COMMAND_POSTEXEC |
+			2u << DM_COMMAND_AARSIZE_LSB | REGNO_GPR(8));
+		dmi_read_sync(s, DM_ABSTRACTCS);
+		dmi_read_sync(s, DM_DATA0);
+		dmi_read_sync(s, DM_DATA1);
+	}
+	session_flush(s);
+}
+
+// "dump_image" of the whole of memory via System Bus Access, with OpenOCD's
+// batched sbdata0 reads
+static void build_mem_dump(session_t *s) {
+	const uint32_t sbcs = 2u << DM_SBCS_SBACCESS_LSB | DM_SBCS_SBREADONADDR |
+		DM_SBCS_SBAUTOINCREMENT;
+	const uint n_words = MEM_SIZE / 4;
+	dmi_write_sync(s, DM_SBCS, sbcs | DM_SBCS_SBREADONDATA);
+	dmi_write_sync(s, DM_SBADDRESS0, MEM_BASE);
+	for (uint i = 0; i < n_words; ++i) {
+		// Don't start a bus read past the end of the dump
+		if (i == n_words - 1)
+			dmi_scan(s, DMI_OP_WRITE, DM_SBCS, sbcs);
+		dmi_scan(s, DMI_OP_READ, DM_SBDATA0, 0);
+		if ((i + 1) % SBA_BATCH == 0 || i == n_words - 1) {
+			dmi_scan(s, DMI_OP_READ, DM_SBCS, 0);
+			dmi_scan(s, DMI_OP_NONE, 0, 0);
+			session_flush(s);
+		}
+	}
+}
+
+// "load_image" of the whole of memory via System Bus Access, with OpenOCD's
+// batched sbdata0 writes
+static void build_mem_load(session_t *s) {
+	const uint32_t sbcs = 2u << DM_SBCS_SBACCESS_LSB | DM_SBCS_SBAUTOINCREMENT;
+	const uint n_words = MEM_SIZE / 4;
+	dmi_write_sync(s, DM_SBCS, sbcs);
+	dmi_write_sync(s, DM_SBADDRESS0, MEM_BASE);
+	for (uint i = 0; i < n_words; ++i) {
+		dmi_scan(s, DMI_OP_WRITE, DM_SBDATA0, i * 0x9e3779b9u);
+		if ((i + 1) % SBA_BATCH == 0 || i == n_words - 1) {
+			dmi_scan(s, DMI_OP_READ, DM_SBCS, 0);
+			dmi_scan(s, DMI_OP_NONE, 0, 0);
+			session_flush(s);
+		}
+	}
+}
+
+// OpenOCD polling each hart in turn, as it does in the background with one
+// target per TAP, each poll starting with an IR scan to select its DMI
+static void build_poll_all(session_t *s) {
+	for (uint i = 0; i < 64; ++i) {
+		for (cur_tap = 0; cur_tap < n_taps; ++cur_tap) {
+			jtag_ir(s, IR_DMI);
+			dmi_read_sync(s, DM_DMSTATUS);
+		}
+	}
+	cur_tap = 0;
+	jtag_ir(s, IR_DMI);
+	session_flush(s);
+}
+
+// Polling every hart at once, with the DMI selected in every TAP so that
+// each scan carries one access per TAP. OpenOCD doesn't do this, but it lets
+// a host drive DMs on different SWD ports in parallel.
+static void build_poll_par(session_t *s) {
+	cur_tap = ALL_TAPS;
+	jtag_ir(s, IR_DMI);
+	for (uint i = 0; i < 64; ++i)
+		dmi_read_sync(s, DM_DMSTATUS);
+	cur_tap = 0;
+	jtag_ir(s, IR_DMI);
+	session_flush(s);
+}
+
+static bool load_capture(session_t *s, const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+	uint8_t chunk[4096];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+		session_append(s, chunk, n);
+	fclose(f);
+	s->name = path;
+	return true;
+}
+
+// Session from a DMI capture (see dmi_capture_file.h): the DMI accesses the
+// probe made, as OpenOCD-style scans to the TAP that made them, with one
+// packet per batch. The write data is replayed, but the read data and status
+// come from the simulated DM. Batches which ran in parallel on the probe's
+// two cores are replayed one after the other.
+static bool load_dmi_capture(session_t *s, const char *path) {
+	uint32_t n;
+	dmi_capture_rec_t *recs = dmi_capture_load(path, &n);
+	if (!recs)
+		return false;
+	s->name = path;
+	uint32_t skipped = 0;
+	cur_tap = ALL_TAPS;
+	jtag_reset(s);
+	for (uint32_t i = 0; i < n; ++i) {
+		const dmi_capture_rec_t *rec = &recs[i];
+		uint type = rec->type & CAPTURE_TYPE_MASK;
+		if (type == CAPTURE_BATCH) {
+			session_flush(s);
+		} else if (type == CAPTURE_DMI && rec->tap >= n_taps) {
+			++skipped;
+		} else if (type == CAPTURE_DMI) {
+			if (rec->tap != cur_tap) {
+				cur_tap = rec->tap;
+				jtag_ir(s, IR_DMI);
+			}
+			uint op = rec->b & 0x3u;
+			dmi_scan(s, op, rec->a, op == DMI_OP_WRITE ? rec->data : 0);
+		}
+	}
+	dmi_scan(s, DMI_OP_NONE, 0, 0);
+	cur_tap = 0;
+	jtag_ir(s, IR_DMI);
+	session_flush(s);
+	free(recs);
+	if (skipped)
+		fprintf(stderr, "%s: skipped %lu accesses to TAPs past %u (see -t)\n",
+			path, (unsigned long)skipped, n_taps - 1);
+	return true;
+}
+
+// ----------------------------------------------------------------------------
+// Replay
+
+typedef struct {
+	uint64_t packets;
+	uint64_t fast_packets;
+	uint64_t slow_packets;
+	uint64_t skipped_packets;
+	uint64_t tck;
+	uint64_t host_ns;
+} replay_stats_t;
+
+// Returns the request length of a JTAG_Sequence packet, and adds up its TCK
+// cycles, or returns 0 if the packet is malformed.
+static uint parse_jtag_sequence(const uint8_t *req, uint len, uint64_t *tck) {
+	if (len < 2)
+		return 0;
+	uint pos = 2;
+	for (uint i = 0; i < req[1]; ++i) {
+		if (pos >= len)
+			return 0;
+		uint n = req[pos] & JTAG_SEQUENCE_TCK;
+		if (!n)
+			n = 64;
+		pos += 1 + (n + 7) / 8;
+		*tck += n;
+	}
+	return pos <= len ? pos : 0;
+}
+
+// Fallback for packets the recogniser doesn't handle, equivalent to
+// DAP_JTAG_Sequence() in DAP.c
+static void jtag_sequence_packet(const uint8_t *request, uint8_t *response) {
+	const uint8_t *req = request + 2;
+	uint8_t *resp = response + 2;
+	for (uint i = 0; i < request[1]; ++i) {
+		uint32_t info = *req++;
+		uint n = info & JTAG_SEQUENCE_TCK;
+		if (!n)
+			n = 64;
+		JTAG_Sequence(info, req, resp);
+		req += (n + 7) / 8;
+		if (info & JTAG_SEQUENCE_TDO)
+			resp += (n + 7) / 8;
+	}
+	response[0] = ID_DAP_JTAG_Sequence;
+	response[1] = DAP_OK;
+}
+
+static uint64_t time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static bool replay(const session_t *s, replay_stats_t *st) {
+	memset(st, 0, sizeof(*st));
+	// Check framing up front, so that the timed loop only does DAP work
+	for (size_t pos = 0; pos < s->len;) {
+		uint len = pos + 2 <= s->len ? s->buf[pos] | s->buf[pos + 1] << 8 : 0;
+		const uint8_t *req = s->buf + pos + 2;
+		if (len == 0 || len > DAP_PACKET_SIZE || pos + 2 + len > s->len) {
+			fprintf(stderr, "%s: bad packet length at offset %zu\n", s->name, pos);
+			return false;
+		}
+		if (req[0] == ID_DAP_JTAG_Sequence && !parse_jtag_sequence(req, len, &st->tck)) {
+			fprintf(stderr, "%s: malformed JTAG_Sequence at offset %zu\n", s->name, pos);
+			return false;
+		}
+		pos += 2 + len;
+	}
+
+	uint8_t request[DAP_PACKET_SIZE];
+	uint8_t response[DAP_PACKET_SIZE];
+	uint64_t t0 = time_ns();
+	for (size_t pos = 0; pos < s->len;) {
+		uint len = s->buf[pos] | s->buf[pos + 1] << 8;
+		memset(request, 0, sizeof(request));
+		memcpy(request, s->buf + pos + 2, len);
+		pos += 2 + len;
+		++st->packets;
+		if (vdtm_process_command(request, response)) {
+			++st->fast_packets;
+		} else if (request[0] == ID_DAP_JTAG_Sequence) {
+			jtag_sequence_packet(request, response);
+			++st->slow_packets;
+		} else {
+			++st->skipped_packets;
+		}
+	}
+	st->host_ns = time_ns() - t0;
+	return true;
+}
+
+// ----------------------------------------------------------------------------
+
+// One DM and DP per TAP, with the DPs of each SWD port on its own wire
+static sim_dm_t *dm[MAX_TAPS];
+static sim_swd_t *swd[MAX_TAPS];
+static uint n_ports = 1;
+static swd_link_port_t ports[MAX_TAPS];
+
+static const swd_link_ops_t *link = &sim_swd_link;
+
+static void report(const char *name, const replay_stats_t *st, uint64_t dmi_ops,
+		uint64_t swd_packets, uint64_t swclk, uint64_t swclk_busiest,
+		const swd_dmi_stats_t *dmi_stats) {
+	double secs = st->host_ns * 1e-9;
+	double per_op = dmi_ops ? 1.0 / dmi_ops : 0.0;
+	printf("%s (%s link):\n", name, link->name);
+	printf("  DAP:  %llu packets: %llu fast path, %llu bit-accurate, %llu skipped\n",
+		(unsigned long long)st->packets, (unsigned long long)st->fast_packets,
+		(unsigned long long)st->slow_packets, (unsigned long long)st->skipped_packets);
+	printf("  JTAG: %llu TCK cycles in %.3f ms host time, %.2f M TCK/s\n",
+		(unsigned long long)st->tck, secs * 1e3, secs > 0 ? st->tck / secs * 1e-6 : 0.0);
+	printf("  DMI:  %llu accesses at the DM, %.1f k DMI/s\n",
+		(unsigned long long)dmi_ops, secs > 0 ? dmi_ops / secs * 1e-3 : 0.0);
+	printf("  SWD:  %llu packets, %llu SWCLK cycles: %.2f packets and %.1f SWCLK per "
+		"DMI access, %.3f ms on the wire at %u kHz\n",
+		(unsigned long long)swd_packets, (unsigned long long)swclk,
+		swd_packets * per_op, swclk * per_op, (double)swclk_busiest / link->swclk_khz,
+		link->swclk_khz);
+	printf("        %lu WAIT, %lu FAULT, %lu retries, %lu DP switches, "
+		"idle cycles after DRW read %u write %u\n",
+		(unsigned long)dmi_stats->wait, (unsigned long)dmi_stats->fault,
+		(unsigned long)dmi_stats->retries, (unsigned long)dmi_stats->switches,
+		dmi_stats->idle_read, dmi_stats->idle_write);
+}
+
+// Counters summed over all TAPs, and the idle cycles of TAP 0
+static void get_dmi_stats(swd_dmi_stats_t *total) {
+	vdtm_get_dmi_stats(0, total);
+	for (uint i = 1; i < n_taps; ++i) {
+		swd_dmi_stats_t st;
+		vdtm_get_dmi_stats(i, &st);
+		total->wait += st.wait;
+		total->fault += st.fault;
+		total->retries += st.retries;
+		total->switches += st.switches;
+	}
+}
+
+static uint64_t dmi_access_count(void) {
+	uint64_t n = 0;
+	for (uint i = 0; i < n_taps; ++i)
+		n += sim_dm_get_access_count(dm[i]);
+	return n;
+}
+
+// Deselected DPs ignore packet headers until the next line reset, so add up
+// the packets seen by each. (A TARGETSEL is seen by all of them.)
+static uint64_t swd_packet_count(void) {
+	uint64_t n = 0;
+	for (uint i = 0; i < n_taps; ++i)
+		n += sim_swd_get_packet_count(swd[i]);
+	return n;
+}
+
+// Every DP on a wire sees every SWCLK cycle, so count those at the first DP
+// of each port
+static void swclk_counts(uint64_t *count) {
+	for (uint p = 0; p < n_ports; ++p)
+		count[p] = sim_swd_get_swclk_count(swd[p * (n_taps / n_ports)]);
+}
+
+// Total SWCLK cycles since the counts in start, and the most on any one port
+static uint64_t swclk_since(const uint64_t *start, uint64_t *busiest) {
+	uint64_t now[MAX_TAPS];
+	swclk_counts(now);
+	uint64_t total = 0;
+	*busiest = 0;
+	for (uint p = 0; p < n_ports; ++p) {
+		total += now[p] - start[p];
+		if (now[p] - start[p] > *busiest)
+			*busiest = now[p] - start[p];
+	}
+	return total;
+}
+
+static bool run(const session_t *s) {
+	uint64_t dmi_ops = dmi_access_count();
+	uint64_t swd_packets = swd_packet_count();
+	uint64_t swclk_start[MAX_TAPS];
+	swclk_counts(swclk_start);
+	swd_dmi_stats_t before, after;
+	get_dmi_stats(&before);
+	replay_stats_t st;
+	if (!replay(s, &st))
+		return false;
+	get_dmi_stats(&after);
+	after.wait -= before.wait;
+	after.fault -= before.fault;
+	after.retries -= before.retries;
+	after.switches -= before.switches;
+	uint64_t busiest;
+	uint64_t swclk = swclk_since(swclk_start, &busiest);
+	report(s->name, &st,
+		dmi_access_count() - dmi_ops,
+		swd_packet_count() - swd_packets,
+		swclk, busiest, &after);
+	return true;
+}
+
+// Write the records made on the host's only "core" to a DMI capture file
+static bool save_dmi_capture(const char *path) {
+	uint32_t head = dmi_capture_head(0);
+	uint32_t first = head > DMI_CAPTURE_SIZE ? head - DMI_CAPTURE_SIZE : 0;
+	dmi_capture_rec_t *recs = malloc((head - first + 1) * sizeof(dmi_capture_rec_t));
+	if (!recs) {
+		fprintf(stderr, "Out of memory\n");
+		return false;
+	}
+	for (uint32_t i = first; i < head; ++i)
+		(void)dmi_capture_get(0, i, &recs[i - first]);
+	uint32_t n[DMI_CAPTURE_CORES] = {head - first};
+	bool ok = dmi_capture_save(path, &recs, n, 1);
+	free(recs);
+	return ok;
+}
+
+static void run_connect(const char *name) {
+	uint64_t swd_packets = swd_packet_count();
+	uint64_t swclk_start[MAX_TAPS];
+	swclk_counts(swclk_start);
+	jtag_setup_vdtm();
+	uint64_t busiest;
+	uint64_t swclk = swclk_since(swclk_start, &busiest);
+	printf("%s (%s link):\n", name, link->name);
+	printf("  SWD:  %llu packets, %llu SWCLK cycles, %.3f ms on the wire at %u kHz\n",
+		(unsigned long long)(swd_packet_count() - swd_packets),
+		(unsigned long long)swclk, (double)busiest / link->swclk_khz, link->swclk_khz);
+}
+
+int main(int argc, char **argv) {
+	int argi = 1;
+	uint ap_latency = 0;
+	const char *replay_path = NULL;
+	const char *save_path = NULL;
+	while (argi + 1 < argc && argv[argi][0] == '-') {
+		if (!strcmp(argv[argi], "-l")) {
+			if (!strcmp(argv[argi + 1], "bitbang")) {
+				link = &swd_link_bitbang;
+			} else if (strcmp(argv[argi + 1], "sim")) {
+				fprintf(stderr, "Unknown link \"%s\" (expected sim or bitbang)\n", argv[argi + 1]);
+				return 1;
+			}
+		} else if (!strcmp(argv[argi], "-w")) {
+			ap_latency = strtoul(argv[argi + 1], NULL, 0);
+		} else if (!strcmp(argv[argi], "-t")) {
+			n_taps = strtoul(argv[argi + 1], NULL, 0);
+			if (n_taps < 1 || n_taps > MAX_TAPS) {
+				fprintf(stderr, "Number of TAPs must be 1 to %u\n", MAX_TAPS);
+				return 1;
+			}
+		} else if (!strcmp(argv[argi], "-p")) {
+			n_ports = strtoul(argv[argi + 1], NULL, 0);
+		} else if (!strcmp(argv[argi], "-r")) {
+			replay_path = argv[argi + 1];
+		} else if (!strcmp(argv[argi], "-c")) {
+			save_path = argv[argi + 1];
+		} else {
+			fprintf(stderr, "Unknown option \"%s\"\n", argv[argi]);
+			return 1;
+		}
+		argi += 2;
+	}
+
+	if (n_ports < 1 || n_taps % n_ports) {
+		fprintf(stderr, "Number of ports must divide the number of TAPs\n");
+		return 1;
+	}
+	uint taps_per_port = n_taps / n_ports;
+	void *port_ctx[MAX_TAPS];
+	for (uint p = 0; p < n_ports; ++p) {
+		ports[p] = (swd_link_port_t){
+			.pin_swclk = PIN_SWCLK + 2 * p,
+			.pin_swdio = PIN_SWDIO + 2 * p,
+			.sm = p
+		};
+		port_ctx[p] = &ports[p];
+	}
+
+	// A single DP doesn't need TARGETSEL. Every port has the same DPs.
+	uint32_t targetsel[MAX_TAPS] = {0};
+	for (uint t = 0; t < n_taps; ++t) {
+		if (taps_per_port > 1)
+			targetsel[t] = BENCH_TARGETSEL(t % taps_per_port);
+		dm[t] = sim_dm_create(MEM_BASE, MEM_SIZE);
+		swd[t] = dm[t] ? sim_swd_create(dm[t], targetsel[t]) : NULL;
+		if (!swd[t]) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		uint8_t *mem = sim_dm_get_mem(dm[t]);
+		for (uint i = 0; i < MEM_SIZE; ++i)
+			mem[i] = i * 7u + (i >> 8) + t;
+		sim_swd_attach(swd[t], ports[t / taps_per_port].pin_swclk,
+			ports[t / taps_per_port].pin_swdio);
+		sim_swd_set_ap_latency(swd[t], ap_latency);
+	}
+
+	DAP_Data.debug_port = DAP_PORT_JTAG;
+	DAP_Data.clock_delay = BENCH_CLOCK_DELAY;
+	DAP_Data.jtag_dev.count = n_taps;
+	for (uint t = 0; t < n_taps; ++t) {
+		DAP_Data.jtag_dev.ir_length[t] = IR_LEN;
+		DAP_Data.jtag_dev.ir_before[t] = t * IR_LEN;
+		DAP_Data.jtag_dev.ir_after[t] = (n_taps - 1 - t) * IR_LEN;
+	}
+	vdtm_set_swd_ports(link, port_ctx, n_ports);
+	vdtm_set_targetsel(targetsel, taps_per_port);
+	// The first setup finds the DPs dormant, and the second finds them already up
+	run_connect("connect_cold");
+	run_connect("connect_warm");
+
+	bool ok = true;
+	if (replay_path) {
+		session_t s = {0};
+		ok = load_dmi_capture(&s, replay_path) && run(&s);
+		free(s.buf);
+	} else if (argi < argc) {
+		for (int i = argi; i < argc; ++i) {
+			session_t s = {0};
+			ok = load_capture(&s, argv[i]) && run(&s) && ok;
+			free(s.buf);
+		}
+	} else {
+		static const struct {
+			const char *name;
+			void (*build)(session_t *s);
+		} builtin[] = {
+			{"init_halt",    build_init_halt},
+			{"reg_read_all", build_reg_read_all},
+			{"progbuf_exec", build_progbuf_exec},
+			{"mem_dump_64k", build_mem_dump},
+			{"mem_load_64k", build_mem_load},
+			{"poll_all",     build_poll_all},
+			{"poll_par",     build_poll_par},
+		};
+		for (uint i = 0; i < sizeof(builtin) / sizeof(builtin[0]); ++i) {
+			session_t s = {.name = builtin[i].name};
+			builtin[i].build(&s);
+			ok = run(&s) && ok;
+			free(s.buf);
+		}
+	}
+
+	if (save_path)
+		ok = save_dmi_capture(save_path) && ok;
+
+	for (uint t = 0; t < n_taps; ++t) {
+		sim_swd_destroy(swd[t]);
+		sim_dm_destroy(dm[t]);
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,829 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Unit tests for the virtual DTM against the simulated target: jtag_vdtm is
+// clocked bit by bit (or through the DMI scan fast path), and its DMI
+// accesses go through swd_dmi and sim_swd_link to a simulated Debug Module.
+//
+// Usage: vdtm_test [name...]
+//
+// Runs every test, or just the named ones. Exits nonzero if any fail. Run by
+// ctest.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dm_regs.h"
+#include "dmi_prefetch.h"
+#include "jtag_vdtm.h"
+#include "sim_dm.h"
+#include "sim_swd.h"
+#include "swd_dmi.h"
+#include "swd_link.h"
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		return false; \
+	} \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+	unsigned long long _a = (a), _b = (b); \
+	if (_a != _b) { \
+		fprintf(stderr, "%s:%d: check failed: %s == %s (%llx != %llx)\n", \
+			__FILE__, __LINE__, #a, #b, _a, _b); \
+		return false; \
+	} \
+} while (0)
+
+#define TEST_IDCODE 0xdeadbeefu
+
+#define MEM_BASE 0x20000000u
+#define MEM_SIZE 4096u
+
+#define IR_IDCODE 0x01u
+#define IR_DTMCS  0x10u
+#define IR_DMI    0x11u
+#define IR_LEN    5u
+
+#define DMI_LEN   42u
+
+#define DTMCS_DMISTAT_LSB  10
+#define DTMCS_DMIRESET     (1u << 16)
+#define DTMCS_DMIHARDRESET (1u << 17)
+
+// ----------------------------------------------------------------------------
+// Test rig: one virtual TAP in front of one simulated DP and DM, on its own
+// wire
+
+typedef struct {
+	sim_dm_t *dm;
+	sim_swd_t *swd;
+	swd_link_port_t port;
+	swd_dmi_t *dmi;
+	jtag_vdtm_t *dtm;
+	// With deferred set, DMI batches are only run by rig_finish(), as though
+	// core 1 were still working on them. The DTM sees busy until then.
+	bool deferred;
+	jtag_vdtm_dmi_access_t *pending;
+	uint n_pending;
+	// Batches submitted while the previous one was still pending
+	uint overlaps;
+} rig_t;
+
+static void rig_run(rig_t *r, jtag_vdtm_dmi_access_t *accesses, uint n) {
+	for (uint i = 0; i < n; ++i) {
+		jtag_vdtm_dmi_access_t *a = &accesses[i];
+		int rc = a->op == DMI_OP_WRITE ? swd_dmi_write(r->dmi, a->addr, a->data) :
+			swd_dmi_read(r->dmi, a->addr, &a->data);
+		a->status = rc ? DMI_STATUS_FAILED : DMI_STATUS_OK;
+		if (rc)
+			break;
+	}
+}
+
+static void rig_dmi_callback(void *user, jtag_vdtm_dmi_access_t *accesses, uint n) {
+	rig_t *r = user;
+	if (r->pending)
+		++r->overlaps;
+	if (r->deferred) {
+		r->pending = accesses;
+		r->n_pending = n;
+	} else {
+		rig_run(r, accesses, n);
+	}
+}
+
+static jtag_vdtm_dmi_status_t rig_status_callback(void *user) {
+	rig_t *r = user;
+	return r->pending ? DMI_STATUS_BUSY : DMI_STATUS_OK;
+}
+
+// Let the pending batch, if any, complete
+static void rig_finish(rig_t *r) {
+	if (r->pending)
+		rig_run(r, r->pending, r->n_pending);
+	r->pending = NULL;
+}
+
+static bool rig_create(rig_t *r, uint index) {
+	memset(r, 0, sizeof(*r));
+	r->port = (swd_link_port_t){
+		.pin_swclk = 2 + 2 * index,
+		.pin_swdio = 3 + 2 * index,
+		.sm = index
+	};
+	r->dm = sim_dm_create(MEM_BASE, MEM_SIZE);
+	r->swd = r->dm ? sim_swd_create(r->dm, 0) : NULL;
+	r->dmi = swd_dmi_create(&sim_swd_link, &r->port, 0, 0);
+	r->dtm = jtag_vdtm_create(TEST_IDCODE);
+	CHECK(r->swd && r->dmi && r->dtm);
+	sim_swd_attach(r->swd, r->port.pin_swclk, r->port.pin_swdio);
+	int rc = 1;
+	for (uint i = 0; i < 3 && rc; ++i)
+		rc = swd_dmi_connect(r->dmi);
+	CHECK_EQ(rc, 0);
+	jtag_vdtm_set_dmi_callback(r->dtm, rig_dmi_callback, r);
+	jtag_vdtm_set_status_callback(r->dtm, rig_status_callback);
+	return true;
+}
+
+static void rig_destroy(rig_t *r) {
+	jtag_vdtm_destroy(r->dtm);
+	swd_dmi_destroy(r->dmi);
+	sim_swd_destroy(r->swd);
+	sim_dm_destroy(r->dm);
+}
+
+// ----------------------------------------------------------------------------
+// JTAG, one TCK at a time
+
+static bool clock_tck(jtag_vdtm_t *dtm, bool tms, bool tdi) {
+	jtag_vdtm_set_tck(dtm, false);
+	jtag_vdtm_set_tms(dtm, tms);
+	jtag_vdtm_set_tdi(dtm, tdi);
+	bool tdo = jtag_vdtm_get_tdo(dtm);
+	jtag_vdtm_set_tck(dtm, true);
+	return tdo;
+}
+
+// Test-Logic-Reset, then Run-Test/Idle
+static void jtag_reset(jtag_vdtm_t *dtm) {
+	for (uint i = 0; i < 5; ++i)
+		clock_tck(dtm, true, false);
+	clock_tck(dtm, false, false);
+}
+
+// Shift through Shift-xR from Run-Test/Idle and back, returning what came out
+static uint64_t jtag_scan(jtag_vdtm_t *dtm, bool ir, uint64_t in, uint len) {
+	clock_tck(dtm, true, false);
+	if (ir)
+		clock_tck(dtm, true, false);
+	clock_tck(dtm, false, false);
+	clock_tck(dtm, false, false);
+	uint64_t out = 0;
+	for (uint i = 0; i < len; ++i)
+		out |= (uint64_t)clock_tck(dtm, i == len - 1, (in >> i) & 1u) << i;
+	clock_tck(dtm, true, false);
+	clock_tck(dtm, false, false);
+	return out;
+}
+
+static void jtag_ir(jtag_vdtm_t *dtm, uint ir) {
+	(void)jtag_scan(dtm, true, ir, IR_LEN);
+}
+
+static inline uint64_t dmi_dr(uint op, uint addr, uint32_t data) {
+	return (uint64_t)addr << 34 | (uint64_t)data << 2 | op;
+}
+
+// One DMI scan with IR=DMI selected. Returns the captured op/status and
+// data, as {status, data}.
+static uint64_t dmi_scan(jtag_vdtm_t *dtm, uint op, uint addr, uint32_t data) {
+	return jtag_scan(dtm, false, dmi_dr(op, addr, data), DMI_LEN) & ((1ull << 34) - 1);
+}
+
+#define SCAN_STATUS(x) ((uint)((x) & 0x3u))
+#define SCAN_DATA(x)   ((uint32_t)((x) >> 2))
+
+static uint32_t dtmcs_scan(jtag_vdtm_t *dtm, uint32_t in) {
+	jtag_ir(dtm, IR_DTMCS);
+	uint32_t dtmcs = (uint32_t)jtag_scan(dtm, false, in, 32);
+	jtag_ir(dtm, IR_DMI);
+	return dtmcs;
+}
+
+static uint dtmcs_dmistat(jtag_vdtm_t *dtm) {
+	return (dtmcs_scan(dtm, 0) >> DTMCS_DMISTAT_LSB) & 0x3u;
+}
+
+// ----------------------------------------------------------------------------
+// Tests
+
+static bool test_connect(void) {
+	rig_t r;
+	CHECK(rig_create(&r, 0));
+	uint32_t dmstatus = 0;
+	CHECK_EQ(swd_dmi_read(r.dmi, DM_DMSTATUS, &dmstatus), 0);
+	CHECK_EQ(dmstatus & 0xfu, DM_DMSTATUS_VERSION_0_13);
+	jtag_reset(r.dtm);
+	CHECK_EQ(jtag_scan(r.dtm, false, 0, 32), TEST_IDCODE);
+	jtag_ir(r.dtm, IR_IDCODE);
+	CHECK_EQ(jtag_scan(r.dtm, false, 0, 32), TEST_IDCODE);
+	// version 1 (0.13), abits 8
+	uint32_t dtmcs = dtmcs_scan(r.dtm, 0);
+	CHECK_EQ(dtmcs & 0x3ffu, 0x081u);
+	rig_destroy(&r);
+	return true;
+}
+
+static bool test_dmi_rw(void) {
+	rig_t r;
+	CHECK(rig_create(&r, 0));
+	jtag_reset(r.dtm);
+	jtag_ir(r.dtm, IR_DMI);
+	(void)dmi_scan(r.dtm, DMI_OP_WRITE, DM_DATA0, 0x12345678u);
+	(void)dmi_scan(r.dtm, DMI_OP_WRITE, DM_DATA1, 0x9abcdef0u);
+	CHECK_EQ(sim_dm_read(r.dm, DM_DATA0), 0x12345678u);
+	uint64_t x = dmi_scan(r.dtm, DMI_OP_READ, DM_DATA0, 0);
+	CHECK_EQ(SCAN_STATUS(x), DMI_STATUS_OK);
+	x = dmi_scan(r.dtm, DMI_OP_READ, DM_DATA1, 0);
+	CHECK_EQ(SCAN_STATUS(x), DMI_STATUS_OK);
+	CHECK_EQ(SCAN_DATA(x), 0x12345678u);
+	x = dmi_scan(r.dtm, DMI_OP_NONE, 0, 0);
+	CHECK_EQ(SCAN_STATUS(x), DMI_STATUS_OK);
+	CHECK_EQ(SCAN_DATA(x), 0x9abcdef0u);
+	x = dmi_scan(r.dtm, DMI_OP_READ, DM_DMSTATUS, 0);
+	x = dmi_scan(r.dtm, DMI_OP_NONE, 0, 0);
+	CHECK_EQ(SCAN_DATA(x) & 0xfu, DM_DMSTATUS_VERSION_0_13);
+	rig_destroy(&r);
+	return true;
+}
+
+static bool test_busy_dmireset(void) {
+	rig_t r;
+	CHECK(rig_create(&r, 0));
+	r.deferred = true;
+	jtag_reset(r.dtm);
+	jtag_ir(r.dtm, IR_DMI);
+	(void)dmi_scan(r.dtm, DMI_OP_WRITE, DM_DATA0, 0x11111111u);
+	// Still in flight: busy, and further ops are ignored until dmireset
+	uint64_t x = dmi_scan(r.dtm, DMI_OP_WRITE, DM_DATA0, 0x22222222u);
+	CHECK_EQ(SCAN_STATUS(x), DMI_STATUS_BUSY);
+	CHECK_EQ(dtmcs_dmistat(r.dtm), DMI_STATUS_BUSY);
+	rig_finish(&r);
+	CHECK_EQ(sim_dm_read(r.dm, DM_DATA0), 0x11111111u);
+	// Sticky, even though the access has now completed
+	CHECK_EQ(dtmcs_dmistat(r.dtm), DMI_STATUS_BUSY);
+	(void)dtmcs_scan(r.dtm, DTMCS_DMIRESET);
+	CHECK_EQ(dtmcs_dmistat(r.dtm), DMI_STATUS_OK);
+	// Retry the ignored write, then read back
+	(void)dmi_scan(r.dtm, DMI_OP_WRITE, DM_DATA0, 0x22222222u);
+	rig_finish(&r);
+	(void)dmi_scan(r.dtm, DMI_OP_READ, DM_DATA0, 0);
+	rig_finish(&r);
+	x = dmi_scan(r.dtm, DMI_OP_NONE, 0, 0);
+	CHECK_EQ(SCAN_STATUS(x), DMI_STATUS_OK);
+	CHECK_EQ(SCAN_DATA(x), 0x22222222u);
+	CHECK_EQ(r.overlaps, 0);
+	rig_destroy(&r);
+	return true;
+}
+
+// The fast path must capture exactly what the same scans clocked through the
+// TAP would
+static bool test_batch_scan(void) {
+	static const struct {
+		uint op;
+		uint addr;
+		uint32_t data;
+	} scans[] = {
+		{DMI_OP_WRITE, DM_DATA0,    0xcafef00du},
+		{DMI_OP_WRITE, DM_DATA1,    0x0badf00du},
+		{DMI_OP_READ,  DM_DATA0,    0},
+		{DMI_OP_NONE,  0,           0},
+		{DMI_OP_READ,  DM_DATA1,    0},
+		{DMI_OP_READ,  DM_DMSTATUS, 0},
+		{DMI_OP_WRITE, DM_DATA0,    0x5a5a5a5au},
+		{DMI_OP_READ,  DM_DATA0,    0},
+		{DMI_OP_NONE,  0,           0},
+	};
+	const uint n = sizeof(scans) / sizeof(scans[0]);
+	rig_t bit, fast;
+	CHECK(rig_create(&bit, 0));
+	CHECK(rig_create(&fast, 1));
+	jtag_reset(bit.dtm);
+	jtag_ir(bit.dtm, IR_DMI);
+	jtag_reset(fast.dtm);
+	jtag_ir(fast.dtm, IR_DMI);
+	CHECK(jtag_vdtm_can_scan_dmi(fast.dtm));
+
+	uint64_t dr_in[JTAG_VDTM_DMI_BATCH_MAX];
+	uint64_t dr_out[JTAG_VDTM_DMI_BATCH_MAX];
+	for (uint i = 0; i < n; ++i)
+		dr_in[i] = dmi_dr(scans[i].op, scans[i].addr, scans[i].data);
+	jtag_vdtm_scan_dmi_batch(fast.dtm, dr_in, dr_out, n);
+	for (uint i = 0; i < n; ++i) {
+		uint64_t x = dmi_scan(bit.dtm, scans[i].op, scans[i].addr, scans[i].data);
+		CHECK_EQ(dr_out[i] & ((1ull << 34) - 1), x);
+	}
+	CHECK_EQ(sim_dm_get_access_count(fast.dm), sim_dm_get_access_count(bit.dm));
+	CHECK_EQ(sim_dm_read(fast.dm, DM_DATA0), 0x5a5a5a5au);
+	// Carries on from where the batch left off on the bit-accurate path
+	uint64_t x = dmi_scan(fast.dtm, DMI_OP_NONE, 0, 0);
+	CHECK_EQ(SCAN_DATA(x), 0x5a5a5a5au);
+	rig_destroy(&bit);
+	rig_destroy(&fast);
+	return true;
+}
+
+// A fast-path scan while a bit-accurate access is still in flight must not
+// forget that access, or a retry after dmireset would reuse its slot while
+// the backend still owns it
+static bool test_batch_while_busy(void) {
+	rig_t r;
+	CHECK(rig_create(&r, 0));
+	r.deferred = true;
+	jtag_reset(r.dtm);
+	jtag_ir(r.dtm, IR_DMI);
+	(void)dmi_scan(r.dtm, DMI_OP_WRITE, DM_DATA0, 0x11111111u);
+	uint64_t dr_in[2] = {
+		dmi_dr(DMI_OP_WRITE, DM_DATA1, 0x22222222u),
+		dmi_dr(DMI_OP_NONE, 0, 0)
+	};
+	uint64_t dr_out[2];
+	jtag_vdtm_scan_dmi_batch(r.dtm, dr_in, dr_out, 2);
+	CHECK_EQ(SCAN_STATUS(dr_out[0]), DMI_STATUS_BUSY);
+	CHECK_EQ(SCAN_STATUS(dr_out[1]), DMI_STATUS_BUSY);
+	(void)dtmcs_scan(r.dtm, DTMCS_DMIRESET);
+	// The first write is still going, so the retry is busy too
+	uint64_t x = dmi_scan(r.dtm, DMI_OP_WRITE, DM_DATA1, 0x22222222u);
+	CHECK_EQ(SCAN_STATUS(x), DMI_STATUS_BUSY);
+	CHECK_EQ(r.overlaps, 0);
+	rig_finish(&r);
+	// The fast path waits for its own batch, so complete it straight away
+	r.deferred = false;
+	(void)dtmcs_scan(r.dtm, DTMCS_DMIRESET);
+	jtag_vdtm_scan_dmi_batch(r.dtm, dr_in, dr_out, 2);
+	CHECK_EQ(SCAN_STATUS(dr_out[0]), DMI_STATUS_OK);
+	CHECK_EQ(SCAN_STATUS(dr_out[1]), DMI_STATUS_OK);
+	CHECK_EQ(r.overlaps, 0);
+	CHECK_EQ(sim_dm_read(r.dm, DM_DATA0), 0x11111111u);
+	CHECK_EQ(sim_dm_read(r.dm, DM_DATA1), 0x22222222u);
+	rig_destroy(&r);
+	return true;
+}
+
+// Sequential DMI accesses from 0xff to 0x00 cross the end of the AP's 1 kB
+// TAR block, where the sim carries rather than wraps
+static bool test_tar_block_end(void) {
+	rig_t r;
+	CHECK(rig_create(&r, 0));
+	for (uint32_t addr = 0xfd; addr <= 0xff; ++addr)
+		CHECK_EQ(swd_dmi_write(r.dmi, addr, 0), 0);
+	for (uint32_t addr = 0; addr <= DM_DATA0; ++addr)
+		CHECK_EQ(swd_dmi_write(r.dmi, addr, addr == DM_DATA0 ? 0x600df00du : 0), 0);
+	CHECK_EQ(sim_dm_read(r.dm, DM_DATA0), 0x600df00du);
+	rig_destroy(&r);
+	return true;
+}
+
+// A System Bus Access stream as OpenOCD reads memory, through dmi_prefetch
+// with idle time before each access, as core 1 has between batches. With
+// prefetch on, the host's sbdata0 reads cost no SWD packets, and stopping the
+// stream leaves the DM where the host expects it.
+#define PREFETCH_WORDS 8u
+
+static bool prefetch_stream(bool enable, uint32_t *read_packets, uint32_t *result) {
+	rig_t r;
+	CHECK(rig_create(&r, 0));
+	uint8_t *mem = sim_dm_get_mem(r.dm);
+	for (uint i = 0; i < 4 * (PREFETCH_WORDS + 2); ++i)
+		mem[i] = i * 7 + 1;
+	dmi_prefetch_t *pf = dmi_prefetch_create(r.dmi);
+	CHECK(pf);
+	dmi_prefetch_set_enabled(pf, enable);
+	const uint32_t sbcs = 2u << DM_SBCS_SBACCESS_LSB;
+	CHECK_EQ(dmi_prefetch_write(pf, DM_SBCS, sbcs | DM_SBCS_SBREADONADDR |
+		DM_SBCS_SBREADONDATA | DM_SBCS_SBAUTOINCREMENT), 0);
+	CHECK_EQ(dmi_prefetch_write(pf, DM_SBADDRESS0, MEM_BASE), 0);
+	*read_packets = 0;
+	for (uint i = 0; i < PREFETCH_WORDS; ++i) {
+		dmi_prefetch_idle(pf);
+		uint64_t before = sim_swd_get_packet_count(r.swd);
+		uint32_t data;
+		CHECK_EQ(dmi_prefetch_read(pf, DM_SBDATA0, &data), 0);
+		*read_packets += sim_swd_get_packet_count(r.swd) - before;
+		uint32_t expect;
+		memcpy(&expect, mem + 4 * i, 4);
+		CHECK_EQ(data, expect);
+	}
+	dmi_prefetch_idle(pf);
+	CHECK_EQ(dmi_prefetch_write(pf, DM_SBCS, sbcs), 0);
+	CHECK_EQ(dmi_prefetch_read(pf, DM_SBCS, &result[0]), 0);
+	CHECK_EQ(dmi_prefetch_read(pf, DM_SBADDRESS0, &result[1]), 0);
+	CHECK_EQ(dmi_prefetch_read(pf, DM_SBDATA0, &result[2]), 0);
+	dmi_prefetch_destroy(pf);
+	rig_destroy(&r);
+	return true;
+}
+
+static bool test_prefetch(void) {
+	uint32_t packets_off, packets_on;
+	uint32_t result_off[3], result_on[3];
+	CHECK(prefetch_stream(false, &packets_off, result_off));
+	CHECK(prefetch_stream(true, &packets_on, result_on));
+	CHECK(packets_off >= PREFETCH_WORDS);
+	CHECK_EQ(packets_on, 0);
+	CHECK_EQ(result_on[0], result_off[0]);
+	CHECK_EQ(result_on[1], result_off[1]);
+	CHECK_EQ(result_on[2], result_off[2]);
+	CHECK_EQ(result_off[1], MEM_BASE + 4 * (PREFETCH_WORDS + 1));
+	return true;
+}
+
+// Write bursts run with ORUNDETECT set, so after a WAIT, or a write with bad
+// data parity, the DP FAULTs the rest of the burst. swd_dmi_write_burst()
+// must find the first word the DM did not take from CTRL/STAT, and replay
+// from there at the right address. A stream into sbdata0 would show a word
+// written twice or skipped, and an incrementing burst ending on data0 and
+// data1 would show the replay starting at the wrong address.
+#define BURST_WORDS   16u
+#define BURST_FAIL_AT 6u
+
+static bool write_burst_replay(bool wdataerr, bool incr) {
+	rig_t r;
+	CHECK(rig_create(&r, 0));
+	uint32_t addr = incr ? DM_DATA1 - 3 : DM_SBDATA0;
+	uint n = incr ? 4 : BURST_WORDS;
+	uint fail_at = incr ? 2 : BURST_FAIL_AT;
+	uint32_t data[BURST_WORDS];
+	for (uint i = 0; i < n; ++i)
+		data[i] = 0x5a000000u + i * 0x10101u;
+	CHECK_EQ(swd_dmi_write(r.dmi, DM_SBCS, 2u << DM_SBCS_SBACCESS_LSB | DM_SBCS_SBAUTOINCREMENT), 0);
+	CHECK_EQ(swd_dmi_write(r.dmi, DM_SBADDRESS0, MEM_BASE), 0);
+	// Both make word fail_at the first one the DM does not see
+	if (wdataerr)
+		sim_swd_inject_wdataerr(r.swd, fail_at + 1);
+	else
+		sim_swd_inject_wait(r.swd, fail_at, 200);
+	uint32_t accesses = sim_dm_get_access_count(r.dm);
+	CHECK_EQ(swd_dmi_write_burst(r.dmi, addr, data, n, incr), n);
+	CHECK_EQ(sim_dm_get_access_count(r.dm) - accesses, n);
+
+	swd_dmi_stats_t stats;
+	swd_dmi_get_stats(r.dmi, &stats);
+	CHECK(stats.retries >= 1);
+	if (incr) {
+		CHECK_EQ(sim_dm_read(r.dm, DM_DATA0), data[2]);
+		CHECK_EQ(sim_dm_read(r.dm, DM_DATA1), data[3]);
+	} else {
+		const uint8_t *mem = sim_dm_get_mem(r.dm);
+		for (uint i = 0; i < n; ++i) {
+			uint32_t word;
+			memcpy(&word, mem + 4 * i, 4);
+			CHECK_EQ(word, data[i]);
+		}
+	}
+	// The sticky flags have been cleared
+	uint32_t sbaddress;
+	CHECK_EQ(swd_dmi_read(r.dmi, DM_SBADDRESS0, &sbaddress), 0);
+	CHECK_EQ(sbaddress, MEM_BASE + (incr ? 0 : 4 * n));
+	rig_destroy(&r);
+	return true;
+}
+
+static bool test_burst_wait(void) {
+	CHECK(write_burst_replay(false, false));
+	CHECK(write_burst_replay(false, true));
+	return true;
+}
+
+static bool test_burst_wdataerr(void) {
+	CHECK(write_burst_replay(true, false));
+	CHECK(write_burst_replay(true, true));
+	return true;
+}
+
+// A DM on a slow clock, which keeps the AP busy after every DRW access. The
+// first accesses get WAITs and are retried. swd_dmi learns to idle long
+// enough after each access, then the WAITs stop and the idle counts stay
+// put, without going much past what the latency needs. (The counts only
+// decay after IDLE_DECAY_PERIOD accesses, more than this test makes.)
+#define SLOW_AP_LATENCY 100u
+#define SLOW_AP_ROUNDS  8u
+#define SLOW_AP_WORDS   16u
+
+static bool test_slow_ap(void) {
+	rig_t r;
+	CHECK(rig_create(&r, 0));
+	sim_swd_set_ap_latency(r.swd, SLOW_AP_LATENCY);
+	swd_dmi_stats_t stats[SLOW_AP_ROUNDS];
+	swd_dmi_get_stats(r.dmi, &stats[0]);
+	CHECK_EQ(stats[0].idle_read, 0);
+	CHECK_EQ(stats[0].idle_write, 0);
+	for (uint round = 0; round < SLOW_AP_ROUNDS; ++round) {
+		for (uint i = 0; i < SLOW_AP_WORDS; ++i) {
+			uint32_t wdata = round << 16 | i;
+			uint32_t rdata;
+			CHECK_EQ(swd_dmi_write(r.dmi, DM_DATA0, wdata), 0);
+			CHECK_EQ(swd_dmi_read(r.dmi, DM_DATA0, &rdata), 0);
+			CHECK_EQ(rdata, wdata);
+		}
+		swd_dmi_get_stats(r.dmi, &stats[round]);
+	}
+	CHECK(stats[0].retries > 0);
+	CHECK(stats[0].idle_read > 0);
+	CHECK(stats[0].idle_write > 0);
+	for (uint round = 1; round < SLOW_AP_ROUNDS; ++round) {
+		CHECK_EQ(stats[round].retries, stats[0].retries);
+		CHECK_EQ(stats[round].idle_read, stats[0].idle_read);
+		CHECK_EQ(stats[round].idle_write, stats[0].idle_write);
+	}
+	CHECK(stats[0].idle_read <= 2 * SLOW_AP_LATENCY);
+	CHECK(stats[0].idle_write <= 2 * SLOW_AP_LATENCY);
+	rig_destroy(&r);
+	return true;
+}
+
+// Consecutive posted reads cost one SWD packet each, plus one RDBUFF read to
+// collect the last, rather than two each. Each result must land in the right
+// place: reading an sbdata0 stream, every read returns a different word.
+// Packets are counted from the third read on: by then the repeated address
+// has turned off TAR auto-increment, and TAR and CSW are left alone.
+#define POSTED_WORDS 8u
+
+static bool read_stream(rig_t *r, bool posted, uint32_t *packets, uint32_t *data) {
+	CHECK_EQ(swd_dmi_write(r->dmi, DM_SBCS, 2u << DM_SBCS_SBACCESS_LSB |
+		DM_SBCS_SBREADONADDR | DM_SBCS_SBREADONDATA | DM_SBCS_SBAUTOINCREMENT), 0);
+	CHECK_EQ(swd_dmi_write(r->dmi, DM_SBADDRESS0, MEM_BASE), 0);
+	uint64_t before = 0;
+	for (uint i = 0; i < POSTED_WORDS; ++i) {
+		if (posted)
+			CHECK_EQ(swd_dmi_read_posted(r->dmi, DM_SBDATA0, &data[i]), 0);
+		else
+			CHECK_EQ(swd_dmi_read(r->dmi, DM_SBDATA0, &data[i]), 0);
+		if (i == 1)
+			before = sim_swd_get_packet_count(r->swd);
+	}
+	CHECK_EQ(swd_dmi_flush(r->dmi), 0);
+	*packets = sim_swd_get_packet_count(r->swd) - before;
+	return true;
+}
+
+static bool test_posted_reads(void) {
+	rig_t r;
+	CHECK(rig_create(&r, 0));
+	uint8_t *mem = sim_dm_get_mem(r.dm);
+	for (uint i = 0; i < 4 * POSTED_WORDS; ++i)
+		mem[i] = i * 13 + 5;
+	uint32_t packets_plain, packets_posted;
+	uint32_t plain[POSTED_WORDS], posted[POSTED_WORDS];
+	CHECK(read_stream(&r, false, &packets_plain, plain));
+	CHECK(read_stream(&r, true, &packets_posted, posted));
+	for (uint i = 0; i < POSTED_WORDS; ++i) {
+		uint32_t expect;
+		memcpy(&expect, mem + 4 * i, 4);
+		CHECK_EQ(plain[i], expect);
+		CHECK_EQ(posted[i], expect);
+	}
+	CHECK_EQ(packets_plain, 2 * (POSTED_WORDS - 2));
+	CHECK_EQ(packets_posted, POSTED_WORDS - 1);
+	rig_destroy(&r);
+	return true;
+}
+
+// Connecting gets cheaper at each tier. From dormant (as the rig's first
+// connection is), the wake-up sequence is needed. A DP already in SWD mode
+// answers a plain line reset. The same DP, still powered up, also skips the
+// power-up handshake and AP identification. The link must still work after a
+// warm reconnect.
+static bool test_warm_reconnect(void) {
+	rig_t r;
+	CHECK(rig_create(&r, 0));
+	uint64_t dormant = sim_swd_get_swclk_count(r.swd);
+	// A new DMI on the same wire has never connected
+	swd_dmi_t *dmi = swd_dmi_create(&sim_swd_link, &r.port, 0, 0);
+	CHECK(dmi);
+	uint64_t before = sim_swd_get_swclk_count(r.swd);
+	CHECK_EQ(swd_dmi_connect(dmi), 0);
+	uint64_t cold = sim_swd_get_swclk_count(r.swd) - before;
+	CHECK_EQ(swd_dmi_write(dmi, DM_DATA0, 0x1234u), 0);
+
+	before = sim_swd_get_swclk_count(r.swd);
+	CHECK_EQ(swd_dmi_connect(dmi), 0);
+	uint64_t warm = sim_swd_get_swclk_count(r.swd) - before;
+	CHECK(cold < dormant);
+	CHECK(warm < cold);
+	uint32_t data;
+	CHECK_EQ(swd_dmi_read(dmi, DM_DATA0, &data), 0);
+	CHECK_EQ(data, 0x1234u);
+	CHECK_EQ(swd_dmi_write(dmi, DM_DATA1, 0x5678u), 0);
+	CHECK_EQ(sim_dm_read(r.dm, DM_DATA1), 0x5678u);
+	swd_dmi_destroy(dmi);
+	rig_destroy(&r);
+	return true;
+}
+
+// Two DPs with different TARGETSELs on one wire, each in front of its own
+// DM. Alternating between their DMIs must reach the right DM every time,
+// with a switch each time, and a posted read on one must be collected before
+// the other DP is selected.
+#define MULTIDROP_TARGETSEL0 0x01002927u
+#define MULTIDROP_TARGETSEL1 0x11002927u
+
+static bool test_multidrop(void) {
+	swd_link_port_t port = {.pin_swclk = 2, .pin_swdio = 3, .sm = 0};
+	sim_dm_t *dm[2];
+	sim_swd_t *swd[2];
+	swd_dmi_t *dmi[2];
+	const uint32_t targetsel[2] = {MULTIDROP_TARGETSEL0, MULTIDROP_TARGETSEL1};
+	for (uint i = 0; i < 2; ++i) {
+		dm[i] = sim_dm_create(MEM_BASE, MEM_SIZE);
+		swd[i] = dm[i] ? sim_swd_create(dm[i], targetsel[i]) : NULL;
+		CHECK(swd[i]);
+		sim_swd_attach(swd[i], port.pin_swclk, port.pin_swdio);
+	}
+	dmi[0] = swd_dmi_create(&sim_swd_link, &port, targetsel[0], 0);
+	CHECK(dmi[0]);
+	dmi[1] = swd_dmi_create_shared(dmi[0], targetsel[1], 0);
+	CHECK(dmi[1]);
+	for (uint i = 0; i < 2; ++i) {
+		int rc = 1;
+		for (uint j = 0; j < 3 && rc; ++j)
+			rc = swd_dmi_connect(dmi[i]);
+		CHECK_EQ(rc, 0);
+	}
+
+	swd_dmi_stats_t stats[2];
+	uint32_t switches[2];
+	for (uint i = 0; i < 2; ++i) {
+		swd_dmi_get_stats(dmi[i], &stats[i]);
+		switches[i] = stats[i].switches;
+	}
+	for (uint round = 0; round < 4; ++round) {
+		for (uint i = 0; i < 2; ++i)
+			CHECK_EQ(swd_dmi_write(dmi[i], DM_DATA0, round << 8 | i), 0);
+		for (uint i = 0; i < 2; ++i)
+			CHECK_EQ(sim_dm_read(dm[i], DM_DATA0), round << 8 | i);
+	}
+	uint32_t posted;
+	uint32_t data;
+	CHECK_EQ(swd_dmi_read_posted(dmi[0], DM_DATA0, &posted), 0);
+	CHECK_EQ(swd_dmi_read(dmi[1], DM_DATA0, &data), 0);
+	CHECK_EQ(posted, 3u << 8 | 0);
+	CHECK_EQ(data, 3u << 8 | 1);
+	// dmi[1] was selected last by its connect, so the first round starts
+	// with a switch to dmi[0]
+	for (uint i = 0; i < 2; ++i) {
+		swd_dmi_get_stats(dmi[i], &stats[i]);
+		CHECK_EQ(stats[i].switches - switches[i], 5);
+	}
+
+	for (uint i = 0; i < 2; ++i) {
+		swd_dmi_destroy(dmi[i]);
+		sim_swd_destroy(swd[i]);
+		sim_dm_destroy(dm[i]);
+	}
+	return true;
+}
+
+// Every (state, TMS byte) entry of jtag_vdtm_shift()'s table against eight
+// steps of the reference state machine. Run-Test/Idle, Pause-DR and Pause-IR
+// are idle states. Test-Logic-Reset and the Capture, Shift and Update states
+// have side effects, so the table must not let a byte skip past them.
+static bool test_tap_fsm_lut(void) {
+	const uint16_t idle_states = 1u << 1 | 1u << 6 | 1u << 13;
+	const uint16_t event_states = 1u << 0 | 1u << 3 | 1u << 4 | 1u << 8 |
+		1u << 10 | 1u << 11 | 1u << 15;
+	for (uint state = 0; state < 16; ++state) {
+		for (uint tms = 0; tms < 256; ++tms) {
+			uint s = state;
+			uint expect_idle = 0;
+			bool expect_events = false;
+			for (uint i = 0; i < 8; ++i) {
+				bool tms_bit = (tms >> i) & 1u;
+				expect_idle += ((idle_states >> s) & 1u) && !tms_bit;
+				expect_events = expect_events || ((event_states >> s) & 1u);
+				s = jtag_vdtm_test_step_tap(s, tms_bit);
+			}
+			uint idle;
+			bool events;
+			uint next = jtag_vdtm_test_tap_lut(state, (uint8_t)tms, &idle, &events);
+			if (next != s || idle != expect_idle || events != expect_events) {
+				fprintf(stderr, "state %u TMS %02x: got %u/%u/%d, expected %u/%u/%d\n",
+					state, tms, next, idle, events, s, expect_idle, expect_events);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Differential fuzz of jtag_vdtm_shift() and jtag_vdtm_idle(), which take
+// shortcuts through shift runs, idle runs and whole bytes of TMS, against
+// the same bits clocked one at a time. TMS comes in runs of random length,
+// mostly 0, so that both paths spend time in Shift-xR and the idle states,
+// and occasionally wander through Update-DR with IR=DMI. Each DTM has its
+// own simulated DM, which must see the same number of accesses.
+
+#define FUZZ_TRIALS   20000
+#define FUZZ_MAX_BITS 256
+
+static uint32_t fuzz_rand(uint32_t *state) {
+	// xorshift32
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static bool test_shift_fuzz(void) {
+	sim_dm_t *dm[2] = {sim_dm_create(MEM_BASE, MEM_SIZE), sim_dm_create(MEM_BASE, MEM_SIZE)};
+	jtag_vdtm_t *fast = jtag_vdtm_create(TEST_IDCODE);
+	jtag_vdtm_t *slow = jtag_vdtm_create(TEST_IDCODE);
+	CHECK(dm[0] && dm[1] && fast && slow);
+	jtag_vdtm_set_dmi_callback(fast, sim_dm_dmi_callback, dm[0]);
+	jtag_vdtm_set_dmi_callback(slow, sim_dm_dmi_callback, dm[1]);
+	jtag_reset(fast);
+	jtag_reset(slow);
+
+	uint32_t seed = 0x12345678u;
+	bool tdi_bit = false;
+	for (uint trial = 0; trial < FUZZ_TRIALS; ++trial) {
+		uint8_t tms[FUZZ_MAX_BITS / 8] = {0};
+		uint8_t tdi[FUZZ_MAX_BITS / 8] = {0};
+		uint8_t tdo_fast[FUZZ_MAX_BITS / 8] = {0};
+		uint8_t tdo_slow[FUZZ_MAX_BITS / 8] = {0};
+		uint nbits = 1 + fuzz_rand(&seed) % FUZZ_MAX_BITS;
+		if (fuzz_rand(&seed) % 16 == 0) {
+			// Random IRs rarely select the DMI, so help it along
+			jtag_reset(fast);
+			jtag_reset(slow);
+			jtag_ir(fast, IR_DMI);
+			jtag_ir(slow, IR_DMI);
+		}
+		if (fuzz_rand(&seed) % 8 == 0) {
+			// TMS=0 with TDI held, as jtag_vdtm_idle() leaves it
+			jtag_vdtm_idle(fast, nbits);
+			for (uint i = 0; i < nbits; ++i)
+				(void)clock_tck(slow, false, tdi_bit);
+		} else {
+			for (uint i = 0; i < nbits; ) {
+				bool tms_bit = fuzz_rand(&seed) & 1u;
+				uint run = 1 + fuzz_rand(&seed) % (tms_bit ? 2 : 64);
+				for (; run && i < nbits; --run, ++i)
+					tms[i / 8] |= (uint8_t)tms_bit << (i % 8);
+			}
+			for (uint i = 0; i < nbits; ++i)
+				tdi[i / 8] |= (uint8_t)(fuzz_rand(&seed) & 1u) << (i % 8);
+			jtag_vdtm_shift(fast, tms, tdi, tdo_fast, nbits);
+			for (uint i = 0; i < nbits; ++i) {
+				tdi_bit = (tdi[i / 8] >> (i % 8)) & 1u;
+				bool tdo = clock_tck(slow, (tms[i / 8] >> (i % 8)) & 1u, tdi_bit);
+				tdo_slow[i / 8] |= (uint8_t)tdo << (i % 8);
+			}
+		}
+		if (memcmp(tdo_fast, tdo_slow, sizeof(tdo_fast))) {
+			fprintf(stderr, "TDO differs in trial %u (%u bits)\n", trial, nbits);
+			return false;
+		}
+		CHECK_EQ(jtag_vdtm_get_tdo(fast), jtag_vdtm_get_tdo(slow));
+		CHECK_EQ(jtag_vdtm_get_idle_cycles(fast), jtag_vdtm_get_idle_cycles(slow));
+		CHECK_EQ(sim_dm_get_access_count(dm[0]), sim_dm_get_access_count(dm[1]));
+	}
+	// Both should have gone through plenty of DMI scans and idle time
+	CHECK(sim_dm_get_access_count(dm[0]) > 100);
+	CHECK(jtag_vdtm_get_idle_cycles(fast) > FUZZ_TRIALS);
+
+	jtag_vdtm_destroy(fast);
+	jtag_vdtm_destroy(slow);
+	sim_dm_destroy(dm[0]);
+	sim_dm_destroy(dm[1]);
+	return true;
+}
+
+static const struct {
+	const char *name;
+	bool (*run)(void);
+} tests[] = {
+	{"connect",          test_connect},
+	{"dmi_rw",           test_dmi_rw},
+	{"busy_dmireset",    test_busy_dmireset},
+	{"batch_scan",       test_batch_scan},
+	{"batch_while_busy", test_batch_while_busy},
+	{"tar_block_end",    test_tar_block_end},
+	{"prefetch",         test_prefetch},
+	{"burst_wait",       test_burst_wait},
+	{"burst_wdataerr",   test_burst_wdataerr},
+	{"slow_ap",          test_slow_ap},
+	{"posted_reads",     test_posted_reads},
+	{"warm_reconnect",   test_warm_reconnect},
+	{"multidrop",        test_multidrop},
+	{"tap_fsm_lut",      test_tap_fsm_lut},
+	{"shift_fuzz",       test_shift_fuzz},
+};
+
+int main(int argc, char **argv) {
+	uint failed = 0;
+	uint run = 0;
+	for (uint i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+		bool selected = argc < 2;
+		for (int j = 1; j < argc; ++j)
+			selected = selected || !strcmp(argv[j], tests[i].name);
+		if (!selected)
+			continue;
+		bool ok = tests[i].run();
+		printf("%-16s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+		failed += !ok;
+		++run;
+	}
+	if (!run) {
+		fprintf(stderr, "No such test\n");
+		return 1;
+	}
+	printf("%u of %u tests failed\n", failed, run);
+	return failed ? 1 : 0;
+}
@@ -311,8 +311,9 @@ extern volatile bool disable_raw_swj_access;
 void jtag_setup_vdtm(void);
 __STATIC_INLINE void PORT_JTAG_SETUP (void) {
   disable_raw_swj_access = true;
-  jtag_setup_vdtm();
+  /* Before connecting: the DMI links expect probe.pio to be loaded already */
   probe_init();
+  jtag_setup_vdtm();
   cached_delay = 0;
 }
 
@@ -325,6 +326,8 @@ Configures the DAP Hardware I/O pins for Serial Wire Debug (SWD) mode:
 __STATIC_INLINE void PORT_SWD_SETUP (void) {
   disable_raw_swj_access = false;
   probe_init();
+  /* Take the pins back from a bitbanged DMI link, if JTAG-DTM mode used one */
+  probe_gpio_init();
   cached_delay = 0;
 }
 
@@ -0,0 +1,135 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Replaces the empty template in CMSIS-DAP's DAP_vendor.c. See dap_vendor.h
+// for the commands.
+
+#include <string.h>
+
+#include "DAP_config.h"
+#include "DAP.h"
+
+#include "dap_vendor.h"
+#include "dmi_capture.h"
+#include "latency.h"
+
+// Return values are as for DAP_ProcessVendorCommand(): request length in the
+// upper 16 bits and response length in the lower, both including the ID.
+
+static void put_u32(uint8_t *p, uint32_t x) {
+	for (uint i = 0; i < 4; ++i)
+		p[i] = x >> 8 * i;
+}
+
+static uint32_t capture_command(const uint8_t *request, uint8_t *response) {
+	uint32_t req_len = 2;
+	uint32_t resp_len = 2;
+	response[1] = DAP_OK;
+	switch (request[1]) {
+	case CAPTURE_INFO: {
+		dmi_capture_freeze(true);
+		response[2] = DMI_CAPTURE_CORES;
+		response[3] = sizeof(dmi_capture_rec_t);
+		response[4] = DMI_CAPTURE_SIZE & 0xff;
+		response[5] = DMI_CAPTURE_SIZE >> 8;
+		resp_len = 6;
+		for (uint core = 0; core < DMI_CAPTURE_CORES; ++core) {
+			put_u32(response + resp_len, dmi_capture_head(core));
+			resp_len += 4;
+		}
+		break;
+	}
+	case CAPTURE_READ: {
+		req_len = 7;
+		uint core = request[2];
+		uint32_t index = 0;
+		for (uint i = 0; i < 4; ++i)
+			index |= (uint32_t)request[3 + i] << 8 * i;
+		uint n = 0;
+		dmi_capture_rec_t rec;
+		resp_len = 3;
+		while (resp_len + sizeof(rec) <= DAP_PACKET_SIZE && dmi_capture_get(core, index + n, &rec)) {
+			// Both ends are little-endian
+			memcpy(response + resp_len, &rec, sizeof(rec));
+			resp_len += sizeof(rec);
+			++n;
+		}
+		response[2] = n;
+		if (!n)
+			response[1] = DAP_ERROR;
+		break;
+	}
+	case CAPTURE_RESUME:
+		req_len = 3;
+		if (request[2])
+			dmi_capture_clear();
+		dmi_capture_freeze(false);
+		break;
+	default:
+		response[1] = DAP_ERROR;
+		break;
+	}
+	return req_len << 16 | resp_len;
+}
+
+static uint32_t latency_command(const uint8_t *request, uint8_t *response) {
+	uint32_t req_len = 2;
+	uint32_t resp_len = 2;
+	response[1] = DAP_OK;
+	latency_hist_t hist;
+	switch (request[1]) {
+	case LATENCY_SUMMARY:
+		req_len = 3;
+		if (request[2] >= LATENCY_N_STAGES) {
+			response[1] = DAP_ERROR;
+			break;
+		}
+		latency_get(request[2], &hist);
+		response[2] = LATENCY_N_STAGES;
+		response[3] = latency_clk_mhz();
+		put_u32(response + 4, hist.count);
+		put_u32(response + 8, (uint32_t)hist.sum);
+		put_u32(response + 12, (uint32_t)(hist.sum >> 32));
+		put_u32(response + 16, hist.min);
+		put_u32(response + 20, hist.max);
+		resp_len = 24;
+		break;
+	case LATENCY_BUCKETS: {
+		req_len = 4;
+		uint first = request[3];
+		if (request[2] >= LATENCY_N_STAGES || first >= LATENCY_N_BUCKETS) {
+			response[1] = DAP_ERROR;
+			break;
+		}
+		latency_get(request[2], &hist);
+		uint n = LATENCY_N_BUCKETS - first;
+		if (n > (DAP_PACKET_SIZE - 3) / 4)
+			n = (DAP_PACKET_SIZE - 3) / 4;
+		for (uint i = 0; i < n; ++i)
+			put_u32(response + 3 + 4 * i, hist.buckets[first + i]);
+		response[2] = n;
+		resp_len = 3 + 4 * n;
+		break;
+	}
+	case LATENCY_CLEAR:
+		latency_clear();
+		break;
+	default:
+		response[1] = DAP_ERROR;
+		break;
+	}
+	return req_len << 16 | resp_len;
+}
+
+uint32_t DAP_ProcessVendorCommand(const uint8_t *request, uint8_t *response) {
+	response[0] = request[0];
+	switch (request[0]) {
+	case ID_DAP_VENDOR_CAPTURE:
+		return capture_command(request, response);
+	case ID_DAP_VENDOR_LATENCY:
+		return latency_command(request, response);
+	default:
+		response[0] = ID_DAP_Invalid;
+		return 1u << 16 | 1u;
+	}
+}
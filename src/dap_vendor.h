@@ -0,0 +1,53 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// CMSIS-DAP vendor commands implemented by this probe (DAP_ProcessVendorCommand
+// in dap_vendor.c). Also included by the host tools, so this only defines the
+// wire format. Multi-byte fields are little-endian. Responses start with the
+// command ID and a status byte, DAP_OK (0) or DAP_ERROR (0xff).
+
+#ifndef _DAP_VENDOR_H
+#define _DAP_VENDOR_H
+
+// ID_DAP_Vendor0: download the DMI capture buffer (dmi_capture.h)
+#define ID_DAP_VENDOR_CAPTURE 0x80u
+
+// Stop recording, and report where each core's ring is up to:
+//   request:  ID, CAPTURE_INFO
+//   response: ID, status, n_cores, record size, ring size (u16),
+//             head (u32) for each core
+#define CAPTURE_INFO   0x00u
+
+// Read consecutive records from one core's ring, starting at index (which
+// counts from 0 like head). As many records as fit in a packet:
+//   request:  ID, CAPTURE_READ, core, index (u32)
+//   response: ID, status, n, n records
+#define CAPTURE_READ   0x01u
+
+// Start recording again, optionally discarding what was recorded:
+//   request:  ID, CAPTURE_RESUME, clear
+//   response: ID, status
+#define CAPTURE_RESUME 0x02u
+
+// ID_DAP_Vendor1: read the latency histograms (latency.h). Stages are
+// numbered as in latency_stage_t, and times are in clk_sys cycles.
+#define ID_DAP_VENDOR_LATENCY 0x81u
+
+// Totals for one stage, over both cores:
+//   request:  ID, LATENCY_SUMMARY, stage
+//   response: ID, status, n_stages, clk_sys MHz, count (u32), sum (u64),
+//             min (u32), max (u32)
+#define LATENCY_SUMMARY 0x00u
+
+// Bucket counts for one stage, starting at bucket first. Bucket i counts
+// times of 2^i to 2^(i + 1) - 1 cycles. As many buckets as fit in a packet:
+//   request:  ID, LATENCY_BUCKETS, stage, first
+//   response: ID, status, n, n counts (u32)
+#define LATENCY_BUCKETS 0x01u
+
+// Empty all histograms:
+//   request:  ID, LATENCY_CLEAR
+//   response: ID, status
+#define LATENCY_CLEAR   0x02u
+
+#endif
@@ -0,0 +1,134 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+#include "dlog.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/platform.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+
+// Entries per core. Must be a power of two.
+#ifndef DLOG_RING_SIZE
+#define DLOG_RING_SIZE 128
+#endif
+
+// Longest formatted message, including the newline
+#define DLOG_LINE_MAX 128
+
+typedef struct {
+	const char *fmt;
+	uint32_t timestamp;
+	uint32_t n_args;
+	uint64_t args[DLOG_MAX_ARGS];
+} dlog_entry_t;
+
+// One ring per core, so the only contention on a ring is between the tasks
+// and IRQs of one core, which dlog_put() excludes by briefly disabling
+// interrupts. head and dropped are only written by the producing core, and
+// tail and dropped_reported only by dlog_drain(). All count up freely.
+typedef struct {
+	dlog_entry_t entries[DLOG_RING_SIZE];
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t dropped;
+	uint32_t dropped_reported;
+} dlog_ring_t;
+
+static dlog_ring_t rings[NUM_CORES];
+
+void dlog_put(const char *fmt, const uint64_t *args, uint n_args) {
+	dlog_ring_t *r = &rings[get_core_num()];
+	uint32_t save = save_and_disable_interrupts();
+	uint32_t head = r->head;
+	if (head - r->tail >= DLOG_RING_SIZE) {
+		++r->dropped;
+	} else {
+		dlog_entry_t *e = &r->entries[head % DLOG_RING_SIZE];
+		e->fmt = fmt;
+		e->timestamp = time_us_32();
+		e->n_args = n_args;
+		for (uint i = 0; i < n_args; ++i)
+			e->args[i] = args[i];
+		// Publish the entry before head moves
+		__dmb();
+		r->head = head + 1;
+	}
+	restore_interrupts(save);
+}
+
+// Format one entry. Each conversion in the format is passed to snprintf()
+// on its own, with the argument cast to the type its length modifier asks
+// for, which is how a printf() call site would have passed it.
+static void print_entry(const dlog_entry_t *e) {
+	char line[DLOG_LINE_MAX];
+	uint len = 0;
+	uint arg = 0;
+	const char *p = e->fmt;
+	while (*p && len < sizeof(line) - 1) {
+		if (*p != '%') {
+			line[len++] = *p++;
+			continue;
+		}
+		char spec[16];
+		uint spec_len = 0;
+		uint longs = 0;
+		spec[spec_len++] = *p++;
+		while (*p && strchr("-+ #0123456789hl", *p) && spec_len < sizeof(spec) - 2) {
+			longs += *p == 'l';
+			spec[spec_len++] = *p++;
+		}
+		if (!*p)
+			break;
+		spec[spec_len++] = *p;
+		spec[spec_len] = '\0';
+		int n;
+		if (*p++ == '%') {
+			n = snprintf(line + len, sizeof(line) - len, "%%");
+		} else {
+			uint64_t x = arg < e->n_args ? e->args[arg++] : 0;
+			if (longs >= 2)
+				n = snprintf(line + len, sizeof(line) - len, spec, (unsigned long long)x);
+			else if (longs == 1)
+				n = snprintf(line + len, sizeof(line) - len, spec, (unsigned long)x);
+			else
+				n = snprintf(line + len, sizeof(line) - len, spec, (unsigned int)x);
+		}
+		if (n > 0)
+			len += (uint)n < sizeof(line) - len ? (uint)n : sizeof(line) - 1 - len;
+	}
+	line[len] = '\0';
+	printf("[%10lu] %s", (unsigned long)e->timestamp, line);
+}
+
+void dlog_drain(void) {
+	while (true) {
+		// Merge the rings by timestamp, oldest first
+		dlog_ring_t *oldest = NULL;
+		for (uint core = 0; core < NUM_CORES; ++core) {
+			dlog_ring_t *r = &rings[core];
+			uint32_t dropped = r->dropped;
+			if (dropped != r->dropped_reported) {
+				printf("dlog: core %u dropped %lu messages\n", core,
+					(unsigned long)(dropped - r->dropped_reported));
+				r->dropped_reported = dropped;
+			}
+			if (r->head == r->tail)
+				continue;
+			// Read the entry only after seeing head move
+			__dmb();
+			if (!oldest || (int32_t)(r->entries[r->tail % DLOG_RING_SIZE].timestamp -
+					oldest->entries[oldest->tail % DLOG_RING_SIZE].timestamp) < 0) {
+				oldest = r;
+			}
+		}
+		if (!oldest)
+			return;
+		print_entry(&oldest->entries[oldest->tail % DLOG_RING_SIZE]);
+		// Release the slot only once it has been read
+		__dmb();
+		oldest->tail = oldest->tail + 1;
+	}
+}
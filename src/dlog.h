@@ -0,0 +1,60 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Deferred logging for the JTAG/SWD hot paths. dlog() takes printf-style
+// arguments, but only records the format pointer, a timestamp and the raw
+// arguments into a per-core ring, which costs a few dozen cycles. The
+// formatting and the slow UART write happen later, in dlog_drain(), called
+// from the lowest-priority task.
+//
+// Restrictions, compared to printf:
+//
+// - The format must be a string literal, as only its address is kept
+// - At most DLOG_MAX_ARGS arguments, all integers (no %s, no floats, no *)
+//
+// When the ring is full, new messages are dropped, and the drain reports how
+// many were lost.
+//
+// Host builds define DLOG_DEFERRED=0, and dlog() is plain printf().
+
+#ifndef _DLOG_H
+#define _DLOG_H
+
+#include <stdint.h>
+
+#ifndef DLOG_DEFERRED
+#define DLOG_DEFERRED 1
+#endif
+
+#define DLOG_MAX_ARGS 4
+
+#if DLOG_DEFERRED
+
+typedef unsigned int uint;
+
+#define dlog(fmt, ...) do { \
+	if (0) dlog_check_format(fmt, ##__VA_ARGS__); \
+	const uint64_t _dlog_args[] = {0, ##__VA_ARGS__}; \
+	_Static_assert(sizeof(_dlog_args) <= (DLOG_MAX_ARGS + 1) * sizeof(uint64_t), \
+		"too many dlog() arguments"); \
+	dlog_put("" fmt "", _dlog_args + 1, sizeof(_dlog_args) / sizeof(uint64_t) - 1); \
+} while (0)
+
+// Never called, only lets the compiler check dlog() formats against arguments
+static inline void __attribute__((format(printf, 1, 2))) dlog_check_format(const char *fmt, ...) {}
+
+// Record one message on the calling core's ring. Use dlog() instead.
+void dlog_put(const char *fmt, const uint64_t *args, uint n_args);
+
+// Format and print all recorded messages, oldest first. Call from one place
+// only, typically a low-priority task.
+void dlog_drain(void);
+
+#else
+
+#include <stdio.h>
+#define dlog(...) printf(__VA_ARGS__)
+
+#endif
+
+#endif
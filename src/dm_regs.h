@@ -0,0 +1,77 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0 
+
+// RISC-V Debug Module register addresses and fields (debug spec 0.13.2)
+
+#ifndef _DM_REGS_H
+#define _DM_REGS_H
+
+#define DM_DATA0        0x04
+#define DM_DATA1        0x05
+#define DM_DMCONTROL    0x10
+#define DM_DMSTATUS     0x11
+#define DM_HARTINFO     0x12
+#define DM_HALTSUM1     0x13
+#define DM_HALTSUM0     0x40
+#define DM_HAWINDOWSEL  0x14
+#define DM_HAWINDOW     0x15
+#define DM_ABSTRACTCS   0x16
+#define DM_COMMAND      0x17
+#define DM_ABSTRACTAUTO 0x18
+#define DM_CONFSTRPTR0  0x19
+#define DM_CONFSTRPTR1  0x1a
+#define DM_CONFSTRPTR2  0x1b
+#define DM_CONFSTRPTR3  0x1c
+#define DM_NEXTDM       0x1d
+#define DM_PROGBUF0     0x20
+#define DM_PROGBUF1     0x21
+#define DM_SBCS         0x38
+#define DM_SBADDRESS0   0x39
+#define DM_SBDATA0      0x3c
+
+#define DM_DMCONTROL_DMACTIVE        (1u << 0)
+#define DM_DMCONTROL_NDMRESET        (1u << 1)
+#define DM_DMCONTROL_RESUMEREQ       (1u << 30)
+#define DM_DMCONTROL_HALTREQ         (1u << 31)
+
+#define DM_DMSTATUS_VERSION_0_13     (2u << 0)
+#define DM_DMSTATUS_AUTHENTICATED    (1u << 7)
+#define DM_DMSTATUS_ANYHALTED        (1u << 8)
+#define DM_DMSTATUS_ALLHALTED        (1u << 9)
+#define DM_DMSTATUS_ANYRUNNING       (1u << 10)
+#define DM_DMSTATUS_ALLRUNNING       (1u << 11)
+#define DM_DMSTATUS_ANYRESUMEACK     (1u << 16)
+#define DM_DMSTATUS_ALLRESUMEACK     (1u << 17)
+
+#define DM_ABSTRACTCS_DATACOUNT_LSB  0
+#define DM_ABSTRACTCS_CMDERR_LSB     8
+#define DM_ABSTRACTCS_CMDERR_BITS    (0x7u << 8)
+#define DM_ABSTRACTCS_BUSY           (1u << 12)
+
+#define DM_COMMAND_CMDTYPE_LSB       24
+#define DM_COMMAND_AARSIZE_LSB       20
+#define DM_COMMAND_AARSIZE_BITS      (0x7u << 20)
+#define DM_COMMAND_AARPOSTINCREMENT  (1u << 19)
+#define DM_COMMAND_POSTEXEC          (1u << 18)
+#define DM_COMMAND_TRANSFER          (1u << 17)
+#define DM_COMMAND_WRITE             (1u << 16)
+#define DM_COMMAND_REGNO_BITS        0xffffu
+
+#define DM_SBCS_SBACCESS8            (1u << 0)
+#define DM_SBCS_SBACCESS16           (1u << 1)
+#define DM_SBCS_SBACCESS32           (1u << 2)
+#define DM_SBCS_SBASIZE_LSB          5
+#define DM_SBCS_SBERROR_LSB          12
+#define DM_SBCS_SBERROR_BITS         (0x7u << 12)
+#define DM_SBCS_SBREADONDATA         (1u << 15)
+#define DM_SBCS_SBAUTOINCREMENT      (1u << 16)
+#define DM_SBCS_SBACCESS_LSB         17
+#define DM_SBCS_SBACCESS_BITS        (0x7u << 17)
+#define DM_SBCS_SBREADONADDR         (1u << 20)
+#define DM_SBCS_SBBUSY               (1u << 21)
+#define DM_SBCS_SBBUSYERROR          (1u << 22)
+#define DM_SBCS_SBVERSION_LSB        29
+
+#define DM_ABSTRACTAUTO_AUTOEXECDATA (0xfffu << 0)
+
+#endif
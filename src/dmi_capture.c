@@ -0,0 +1,66 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+#include "dmi_capture.h"
+
+#include <string.h>
+
+#include "pico/platform.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+
+// head is only written by the recording core (or by dmi_capture_clear(),
+// with recording frozen). It counts up freely, and records are overwritten
+// in place, so readers must freeze recording first.
+typedef struct {
+	dmi_capture_rec_t recs[DMI_CAPTURE_SIZE];
+	volatile uint32_t head;
+} capture_ring_t;
+
+static capture_ring_t rings[DMI_CAPTURE_CORES];
+static volatile bool frozen;
+
+#if DMI_CAPTURE
+void dmi_capture_put(uint8_t type, uint8_t tap, uint8_t a, uint8_t b, uint32_t data) {
+	if (frozen)
+		return;
+	capture_ring_t *r = &rings[get_core_num()];
+	// Only the tasks and IRQs of this core can get in the way
+	uint32_t save = save_and_disable_interrupts();
+	uint32_t head = r->head;
+	dmi_capture_rec_t *rec = &r->recs[head % DMI_CAPTURE_SIZE];
+	rec->timestamp = time_us_32();
+	rec->data = data;
+	rec->type = type;
+	rec->tap = tap;
+	rec->a = a;
+	rec->b = b;
+	r->head = head + 1;
+	restore_interrupts(save);
+}
+#endif
+
+void dmi_capture_freeze(bool freeze) {
+	frozen = freeze;
+	__dmb();
+}
+
+void dmi_capture_clear(void) {
+	for (uint core = 0; core < DMI_CAPTURE_CORES; ++core)
+		rings[core].head = 0;
+}
+
+uint32_t dmi_capture_head(uint core) {
+	return core < DMI_CAPTURE_CORES ? rings[core].head : 0;
+}
+
+bool dmi_capture_get(uint core, uint32_t index, dmi_capture_rec_t *rec) {
+	if (core >= DMI_CAPTURE_CORES)
+		return false;
+	uint32_t head = rings[core].head;
+	if (index >= head || head - index > DMI_CAPTURE_SIZE)
+		return false;
+	__dmb();
+	*rec = rings[core].recs[index % DMI_CAPTURE_SIZE];
+	return true;
+}
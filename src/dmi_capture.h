@@ -0,0 +1,94 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Always-on record of what the probe did on each DMI: every batch of DMI
+// accesses, and every SWD packet they turned into, with timestamps. Each
+// core has its own ring of fixed-size records, and the oldest records are
+// overwritten when a ring is full.
+//
+// The host downloads the rings with the DAP_VENDOR_CAPTURE command (see
+// dap_vendor.h), freezing them first so they stay consistent. host/dmi_capture
+// fetches and decodes them, and vdtm_bench -r replays a capture against the
+// simulated target.
+
+#ifndef _DMI_CAPTURE_H
+#define _DMI_CAPTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef unsigned int uint;
+
+#ifndef DMI_CAPTURE
+#define DMI_CAPTURE 1
+#endif
+
+// Records per core. Must be a power of two.
+#ifndef DMI_CAPTURE_SIZE
+#define DMI_CAPTURE_SIZE 512
+#endif
+
+#define DMI_CAPTURE_CORES 2
+
+typedef enum dmi_capture_type {
+	// A DMI batch starting: tap, data = number of accesses
+	CAPTURE_BATCH     = 1,
+	// One DMI access, once its batch is complete: tap, a = DMI address,
+	// b = op | status << 4, data = write data or read result
+	CAPTURE_DMI       = 2,
+	// One SWD packet: a = header, b = ACK (or SWD_LINK_PARITY_ERROR) | WAIT
+	// retries so far (at most 15) << 4, data = read or write data
+	CAPTURE_SWD       = 3,
+	// A back-to-back SWD write burst: a = header, b = OK if every write was
+	// ACKed OK, else FAULT, data = number of writes | index of the first
+	// write not ACKed OK << 16
+	CAPTURE_SWD_BURST = 4
+} dmi_capture_type_t;
+
+// In files written by host tools, the core that made a record is in bit 7 of
+// its type
+#define CAPTURE_TYPE_MASK 0x7fu
+#define CAPTURE_TYPE_CORE_LSB 7
+
+// SWD records come from swd_dmi.c, which does not know its TAP number
+#define CAPTURE_TAP_NONE 0xffu
+
+// Timestamps are time_us_32(), the same as TIMESTAMP_GET() in DAP_config.h.
+// Little-endian, 12 bytes, in both memory and the download format.
+typedef struct dmi_capture_rec {
+	uint32_t timestamp;
+	uint32_t data;
+	uint8_t type;
+	uint8_t tap;
+	uint8_t a;
+	uint8_t b;
+} dmi_capture_rec_t;
+
+_Static_assert(sizeof(dmi_capture_rec_t) == 12, "capture record is not packed");
+
+#if DMI_CAPTURE
+
+void dmi_capture_put(uint8_t type, uint8_t tap, uint8_t a, uint8_t b, uint32_t data);
+
+#else
+
+static inline void dmi_capture_put(uint8_t type, uint8_t tap, uint8_t a, uint8_t b, uint32_t data) {}
+
+#endif
+
+// Stop or restart recording. Records being written on the other core when
+// recording stops may still land, so leave a moment before reading.
+void dmi_capture_freeze(bool freeze);
+
+// Discard all records
+void dmi_capture_clear(void);
+
+// Total number of records ever made on this core. The ones still in the
+// ring are those from head - DMI_CAPTURE_SIZE (or 0) up to head.
+uint32_t dmi_capture_head(uint core);
+
+// Copy record number index (counting since the last clear) from this core's
+// ring. Returns false if it has been overwritten, or not made yet.
+bool dmi_capture_get(uint core, uint32_t index, dmi_capture_rec_t *rec);
+
+#endif
@@ -0,0 +1,272 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+#include "dmi_prefetch.h"
+#include "dm_regs.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// How long to wait for a speculative bus read to finish before rewinding
+#define SBBUSY_TIMEOUT 100
+
+// We track the System Bus Access state that the host *should* see (the
+// "virtual" state) in addition to what the Debug Module actually holds. This
+// requires knowing the RW fields of sbcs, which we learn from the host's
+// writes, and sbaddress0, which we learn from host writes and reads.
+//
+// Only sbdata0 is speculated on. Reading data0 with abstractauto.autoexecdata
+// set would also stream data (OpenOCD uses this for progbuf memory reads),
+// but that re-executes an abstract command on the hart, which can't be
+// undone, so data0 is always passed straight through.
+
+typedef enum pf_state {
+	// DM state is exactly what the host expects
+	PF_SYNC,
+	// We have read sbdata0 one more time than the host, so the DM has run
+	// one extra bus read and sbaddress0 is one increment ahead. spec_data is
+	// the value the host's next sbdata0 read should return.
+	PF_AHEAD,
+	// sbaddress0 has been rewound, but the DM's sbdata0 is still one bus
+	// read ahead. spec_data is the host-visible value of sbdata0.
+	PF_SHADOWED
+} pf_state_t;
+
+struct dmi_prefetch {
+	swd_dmi_t *dmi;
+	bool enabled;
+	pf_state_t state;
+	// The host is streaming and the DM is in sync, so speculate at the next
+	// dmi_prefetch_idle()
+	bool pending;
+	bool sbcs_known;
+	bool sbaddress_known;
+	uint32_t sbcs;
+	uint32_t sbaddress;
+	uint32_t spec_data;
+};
+
+dmi_prefetch_t *dmi_prefetch_create(swd_dmi_t *dmi) {
+	dmi_prefetch_t *pf = malloc(sizeof(dmi_prefetch_t));
+	if (!pf)
+		return pf;
+	memset(pf, 0, sizeof(*pf));
+	pf->dmi = dmi;
+	pf->state = PF_SYNC;
+	return pf;
+}
+
+void dmi_prefetch_destroy(dmi_prefetch_t *pf) {
+	free(pf);
+}
+
+void dmi_prefetch_reset(dmi_prefetch_t *pf) {
+	pf->state = PF_SYNC;
+	pf->pending = false;
+	pf->sbcs_known = false;
+	pf->sbaddress_known = false;
+}
+
+void dmi_prefetch_set_enabled(dmi_prefetch_t *pf, bool enabled) {
+	// Note a speculation in progress is still rewound correctly after
+	// disabling, as the state tracking is always active.
+	pf->enabled = enabled;
+}
+
+// ----------------------------------------------------------------------------
+// SBA state tracking
+
+static inline uint32_t sb_access_size(dmi_prefetch_t *pf) {
+	return 1u << ((pf->sbcs & DM_SBCS_SBACCESS_BITS) >> DM_SBCS_SBACCESS_LSB);
+}
+
+// The DM has run a bus read or write triggered by the host
+static inline void sb_access_done(dmi_prefetch_t *pf) {
+	if (pf->sbcs & DM_SBCS_SBAUTOINCREMENT)
+		pf->sbaddress += sb_access_size(pf);
+}
+
+static int fail(dmi_prefetch_t *pf) {
+	dmi_prefetch_reset(pf);
+	return -1;
+}
+
+// The DM has just started the bus read for the host's next sbdata0 read
+static inline void arm(dmi_prefetch_t *pf) {
+	pf->pending = pf->enabled;
+}
+
+// Read one more word than the host has asked for, if it is safe to do so
+static void speculate(dmi_prefetch_t *pf) {
+	const uint32_t needed = DM_SBCS_SBREADONDATA | DM_SBCS_SBAUTOINCREMENT;
+	if (!(pf->enabled && pf->sbcs_known && pf->sbaddress_known))
+		return;
+	if ((pf->sbcs & needed) != needed)
+		return;
+	// Stick to 32-bit accesses or smaller, and don't carry into sbaddress1
+	uint32_t size = sb_access_size(pf);
+	if (size > 4 || pf->sbaddress + size < pf->sbaddress)
+		return;
+	// Reading sbdata0 whilst the bus is busy would set sbbusyerror, and if
+	// there is an error, sbdata0 would not be updated.
+	uint32_t sbcs;
+	if (swd_dmi_read(pf->dmi, DM_SBCS, &sbcs)) {
+		fail(pf);
+		return;
+	}
+	if (sbcs & (DM_SBCS_SBBUSY | DM_SBCS_SBBUSYERROR | DM_SBCS_SBERROR_BITS))
+		return;
+	if (swd_dmi_read(pf->dmi, DM_SBDATA0, &pf->spec_data)) {
+		fail(pf);
+		return;
+	}
+	pf->state = PF_AHEAD;
+}
+
+// Undo the extra bus read, apart from the actual read from memory. Leaves
+// the DM's sbdata0 one word ahead, which is tracked as PF_SHADOWED.
+static int rewind(dmi_prefetch_t *pf) {
+	uint32_t sbcs;
+	int timeout = 0;
+	do {
+		if (swd_dmi_read(pf->dmi, DM_SBCS, &sbcs))
+			return fail(pf);
+	} while ((sbcs & DM_SBCS_SBBUSY) && ++timeout < SBBUSY_TIMEOUT);
+	if (timeout == SBBUSY_TIMEOUT)
+		return fail(pf);
+	// The bus was idle and error-free before we speculated, so any errors
+	// now are ours. Clear them (W1C) along with rewriting the host's value.
+	// sbreadonaddr must be clear while sbaddress0 is rewritten, so that this
+	// doesn't start another bus read.
+	uint32_t errors = sbcs & (DM_SBCS_SBBUSYERROR | DM_SBCS_SBERROR_BITS);
+	bool readonaddr = pf->sbcs & DM_SBCS_SBREADONADDR;
+	if ((errors || readonaddr) &&
+		swd_dmi_write(pf->dmi, DM_SBCS, (pf->sbcs & ~DM_SBCS_SBREADONADDR) | errors))
+		return fail(pf);
+	if (swd_dmi_write(pf->dmi, DM_SBADDRESS0, pf->sbaddress))
+		return fail(pf);
+	if (readonaddr && swd_dmi_write(pf->dmi, DM_SBCS, pf->sbcs))
+		return fail(pf);
+	pf->state = PF_SHADOWED;
+	return 0;
+}
+
+void dmi_prefetch_idle(dmi_prefetch_t *pf) {
+	if (!pf->pending)
+		return;
+	pf->pending = false;
+	speculate(pf);
+}
+
+// ----------------------------------------------------------------------------
+// DMI access
+
+int dmi_prefetch_read_posted(dmi_prefetch_t *pf, uint32_t addr, uint32_t *data) {
+	pf->pending = false;
+	if (addr == DM_SBDATA0 && pf->state != PF_SYNC) {
+		*data = pf->spec_data;
+		bool readondata = pf->sbcs & DM_SBCS_SBREADONDATA;
+		if (pf->state == PF_SHADOWED) {
+			if (!readondata)
+				return 0;
+			// Discard the stale value, we only want the side effect
+			uint32_t discard;
+			if (swd_dmi_read(pf->dmi, DM_SBDATA0, &discard))
+				return fail(pf);
+		}
+		// Either way the DM is now in the state the host expects
+		pf->state = PF_SYNC;
+		sb_access_done(pf);
+		if (readondata)
+			arm(pf);
+		return 0;
+	}
+
+	if (pf->state == PF_AHEAD && rewind(pf))
+		return -1;
+
+	if (addr == DM_SBADDRESS0) {
+		// We need the value now
+		if (swd_dmi_read(pf->dmi, addr, data))
+			return fail(pf);
+		pf->sbaddress = *data;
+		pf->sbaddress_known = true;
+		return 0;
+	}
+	if (swd_dmi_read_posted(pf->dmi, addr, data))
+		return fail(pf);
+	if (addr == DM_SBDATA0 && (pf->sbcs & DM_SBCS_SBREADONDATA)) {
+		sb_access_done(pf);
+		arm(pf);
+	}
+	return 0;
+}
+
+int dmi_prefetch_read(dmi_prefetch_t *pf, uint32_t addr, uint32_t *data) {
+	if (dmi_prefetch_read_posted(pf, addr, data))
+		return -1;
+	return dmi_prefetch_flush(pf);
+}
+
+int dmi_prefetch_flush(dmi_prefetch_t *pf) {
+	if (swd_dmi_flush(pf->dmi))
+		return fail(pf);
+	return 0;
+}
+
+// Follow the effect of a host write on the SBA state
+static void track_write(dmi_prefetch_t *pf, uint32_t addr, uint32_t data) {
+	switch (addr) {
+	case DM_SBCS:
+		pf->sbcs = data & ~(DM_SBCS_SBBUSYERROR | DM_SBCS_SBERROR_BITS);
+		pf->sbcs_known = true;
+		break;
+	case DM_SBADDRESS0:
+		pf->sbaddress = data;
+		pf->sbaddress_known = true;
+		if (pf->sbcs & DM_SBCS_SBREADONADDR) {
+			// Starts a read which overwrites sbdata0, and with sbreadondata,
+			// a stream (as OpenOCD does it)
+			pf->state = PF_SYNC;
+			sb_access_done(pf);
+			if (pf->sbcs & DM_SBCS_SBREADONDATA)
+				arm(pf);
+		}
+		break;
+	case DM_SBDATA0:
+		// Starts a write, and sbdata0 now holds the written value
+		pf->state = PF_SYNC;
+		sb_access_done(pf);
+		break;
+	case DM_DMCONTROL:
+		if (!(data & DM_DMCONTROL_DMACTIVE))
+			dmi_prefetch_reset(pf);
+		break;
+	default:
+		break;
+	}
+}
+
+int dmi_prefetch_write(dmi_prefetch_t *pf, uint32_t addr, uint32_t data) {
+	pf->pending = false;
+	if (pf->state == PF_AHEAD && rewind(pf))
+		return -1;
+	if (swd_dmi_write(pf->dmi, addr, data))
+		return fail(pf);
+	track_write(pf, addr, data);
+	return 0;
+}
+
+uint dmi_prefetch_write_burst(dmi_prefetch_t *pf, uint32_t addr, const uint32_t *data, uint n, bool incr) {
+	pf->pending = false;
+	if (pf->state == PF_AHEAD && rewind(pf))
+		return 0;
+	uint done = swd_dmi_write_burst(pf->dmi, addr, data, n, incr);
+	if (done < n) {
+		fail(pf);
+		return done;
+	}
+	for (uint i = 0; i < n; ++i)
+		track_write(pf, incr ? addr + i : addr, data[i]);
+	return n;
+}
@@ -0,0 +1,60 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0 
+
+// Speculative read-ahead for System Bus Access streaming through a DMI.
+//
+// When the host streams memory through sbdata0 with sbreadondata and
+// sbautoincrement set (and usually sbreadonaddr, to start the stream), each
+// read of sbdata0 returns one word and kicks off the bus read for the next.
+// This layer sits between the DTM and an SWD DMI, and after such a read it
+// issues the host's next sbdata0 read ahead of time, in the gap before the
+// host's next request (see dmi_prefetch_idle()), so the result is already to
+// hand when the host asks for it. If the host does something else instead,
+// the Debug Module's state is rewound so that the speculation is invisible,
+// apart from one extra system bus read past the end of the host's stream.
+// This is why prefetch is off by default.
+
+#ifndef _DMI_PREFETCH_H
+#define _DMI_PREFETCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "swd_dmi.h"
+
+struct dmi_prefetch;
+typedef struct dmi_prefetch dmi_prefetch_t;
+
+// Dynamically allocate a prefetcher on top of an existing DMI, with prefetch
+// disabled. Accesses are passed straight through to the DMI until enabled.
+dmi_prefetch_t *dmi_prefetch_create(swd_dmi_t *dmi);
+
+void dmi_prefetch_destroy(dmi_prefetch_t *pf);
+
+void dmi_prefetch_set_enabled(dmi_prefetch_t *pf, bool enabled);
+
+// Forget everything known about the Debug Module's state, e.g. after the
+// link has been reconnected.
+void dmi_prefetch_reset(dmi_prefetch_t *pf);
+
+// Run any speculative read that is due. Call when the DMI would otherwise be
+// idle, e.g. after the DTM's batch has completed, so that the host doesn't
+// wait for the speculation. Does nothing unless the last access left the
+// host streaming.
+void dmi_prefetch_idle(dmi_prefetch_t *pf);
+
+// Same as swd_dmi_write()/swd_dmi_read(), including return values
+int dmi_prefetch_write(dmi_prefetch_t *pf, uint32_t addr, uint32_t data);
+
+int dmi_prefetch_read(dmi_prefetch_t *pf, uint32_t addr, uint32_t *data);
+
+// Same as swd_dmi_write_burst()
+uint dmi_prefetch_write_burst(dmi_prefetch_t *pf, uint32_t addr, const uint32_t *data, uint n, bool incr);
+
+// Same as swd_dmi_read_posted()/swd_dmi_flush(). Reads which hit a prefetched
+// value complete straight away.
+int dmi_prefetch_read_posted(dmi_prefetch_t *pf, uint32_t addr, uint32_t *data);
+
+int dmi_prefetch_flush(dmi_prefetch_t *pf);
+
+#endif
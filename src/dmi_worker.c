@@ -0,0 +1,92 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+#include "dmi_worker.h"
+
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+
+// Must be a power of two. The DTM only has one batch in flight at a time, so
+// this rarely fills up.
+#define DMI_WORKER_RING_SIZE 4
+
+typedef struct {
+	dmi_worker_fn fn;
+	void *user;
+	jtag_vdtm_dmi_access_t *accesses;
+	uint n;
+} dmi_worker_job_t;
+
+// head is only written by core 0 and tail only by core 1. Both count up
+// freely and are reduced modulo the ring size on use. A job's ticket is the
+// value of head when it was submitted, so it is done once tail has passed it.
+//
+// The doorbells in both directions are SEV/WFE rather than the SIO FIFO, as
+// the FreeRTOS port claims the FIFO IRQ for its cross-core pico_sync
+// interop.
+static struct {
+	dmi_worker_job_t jobs[DMI_WORKER_RING_SIZE];
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	bool launched;
+} ring;
+
+static void core1_main(void) {
+	while (true) {
+		uint32_t tail = ring.tail;
+		while (ring.head == tail)
+			__wfe();
+		// Read the job only after seeing head move
+		__dmb();
+		dmi_worker_job_t *job = &ring.jobs[tail % DMI_WORKER_RING_SIZE];
+		job->fn(job->user, job->accesses, job->n);
+		// Publish the results before the slot is released
+		__dmb();
+		ring.tail = tail + 1;
+		__sev();
+	}
+}
+
+void dmi_worker_launch(void) {
+	if (ring.launched)
+		return;
+	multicore_launch_core1(core1_main);
+	ring.launched = true;
+}
+
+uint32_t dmi_worker_submit(dmi_worker_fn fn, void *user, jtag_vdtm_dmi_access_t *accesses, uint n) {
+	uint32_t head = ring.head;
+	if (!ring.launched) {
+		// Nothing else is running yet, so core 0 can also own tail
+		fn(user, accesses, n);
+		ring.head = ring.tail = head + 1;
+		return head;
+	}
+	while (head - ring.tail >= DMI_WORKER_RING_SIZE)
+		__wfe();
+	ring.jobs[head % DMI_WORKER_RING_SIZE] = (dmi_worker_job_t){
+		.fn = fn,
+		.user = user,
+		.accesses = accesses,
+		.n = n
+	};
+	// The job (and the accesses it points to) must be visible before head
+	__dmb();
+	ring.head = head + 1;
+	__sev();
+	return head;
+}
+
+bool dmi_worker_done(uint32_t ticket) {
+	bool done = (int32_t)(ring.tail - ticket) > 0;
+	// Don't let the caller's reads of the results overtake the tail read
+	__dmb();
+	return done;
+}
+
+void dmi_worker_flush(void) {
+	uint32_t head = ring.head;
+	while (ring.tail != head)
+		__wfe();
+	__dmb();
+}
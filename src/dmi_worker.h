@@ -0,0 +1,35 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Run DMI accesses on RP2040 core 1, so that the SWD bitbang overlaps with
+// USB and JTAG emulation on core 0. Core 0 is the only producer and core 1
+// the only consumer of a small ring of batch descriptors in shared SRAM.
+
+#ifndef _DMI_WORKER_H
+#define _DMI_WORKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "jtag_vdtm.h"
+
+// Called on core 1 to perform a batch. The accesses array stays owned by
+// the submitter, and must not be touched until the batch is done.
+typedef void (*dmi_worker_fn)(void *user, jtag_vdtm_dmi_access_t *accesses, uint n);
+
+// Launch core 1. Call once from core 0, before starting the scheduler. Until
+// this is called, batches run synchronously on the submitting core.
+void dmi_worker_launch(void);
+
+// Queue a batch for core 1 (waiting for a free slot if the ring is full) and
+// return a ticket for dmi_worker_done(). Call only from core 0.
+uint32_t dmi_worker_submit(dmi_worker_fn fn, void *user, jtag_vdtm_dmi_access_t *accesses, uint n);
+
+// Returns true once the batch with this ticket, and all batches submitted
+// before it, have completed. Results are then visible to the caller.
+bool dmi_worker_done(uint32_t ticket);
+
+// Wait for all submitted batches to complete
+void dmi_worker_flush(void);
+
+#endif
@@ -29,40 +29,427 @@
 #include "DAP_config.h"
 #include "DAP.h"
 
+#include "jtag_dp_vdtm.h"
 #include "jtag_vdtm.h"
 #include "swd_dmi.h"
+#include "dmi_prefetch.h"
+#include "dmi_capture.h"
+#include "latency.h"
+
+#include <string.h>
+
+// Perform DMI accesses on core 1 (see dmi_worker.h). Otherwise they run
+// synchronously in the DMI callback, on the core that runs the DAP task.
+#ifndef DMI_CORE1
+#define DMI_CORE1     1
+#endif
+
+#if DMI_CORE1
+#include "dmi_worker.h"
+#include "hardware/sync.h"
+#endif
 
 #define DTM_IDCODE    0xdeadbeef
-#define DMI_TARGETSEL 0
 #define DMI_APSEL     0
 
-static jtag_vdtm_t *dtm = 0;
-static swd_dmi_t *dmi = 0;
+// TARGETSEL values of the DPs on a multi-drop SWD link, each presented as its
+// own virtual TAP, starting from the TAP nearest TDO (CMSIS-DAP device index
+// 0). A single 0 means a single DP which doesn't need TARGETSEL. Can be
+// changed at runtime with vdtm_set_targetsel(). With several SWD ports (see
+// vdtm_set_swd_ports()), each port has this same list of DPs, and the TAPs
+// for port 0 are nearest TDO.
+#ifndef DMI_TARGETSEL
+#define DMI_TARGETSEL 0
+#endif
+
+#define VDTM_MAX_TAPS 4U
+
+// Default SWD link backend (see swd_link.h), can be changed at runtime with
+// vdtm_set_swd_link()
+#ifndef DMI_SWD_LINK
+#define DMI_SWD_LINK  PROBE_SWD_LINK
+#endif
+
+extern const swd_link_ops_t DMI_SWD_LINK;
+
+// Speculatively read ahead when the host streams memory through System Bus
+// Access. The read runs on core 1 between batches, so this needs DMI_CORE1.
+// Costs one extra bus read past the end of each stream.
+#ifndef DMI_PREFETCH
+#define DMI_PREFETCH  0
+#endif
+
+// Runs of at least this many writes within a batch, all to one DMI address or
+// to consecutive addresses, go out as a single SWD write burst (see
+// swd_dmi_write_burst()).
+#ifndef DMI_WRITE_BURST_MIN
+#define DMI_WRITE_BURST_MIN 2U
+#endif
+
+// Advertise a dtmcs.idle value based on measured DMI access latency: the
+// number of TCK cycles (at the host's JTAG clock setting) that the average
+// access over a rolling window of recent accesses takes on the SWD side.
+
+#define DMI_LATENCY_WINDOW 8U
+
+// One virtual DTM and the SWD DMI behind it. The DMI callback gets a pointer
+// to this as its user argument.
+typedef struct {
+  jtag_vdtm_t    *dtm;
+  swd_dmi_t      *dmi;
+  dmi_prefetch_t *prefetch;
+  const swd_link_ops_t *link;
+  void           *link_ctx;
+  uint32_t        swd_port;
+  uint32_t        targetsel;
+  bool            failed;
+  uint32_t        latency[DMI_LATENCY_WINDOW];
+  uint32_t        latency_sum;
+  uint32_t        latency_idx;
+  uint32_t        ticket;
+  // The idle hint has not yet been updated from batch `ticket`
+  bool            hint_due;
+  // Run the next batch on this core rather than core 1
+  bool            run_here;
+  // Core 1 has been given a dmi_prefetch_idle() job, with this ticket
+  bool            idle_queued;
+  uint32_t        idle_ticket;
+} vdtm_port_t;
+
+// The CMSIS-DAP JTAG functions below have no context argument, so they
+// always drive this chain of ports: TDI -> ports[n_ports - 1] -> ... ->
+// ports[0] -> TDO.
+static vdtm_port_t ports[VDTM_MAX_TAPS];
+static uint32_t n_ports = 0U;
+
+static const swd_link_ops_t *swd_link = &DMI_SWD_LINK;
+static void *swd_link_ctx[VDTM_MAX_TAPS] = {0};
+static uint32_t n_swd_ports = 1U;
+
+static uint32_t targetsel[VDTM_MAX_TAPS] = {DMI_TARGETSEL};
+static uint32_t n_targetsel = sizeof((uint32_t[]){DMI_TARGETSEL}) / sizeof(uint32_t);
+
+// Runs on whichever core performs the batch. The window is only read back
+// once the batch is done (see update_idle_hint()).
+static void record_latency(vdtm_port_t *p, uint32_t cycles) {
+  p->latency_sum += cycles - p->latency[p->latency_idx];
+  p->latency[p->latency_idx] = cycles;
+  p->latency_idx = (p->latency_idx + 1U) % DMI_LATENCY_WINDOW;
+}
+
+// Always called on core 0, which owns DAP_Data and the DTM, after the batch
+// which last updated the latency window has completed.
+static void update_idle_hint(vdtm_port_t *p) {
+  // Same TCK frequency calculation as SWJ clock setup in sw_dp_pio.c
+  uint32_t tck_khz = CPU_CLOCK / (2000U * (DAP_Data.clock_delay + 1U));
+  uint32_t div = DMI_LATENCY_WINDOW * swd_dmi_get_swclk_khz(p->dmi);
+  uint32_t idle_cycles = (p->latency_sum * tck_khz + div - 1U) / div;
+  // Encoding: 1 means pass through Run-Test/Idle without stopping
+  jtag_vdtm_set_idle_hint(p->dtm, idle_cycles ? idle_cycles + 1U : 0U);
+}
+
+// Number of writes starting at accesses[i] which can be issued as one burst.
+// *incr is set if they are to consecutive addresses.
+static uint32_t write_run(const jtag_vdtm_dmi_access_t *accesses, uint32_t n, uint32_t i, bool *incr) {
+  uint32_t k = 1U;
+  *incr = false;
+  if ((accesses[i].op != DMI_OP_WRITE) || (i + 1U >= n) || (accesses[i + 1U].op != DMI_OP_WRITE)) {
+    return k;
+  }
+  *incr = accesses[i + 1U].addr == accesses[i].addr + 1U;
+  while ((i + k < n) && (accesses[i + k].op == DMI_OP_WRITE) &&
+         (accesses[i + k].addr == accesses[i].addr + (*incr ? k : 0U))) {
+    k++;
+  }
+  return k;
+}
+
+// Perform a batch of accesses, blocking until complete. A failure is reported
+// back to the host as op=2, and the next batch then attempts to bring the
+// link back up before proceeding.
+//
+// Reads are posted, so runs of reads are pipelined on the SWD side, and the
+// last result is collected at the end of the batch. A failure may lose the
+// result of the read before it, so that read is reported as failed too. Long
+// runs of writes are sent as write bursts.
+
+static void vdtm_dmi_run_batch(void *user, jtag_vdtm_dmi_access_t *accesses, uint n) {
+  vdtm_port_t *p = (vdtm_port_t *)user;
+  uint8_t tap = (uint8_t)(p - ports);
+  uint32_t end = n;
+  uint32_t start = latency_now();
+  dmi_capture_put(CAPTURE_BATCH, tap, 0U, 0U, n);
+  if (p->failed) {
+    (void)swd_dmi_connect(p->dmi);
+    dmi_prefetch_reset(p->prefetch);
+  }
+  for (uint32_t i = 0U; i < n; ) {
+    bool incr;
+    uint32_t k = write_run(accesses, n, i, &incr);
+    uint32_t done;
+    if (k >= DMI_WRITE_BURST_MIN) {
+      uint32_t data[JTAG_VDTM_DMI_BATCH_MAX];
+      for (uint32_t j = 0U; j < k; j++) {
+        data[j] = accesses[i + j].data;
+      }
+      done = dmi_prefetch_write_burst(p->prefetch, accesses[i].addr, data, k, incr);
+      uint32_t cycles = swd_dmi_get_last_access_cycles(p->dmi) / k;
+      for (uint32_t j = 0U; j < k; j++) {
+        record_latency(p, cycles);
+      }
+    } else {
+      jtag_vdtm_dmi_access_t *a = &accesses[i];
+      int rc;
+      k = 1U;
+      if (a->op == DMI_OP_WRITE) {
+        rc = dmi_prefetch_write(p->prefetch, a->addr, a->data);
+      } else {
+        rc = dmi_prefetch_read_posted(p->prefetch, a->addr, &a->data);
+      }
+      if ((rc == 0) && (i == n - 1U)) {
+        rc = dmi_prefetch_flush(p->prefetch);
+      }
+      record_latency(p, swd_dmi_get_last_access_cycles(p->dmi));
+      done = rc == 0 ? 1U : 0U;
+    }
+    for (uint32_t j = 0U; j < done; j++) {
+      accesses[i + j].status = DMI_STATUS_OK;
+    }
+    i += done;
+    p->failed = done < k;
+    if (p->failed) {
+      accesses[i].status = DMI_STATUS_FAILED;
+      if ((i > 0U) && (accesses[i - 1U].op == DMI_OP_READ)) {
+        accesses[i - 1U].status = DMI_STATUS_FAILED;
+      }
+      end = i + 1U;
+      break;
+    }
+  }
+  for (uint32_t i = 0U; i < end; i++) {
+    dmi_capture_put(CAPTURE_DMI, tap, accesses[i].addr,
+                    (uint8_t)(accesses[i].op | (accesses[i].status << 4)), accesses[i].data);
+  }
+  (void)latency_record(LATENCY_SWD_WIRE, start);
+}
 
-void vdtm_write_dmi(dmi_addr_t addr, uint32_t wdata) {
-  swd_dmi_write(dmi, addr, wdata);
+#if DMI_CORE1
+// The DTM reports busy to the host until core 1 has finished the batch, so
+// the bit-accurate path carries on emulating JTAG in the meantime. (The
+// fast path waits, as its response includes the results.) Core 1 runs the
+// batches from all ports in order, so ports on one multi-drop link take
+// turns. So that TAPs on different SWD ports can work at the same time, the
+// fast path has core 0 run some of their batches itself (see run_here).
+//
+// With DMI_PREFETCH, each batch on core 1 is followed by a job which runs any
+// speculative read in the gap before the host's next packet. The batch is
+// reported done before that job starts.
+
+static void vdtm_dmi_idle(void *user, jtag_vdtm_dmi_access_t *accesses, uint n) {
+  vdtm_port_t *p = (vdtm_port_t *)user;
+  (void)accesses;
+  (void)n;
+  if (!p->failed) {
+    dmi_prefetch_idle(p->prefetch);
+  }
 }
 
-void vdtm_read_dmi(dmi_addr_t addr, uint32_t *rdata) {
-  swd_dmi_read(dmi, addr, rdata);
+static void vdtm_dmi_batch(void *user, jtag_vdtm_dmi_access_t *accesses, uint n) {
+  vdtm_port_t *p = (vdtm_port_t *)user;
+  uint32_t start = latency_now();
+  if (p->run_here) {
+    // Core 1 may still be speculating on this port
+    while (p->idle_queued && !dmi_worker_done(p->idle_ticket)) {
+      __wfe();
+    }
+    p->idle_queued = false;
+    vdtm_dmi_run_batch(p, accesses, n);
+    update_idle_hint(p);
+  } else {
+    p->ticket = dmi_worker_submit(&vdtm_dmi_run_batch, p, accesses, n);
+    p->hint_due = true;
+    if (DMI_PREFETCH != 0) {
+      p->idle_ticket = dmi_worker_submit(&vdtm_dmi_idle, p, NULL, 0U);
+      p->idle_queued = true;
+    }
+  }
+  (void)latency_record(LATENCY_DMI_CALLBACK, start);
+}
+
+static jtag_vdtm_dmi_status_t vdtm_dmi_status(void *user) {
+  vdtm_port_t *p = (vdtm_port_t *)user;
+  if (p->run_here) {
+    return DMI_STATUS_OK;
+  }
+  if (!dmi_worker_done(p->ticket)) {
+    return DMI_STATUS_BUSY;
+  }
+  // dmi_worker_done() orders this after core 1's writes to the window
+  if (p->hint_due) {
+    p->hint_due = false;
+    update_idle_hint(p);
+  }
+  return DMI_STATUS_OK;
+}
+#else
+static void vdtm_dmi_batch(void *user, jtag_vdtm_dmi_access_t *accesses, uint n) {
+  vdtm_dmi_run_batch(user, accesses, n);
+  update_idle_hint((vdtm_port_t *)user);
+}
+#endif
+
+void vdtm_set_swd_link(const swd_link_ops_t *link, void *link_ctx) {
+  vdtm_set_swd_ports(link, &link_ctx, 1U);
+}
+
+void vdtm_set_swd_ports(const swd_link_ops_t *link, void *const *link_ctx, uint n) {
+  swd_link = link;
+  n_swd_ports = n < 1U ? 1U : n < VDTM_MAX_TAPS ? n : VDTM_MAX_TAPS;
+  for (uint32_t i = 0U; i < n_swd_ports; i++) {
+    swd_link_ctx[i] = n ? link_ctx[i] : 0;
+  }
+}
+
+void vdtm_set_targetsel(const uint32_t *sel, uint n) {
+  if (n == 0U) {
+    // No DPs listed: a single DP without multi-drop
+    targetsel[0] = 0U;
+    n_targetsel = 1U;
+    return;
+  }
+  n_targetsel = n < VDTM_MAX_TAPS ? n : VDTM_MAX_TAPS;
+  memcpy(targetsel, sel, n_targetsel * sizeof(uint32_t));
+}
+
+void vdtm_get_dmi_stats(uint tap, swd_dmi_stats_t *stats) {
+  // Counters may be mid-update on core 1, which is fine for statistics
+  if (tap < n_ports) {
+    swd_dmi_get_stats(ports[tap].dmi, stats);
+  } else {
+    memset(stats, 0, sizeof(*stats));
+  }
+}
+
+static void destroy_ports(void) {
+  for (uint32_t i = 0U; i < n_ports; i++) {
+    dmi_prefetch_destroy(ports[i].prefetch);
+    swd_dmi_destroy(ports[i].dmi);
+    jtag_vdtm_destroy(ports[i].dtm);
+  }
+  memset(ports, 0, sizeof(ports));
+  n_ports = 0U;
 }
 
 void jtag_setup_vdtm(void) {
-  dtm = jtag_vdtm_create(DTM_IDCODE);
-  dmi = swd_dmi_create(DMI_TARGETSEL, DMI_APSEL);
-  jtag_vdtm_set_write_callback(dtm, &vdtm_write_dmi);
-  jtag_vdtm_set_read_callback(dtm, &vdtm_read_dmi);
-  (void)swd_dmi_connect(dmi);
+#if DMI_CORE1
+  // Core 1 may still be working on the previous ports
+  dmi_worker_flush();
+#endif
+  // TAP i is DP i % n_targetsel on SWD port i / n_targetsel, as far as
+  // there are TAPs to go round
+  uint32_t n = n_swd_ports * n_targetsel;
+  if (n > VDTM_MAX_TAPS) {
+    n = VDTM_MAX_TAPS;
+  }
+  // Keep the DMIs across setups with the same links and TARGETSELs, so that
+  // swd_dmi_connect() can skip the steps that found nothing changed last
+  // time.
+  bool keep = n_ports == n;
+  for (uint32_t i = 0U; keep && (i < n_ports); i++) {
+    keep = (ports[i].link == swd_link) && (ports[i].link_ctx == swd_link_ctx[i / n_targetsel]) &&
+      (ports[i].targetsel == targetsel[i % n_targetsel]);
+  }
+  if (!keep) {
+    destroy_ports();
+  }
+  for (uint32_t i = 0U; i < n; i++) {
+    vdtm_port_t *p = &ports[i];
+    uint32_t sel = i % n_targetsel;
+    if (p->dtm) {
+      jtag_vdtm_destroy(p->dtm);
+    }
+    p->dtm = jtag_vdtm_create(DTM_IDCODE);
+    if (!p->dmi) {
+      // The DPs on one SWD port share its link, and are told apart by
+      // TARGETSEL
+      p->swd_port = i / n_targetsel;
+      p->link = swd_link;
+      p->link_ctx = swd_link_ctx[p->swd_port];
+      p->targetsel = targetsel[sel];
+      if (sel == 0U) {
+        p->dmi = swd_dmi_create(p->link, p->link_ctx, p->targetsel, DMI_APSEL);
+      } else {
+        p->dmi = swd_dmi_create_shared(ports[i - sel].dmi, p->targetsel, DMI_APSEL);
+      }
+      p->prefetch = dmi_prefetch_create(p->dmi);
+      dmi_prefetch_set_enabled(p->prefetch, DMI_PREFETCH != 0);
+    } else {
+      dmi_prefetch_reset(p->prefetch);
+    }
+    jtag_vdtm_set_dmi_callback(p->dtm, &vdtm_dmi_batch, p);
+#if DMI_CORE1
+    jtag_vdtm_set_status_callback(p->dtm, &vdtm_dmi_status);
+#endif
+    p->failed = swd_dmi_connect(p->dmi) != 0;
+  }
+  n_ports = n;
+}
+
+// Virtual JTAG chain. TMS and TCK go to every TAP, and each TAP's TDI is the
+// TDO of the next one along, which it samples on the same rising edge. (TDO
+// only changes on falling edges.)
+
+static void chain_set_tms(bool tms) {
+  for (uint32_t i = 0U; i < n_ports; i++) {
+    jtag_vdtm_set_tms(ports[i].dtm, tms);
+  }
+}
+
+static void chain_set_tck(bool tck) {
+  if (tck) {
+    for (uint32_t i = 0U; i + 1U < n_ports; i++) {
+      jtag_vdtm_set_tdi(ports[i].dtm, jtag_vdtm_get_tdo(ports[i + 1U].dtm));
+    }
+  }
+  for (uint32_t i = 0U; i < n_ports; i++) {
+    jtag_vdtm_set_tck(ports[i].dtm, tck);
+  }
+}
+
+static void chain_set_tdi(bool tdi) {
+  jtag_vdtm_set_tdi(ports[n_ports - 1U].dtm, tdi);
+}
+
+static bool chain_get_tdo(void) {
+  return jtag_vdtm_get_tdo(ports[0].dtm);
+}
+
+static void chain_idle(uint32_t ncycles) {
+  for (uint32_t i = 0U; i < n_ports; i++) {
+    jtag_vdtm_idle(ports[i].dtm, ncycles);
+  }
+}
+
+// A TAP's outputs over a whole sequence depend only on its inputs, so the
+// chain can be shifted one TAP at a time, each taking the previous one's TDO
+// as TDI. n <= 64.
+static void chain_shift(const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo, uint32_t n) {
+  uint8_t buf[2][8];
+  for (uint32_t i = n_ports - 1U; i > 0U; i--) {
+    jtag_vdtm_shift(ports[i].dtm, tms, tdi, buf[i & 1U], n);
+    tdi = buf[i & 1U];
+  }
+  jtag_vdtm_shift(ports[0].dtm, tms, tdi, tdo, n);
 }
 
 // JTAG Macros
 
-#define PIN_TMS_SET()    do {jtag_vdtm_set_tms(dtm, 1  );} while (0)
-#define PIN_TMS_CLR()    do {jtag_vdtm_set_tms(dtm, 0  );} while (0)
-#define PIN_TCK_SET()    do {jtag_vdtm_set_tck(dtm, 1  );} while (0)
-#define PIN_TCK_CLR()    do {jtag_vdtm_set_tck(dtm, 0  );} while (0)
-#define PIN_TDI_OUT(tdi) do {jtag_vdtm_set_tdi(dtm, tdi);} while (0)
-#define PIN_TDO_IN()         jtag_vdtm_get_tdo(dtm)
+#define PIN_TMS_SET()    do {chain_set_tms(1  );} while (0)
+#define PIN_TMS_CLR()    do {chain_set_tms(0  );} while (0)
+#define PIN_TCK_SET()    do {chain_set_tck(1  );} while (0)
+#define PIN_TCK_CLR()    do {chain_set_tck(0  );} while (0)
+#define PIN_TDI_OUT(tdi) do {chain_set_tdi(tdi);} while (0)
+#define PIN_TDO_IN()         chain_get_tdo()
 #define PIN_DELAY()      do {                            } while (0)
 
 #define JTAG_CYCLE_TCK() \
@@ -102,36 +489,278 @@ void jtag_setup_vdtm(void) {
 //   tdo:    pointer to TDO captured data
 //   return: none
 void JTAG_Sequence (uint32_t info, const uint8_t *tdi, uint8_t *tdo) {
-  uint32_t i_val;
-  uint32_t o_val;
-  uint32_t bit;
-  uint32_t n, k;
+  static const uint8_t tms_ones[8]  = {0xffU, 0xffU, 0xffU, 0xffU, 0xffU, 0xffU, 0xffU, 0xffU};
+  static const uint8_t tms_zeros[8] = {0U};
+  uint32_t n;
 
   n = info & JTAG_SEQUENCE_TCK;
   if (n == 0U) {
     n = 64U;
   }
 
-  if (info & JTAG_SEQUENCE_TMS) {
-    PIN_TMS_SET();
-  } else {
-    PIN_TMS_CLR();
+  // Hand the whole sequence to the DTMs in one go, rather than bit-banging it
+  // through the PIN_xxx() macros one edge at a time.
+  chain_shift((info & JTAG_SEQUENCE_TMS) ? tms_ones : tms_zeros, tdi,
+    (info & JTAG_SEQUENCE_TDO) ? tdo : NULL, n);
+}
+
+
+// DMI scan recogniser
+//
+// OpenOCD's RISC-V driver talks to the DTM almost entirely through DMI scans
+// which start and end in Run-Test/Idle, optionally followed by some idle
+// cycles, several to a JTAG_Sequence packet. Each sequence in the packet has
+// a constant TMS value, but how the scans are split into sequences varies, so
+// match on the flattened TMS bitstream. Relative to the start of each scan:
+//
+//   bit  0       TMS=1  Run-Test/Idle -> Select-DR-Scan
+//   bits 1..2    TMS=0  -> Capture-DR -> Shift-DR
+//   bits 3..43   TMS=0  Shift DR bits 0..40
+//   bit  44      TMS=1  Shift DR bit 41, -> Exit1-DR
+//   bit  45      TMS=1  -> Update-DR
+//   bit  46      TMS=0  -> Run-Test/Idle
+//   bits 47..    TMS=0  Run-Test/Idle, until the next scan's first TMS=1
+//
+// TDO is 0 everywhere except the 42 shift bits. Packets which match are
+// decoded into DMI scans and idle cycle counts on the DTM directly, and the
+// response synthesised; anything else goes through the bit-accurate
+// emulation as usual.
+//
+// With several TAPs in the chain, this works when every TAP has either the
+// DMI or BYPASS selected. The DR is then the TAPs' DRs end to end, starting
+// from the TAP nearest TDO, and each scan carries one DMI access for each
+// TAP with the DMI selected. OpenOCD selects one at a time, but a host can
+// select several to drive their DMs in parallel.
+
+#define SCAN_W_DMI      42U
+#define SCAN_POS_SHIFT  3U
+#define SCAN_POS_EXIT1(m) (SCAN_POS_SHIFT + (m)->dr_len - 1U)
+#define SCAN_POS_IDLE(m)  (SCAN_POS_EXIT1(m) + 3U)
+#define SCAN_MAX_DMI    8U
+
+typedef struct {
+  // Whole DR length, and for each TAP with the DMI selected, which TAP it
+  // is and where its DMI bits sit in the DR
+  uint32_t dr_len;
+  uint32_t n_dmi;
+  uint32_t dmi_tap[VDTM_MAX_TAPS];
+  uint32_t dmi_offset[VDTM_MAX_TAPS];
+  uint32_t pos;
+  uint32_t n_scans;
+  uint64_t dr_in[VDTM_MAX_TAPS][SCAN_MAX_DMI];
+  uint64_t dr_out[VDTM_MAX_TAPS][SCAN_MAX_DMI];
+  // idle[i] is the number of Run-Test/Idle cycles following the ith scan
+  // (or, for i = 0, preceding the first scan)
+  uint32_t idle[SCAN_MAX_DMI + 1];
+} dmi_scan_match_t;
+
+// Extract n <= 57 bits from a packed bit vector, starting at bit offset
+static uint64_t get_bit_run (const uint8_t *v, uint32_t offset, uint32_t n) {
+  uint32_t nbytes = (offset % 8U + n + 7U) / 8U;
+  uint64_t x = 0U;
+  for (uint32_t i = 0U; i < nbytes; i++) {
+    x |= (uint64_t)v[offset / 8U + i] << (8U * i);
+  }
+  return (x >> (offset % 8U)) & ((1ULL << n) - 1U);
+}
+
+// Advance the matcher over one sequence of n cycles. Gathers TDI bits into
+// dr_in, or, if tdo is non-NULL, ORs the TDO bits from dr_out into tdo.
+// Returns 0 if the sequence doesn't fit the template.
+static uint32_t dmi_scan_match_seq (dmi_scan_match_t *m, uint32_t tms, uint32_t n,
+                                    const uint8_t *tdi, uint8_t *tdo) {
+  uint32_t offset = 0U;
+  while (offset < n) {
+    if (m->pos >= SCAN_POS_IDLE(m)) {
+      if (!tms) {
+        m->idle[m->n_scans] += n - offset;
+        break;
+      }
+      if (m->n_scans == SCAN_MAX_DMI) {
+        return 0U;
+      }
+      for (uint32_t w = 0U; w < m->n_dmi; w++) {
+        m->dr_in[w][m->n_scans] = 0U;
+      }
+      m->n_scans++;
+      m->idle[m->n_scans] = 0U;
+      m->pos = 0U;
+    }
+    uint32_t seg_end;
+    uint32_t seg_tms;
+    if (m->pos < 1U) {
+      seg_end = 1U;                  seg_tms = 1U;
+    } else if (m->pos < SCAN_POS_EXIT1(m)) {
+      seg_end = SCAN_POS_EXIT1(m);      seg_tms = 0U;
+    } else if (m->pos < SCAN_POS_IDLE(m) - 1U) {
+      seg_end = SCAN_POS_IDLE(m) - 1U;  seg_tms = 1U;
+    } else {
+      seg_end = SCAN_POS_IDLE(m);       seg_tms = 0U;
+    }
+    if (tms != seg_tms) {
+      return 0U;
+    }
+    uint32_t k = seg_end - m->pos;
+    if (k > n - offset) {
+      k = n - offset;
+    }
+    // Overlap of these k cycles with each TAP's DMI shift bits
+    for (uint32_t w = 0U; w < m->n_dmi; w++) {
+      uint32_t dmi_lo = SCAN_POS_SHIFT + m->dmi_offset[w];
+      uint32_t dmi_hi = dmi_lo + SCAN_W_DMI;
+      uint32_t lo = m->pos > dmi_lo ? m->pos : dmi_lo;
+      uint32_t hi = m->pos + k < dmi_hi ? m->pos + k : dmi_hi;
+      if (lo >= hi) {
+        continue;
+      }
+      uint32_t scan = m->n_scans - 1U;
+      uint32_t dr_bit = lo - dmi_lo;
+      uint32_t seq_bit = offset + lo - m->pos;
+      if (tdo) {
+        uint64_t x = (m->dr_out[w][scan] >> dr_bit) & ((1ULL << (hi - lo)) - 1U);
+        x <<= seq_bit % 8U;
+        for (uint32_t i = 0U; i < (seq_bit % 8U + hi - lo + 7U) / 8U; i++) {
+          tdo[seq_bit / 8U + i] |= (uint8_t)(x >> (8U * i));
+        }
+      } else {
+        m->dr_in[w][scan] |= get_bit_run(tdi, seq_bit, hi - lo) << dr_bit;
+      }
+    }
+    m->pos += k;
+    offset += k;
   }
+  return 1U;
+}
 
-  while (n) {
-    i_val = *tdi++;
-    o_val = 0U;
-    for (k = 8U; k && n; k--, n--) {
-      JTAG_CYCLE_TDIO(i_val, bit);
-      i_val >>= 1;
-      o_val >>= 1;
-      o_val  |= bit << 7;
+// Walk all the sequences in a JTAG_Sequence request, with the response TDO
+// data going to response if non-NULL. Returns the request length (excluding
+// the command byte), or 0 on mismatch, and the TDO data length in tdo_len.
+static uint32_t dmi_scan_match_packet (dmi_scan_match_t *m, const uint8_t *request,
+                                       uint8_t *response, uint32_t *tdo_len) {
+  const uint8_t *req = request + 1U;
+  uint32_t count = *request;
+  *tdo_len = 0U;
+  m->pos = SCAN_POS_IDLE(m);
+  m->n_scans = 0U;
+  m->idle[0] = 0U;
+  while (count--) {
+    uint32_t info = *req++;
+    uint32_t n = info & JTAG_SEQUENCE_TCK;
+    if (n == 0U) {
+      n = 64U;
+    }
+    uint32_t nbytes = (n + 7U) / 8U;
+    if ((uint32_t)(req + nbytes - request) >= DAP_PACKET_SIZE) {
+      return 0U;
     }
-    o_val >>= k;
+    uint8_t *tdo = NULL;
     if (info & JTAG_SEQUENCE_TDO) {
-      *tdo++ = (uint8_t)o_val;
+      if (response) {
+        tdo = response + *tdo_len;
+        memset(tdo, 0, nbytes);
+      }
+      *tdo_len += nbytes;
     }
+    if (!dmi_scan_match_seq(m, (info & JTAG_SEQUENCE_TMS) ? 1U : 0U, n, req, tdo)) {
+      return 0U;
+    }
+    req += nbytes;
+  }
+  // Must finish back in Run-Test/Idle
+  if (m->pos < SCAN_POS_IDLE(m)) {
+    return 0U;
   }
+  return (uint32_t)(req - request);
+}
+
+// Run the matched scans on each TAP with the DMI selected. All the batches
+// are issued before any is waited for, so TAPs on different SWD ports work
+// concurrently. A TAP whose bit-accurate access is still on core 1 reports
+// busy and issues nothing, and its DTM keeps that access queued until core 1
+// is done with it.
+static void scan_dmi_taps (dmi_scan_match_t *m) {
+  uint32_t here = 0U;
+#if DMI_CORE1
+  // Core 1 runs batches one at a time, so have this core, which would
+  // otherwise just wait, run every other SWD port's batches itself. Anything
+  // still running from the bit-accurate path must finish first, so that no
+  // port is driven from both cores at once.
+  uint32_t seen = 0U;
+  uint32_t n_seen = 0U;
+  for (uint32_t w = 0U; w < m->n_dmi; w++) {
+    uint32_t bit = 1U << ports[m->dmi_tap[w]].swd_port;
+    if (!(seen & bit)) {
+      if (n_seen++ & 1U) {
+        here |= bit;
+      }
+      seen |= bit;
+    }
+  }
+  if (here) {
+    dmi_worker_flush();
+  }
+#endif
+  // Core 1's batches go first, so they are under way while this core works
+  for (uint32_t pass = 0U; pass < 2U; pass++) {
+    for (uint32_t w = 0U; w < m->n_dmi; w++) {
+      vdtm_port_t *p = &ports[m->dmi_tap[w]];
+      bool run_here = (here >> p->swd_port) & 1U;
+      if (run_here == (pass == 1U)) {
+        p->run_here = run_here;
+        jtag_vdtm_scan_dmi_issue(p->dtm, m->dr_in[w], m->n_scans);
+      }
+    }
+  }
+  for (uint32_t w = 0U; w < m->n_dmi; w++) {
+    vdtm_port_t *p = &ports[m->dmi_tap[w]];
+    jtag_vdtm_scan_dmi_complete(p->dtm, m->dr_in[w], m->dr_out[w], m->n_scans);
+    p->run_here = false;
+  }
+}
+
+uint32_t vdtm_process_command(const uint8_t *request, uint8_t *response) {
+  static dmi_scan_match_t m;
+  uint32_t req_len;
+  uint32_t resp_len;
+
+  if (!n_ports || *request != ID_DAP_JTAG_Sequence || DAP_Data.debug_port != DAP_PORT_JTAG) {
+    return 0U;
+  }
+  // Every TAP must have the DMI or BYPASS selected, and at least one the DMI
+  m.dr_len = 0U;
+  m.n_dmi = 0U;
+  for (uint32_t i = 0U; i < n_ports; i++) {
+    if (jtag_vdtm_can_scan_dmi(ports[i].dtm)) {
+      m.dmi_tap[m.n_dmi] = i;
+      m.dmi_offset[m.n_dmi++] = m.dr_len;
+      m.dr_len += SCAN_W_DMI;
+    } else if (jtag_vdtm_is_bypassed(ports[i].dtm)) {
+      m.dr_len += 1U;
+    } else {
+      return 0U;
+    }
+  }
+  if (m.n_dmi == 0U) {
+    return 0U;
+  }
+  // First pass: check the packet fits the template, and gather DR values
+  req_len = dmi_scan_match_packet(&m, request + 1U, NULL, &resp_len);
+  if (req_len == 0U) {
+    return 0U;
+  }
+  // The DMI accesses are issued as one batch and waited for, so idle cycles
+  // between scans don't affect the result, and can be counted up front.
+  uint32_t idle = 0U;
+  for (uint32_t i = 0U; i <= m.n_scans; i++) {
+    idle += m.idle[i];
+  }
+  chain_idle(idle);
+  scan_dmi_taps(&m);
+  // Second pass: synthesise TDO from the captured DR values
+  (void)dmi_scan_match_packet(&m, request + 1U, response + 2U, &resp_len);
+  response[0] = ID_DAP_JTAG_Sequence;
+  response[1] = DAP_OK;
+  return ((1U + req_len) << 16) | (2U + resp_len);
 }
 
 
@@ -268,10 +897,7 @@ exit:
   }                                                                             \
                                                                                 \
   /* Idle cycles */                                                             \
-  n = DAP_Data.transfer.idle_cycles;                                            \
-  while (n--) {                                                                 \
-    JTAG_CYCLE_TCK();                       /* Idle */                          \
-  }                                                                             \
+  chain_idle(DAP_Data.transfer.idle_cycles);                                    \
                                                                                 \
   return ((uint8_t)ack);                                                        \
 }
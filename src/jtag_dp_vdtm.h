@@ -0,0 +1,42 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0 
+
+// Glue between CMSIS-DAP's JTAG support and the virtual DTM
+
+#ifndef _JTAG_DP_VDTM_H
+#define _JTAG_DP_VDTM_H
+
+#include <stdint.h>
+
+#include "swd_link.h"
+#include "swd_dmi.h"
+
+// Try to process a CMSIS-DAP command without going through the bit-accurate
+// JTAG emulation. Currently this handles JTAG_Sequence commands which consist
+// only of whole DMI scans and Run-Test/Idle cycles, as issued by OpenOCD's
+// RISC-V driver. Returns 0 if the command was not handled (call
+// DAP_ProcessCommand() instead), otherwise returns the same as
+// DAP_ProcessCommand(): response length in the lower 16 bits, request length
+// in the upper 16 bits.
+uint32_t vdtm_process_command(const uint8_t *request, uint8_t *response);
+
+// Select the SWD link to the target's DM, taking effect from the next
+// jtag_setup_vdtm(). The default is set by DMI_SWD_LINK.
+void vdtm_set_swd_link(const swd_link_ops_t *link, void *link_ctx);
+
+// Same, but with n separate SWD ports, each with its own context for the
+// link, and its own TAPs (see vdtm_set_targetsel()). DMI accesses to
+// different ports may run at the same time, on different cores.
+void vdtm_set_swd_ports(const swd_link_ops_t *link, void *const *link_ctx, uint n);
+
+// Set the TARGETSEL values of the DPs on a multi-drop link, one virtual TAP
+// each, starting with the TAP nearest TDO. With several SWD ports, each port
+// has the same DPs. Takes effect from the next jtag_setup_vdtm(). The
+// default is set by DMI_TARGETSEL.
+void vdtm_set_targetsel(const uint32_t *targetsel, uint n);
+
+// WAIT/FAULT/retry counters and learned idle cycles of the SWD DMI behind
+// one TAP
+void vdtm_get_dmi_stats(uint tap, swd_dmi_stats_t *stats);
+
+#endif
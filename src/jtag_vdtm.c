@@ -8,14 +8,17 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "hardware/sync.h"
+
 #ifndef DTM_LOG_LEVEL
 #define DTM_LOG_LEVEL 3
 #endif
 
+// Logging is deferred (see dlog.h), so the DMI dump can stay enabled
 #if DTM_LOG_LEVEL > 0
-#include <stdio.h>
+#include "dlog.h"
 #define dtm_log_at_level(level, ...) do { \
-	if (DTM_LOG_LEVEL >= level) printf(__VA_ARGS__); \
+	if (DTM_LOG_LEVEL >= level) dlog(__VA_ARGS__); \
 } while (0)
 #else
 #define dtm_log_at_level(level, ...) ((void)0)
@@ -48,24 +51,43 @@ typedef enum jtag_tap_state {
 
 struct jtag_vdtm {
 	uint8_t ir;
+	uint8_t dr_len;
 	uint64_t shifter;
 	uint32_t idcode;
 	jtag_tap_state_t tap_state;
 	uint32_t dmi_rdata;
-	jtag_vdtm_write_callback write_callback;
-	jtag_vdtm_read_callback read_callback;
+	uint32_t idle_cycles;
+	jtag_vdtm_dmi_callback dmi_callback;
+	jtag_vdtm_status_callback status_callback;
+	void *dmi_user;
+	// Sticky DMI status, reported in dtmcs.dmistat and DMI op
+	uint8_t dmistat;
+	// Number of accesses at the start of dmi_queue which have been issued
+	// but not yet seen to complete
+	uint8_t dmi_queued;
+	jtag_vdtm_dmi_access_t dmi_queue[JTAG_VDTM_DMI_BATCH_MAX];
+	// DR captured by the first scan of a batch, from issue until complete
+	uint64_t batch_capture;
+	// Number of accesses the batch put in dmi_queue, from issue until
+	// complete. If none, anything in the queue is an earlier access which
+	// may still be in flight.
+	uint8_t batch_queued;
+	uint8_t idle_hint;
 	bool tck;
 	bool tms;
 	bool tdi;
 	bool tdo;
 };
 
+static void init_tap_fsm_lut(void);
+
 jtag_vdtm_t *jtag_vdtm_create(uint32_t idcode) {
 	jtag_vdtm_t *dtm = malloc(sizeof(jtag_vdtm_t));
 	if (!dtm)
 		return dtm;
 	memset(dtm, 0, sizeof(*dtm));
 	dtm->idcode = idcode;
+	init_tap_fsm_lut();
 	return dtm;
 }
 
@@ -73,12 +95,19 @@ void jtag_vdtm_destroy(jtag_vdtm_t *dtm) {
 	free(dtm);
 }
 
-void jtag_vdtm_set_write_callback(jtag_vdtm_t *dtm, jtag_vdtm_write_callback cb) {
-	dtm->write_callback = cb;
+void jtag_vdtm_set_dmi_callback(jtag_vdtm_t *dtm, jtag_vdtm_dmi_callback cb, void *user) {
+	dtm->dmi_callback = cb;
+	dtm->dmi_user = user;
 }
 
-void jtag_vdtm_set_read_callback(jtag_vdtm_t *dtm, jtag_vdtm_read_callback cb) {
-	dtm->read_callback = cb;
+void jtag_vdtm_set_status_callback(jtag_vdtm_t *dtm, jtag_vdtm_status_callback cb) {
+	dtm->status_callback = cb;
+}
+
+#define DTMCS_IDLE_MAX 7
+
+void jtag_vdtm_set_idle_hint(jtag_vdtm_t *dtm, uint idle) {
+	dtm->idle_hint = idle > DTMCS_IDLE_MAX ? DTMCS_IDLE_MAX : idle;
 }
 
 void jtag_vdtm_set_tms(jtag_vdtm_t *dtm, bool tms) {
@@ -149,6 +178,74 @@ static jtag_tap_state_t step_tap_fsm(jtag_tap_state_t state, bool tms) {
 	}
 }
 
+// States where TMS=0 just clocks the TAP in place, with no side effects.
+// These cycles are counted in idle_cycles, so that time spent there can be
+// accounted for, but are otherwise skipped as fast as possible.
+static inline bool tap_state_is_idle(jtag_tap_state_t state) {
+	return state == S_RUN_IDLE || state == S_PAUSE_DR || state == S_PAUSE_IR;
+}
+
+// The TAP FSM can also be stepped eight TCKs at a time, using a table indexed
+// by (state, TMS byte). Each entry holds the final state, plus a mask of
+// events for the states the TAP was in at each of the eight rising edges
+// (i.e. the states whose posedge actions tck_posedge() would have run), and
+// the number of idle cycles (see tap_state_is_idle()) among them. A byte of
+// TMS with no events has no effect besides the change of state and the idle
+// count.
+//
+// The table is generated from step_tap_fsm() on first use, so the two can't
+// disagree. 8 kB of RAM.
+
+#define TAP_EV_RESET      (1u << 0)
+#define TAP_EV_CAPTURE_DR (1u << 1)
+#define TAP_EV_SHIFT_DR   (1u << 2)
+#define TAP_EV_UPDATE_DR  (1u << 3)
+#define TAP_EV_CAPTURE_IR (1u << 4)
+#define TAP_EV_SHIFT_IR   (1u << 5)
+#define TAP_EV_UPDATE_IR  (1u << 6)
+
+static const uint8_t tap_state_events[16] = {
+	[S_RESET]      = TAP_EV_RESET,
+	[S_CAPTURE_DR] = TAP_EV_CAPTURE_DR,
+	[S_SHIFT_DR]   = TAP_EV_SHIFT_DR,
+	[S_UPDATE_DR]  = TAP_EV_UPDATE_DR,
+	[S_CAPTURE_IR] = TAP_EV_CAPTURE_IR,
+	[S_SHIFT_IR]   = TAP_EV_SHIFT_IR,
+	[S_UPDATE_IR]  = TAP_EV_UPDATE_IR,
+};
+
+#define TAP_LUT_STATE_MASK 0xfu
+#define TAP_LUT_IDLE_LSB   4
+#define TAP_LUT_IDLE_MASK  0xfu
+#define TAP_LUT_EVENTS_LSB 8
+
+static uint16_t tap_fsm_lut[16][256];
+static bool tap_fsm_lut_valid;
+
+static void init_tap_fsm_lut(void) {
+	if (tap_fsm_lut_valid)
+		return;
+	for (uint state = 0; state < 16; ++state) {
+		for (uint tms = 0; tms < 256; ++tms) {
+			jtag_tap_state_t s = (jtag_tap_state_t)state;
+			uint events = 0;
+			uint idle = 0;
+			for (uint i = 0; i < 8; ++i) {
+				bool tms_bit = (tms >> i) & 1u;
+				events |= tap_state_events[s];
+				idle += tap_state_is_idle(s) && !tms_bit;
+				s = step_tap_fsm(s, tms_bit);
+			}
+			tap_fsm_lut[state][tms] = (uint16_t)(
+				s |
+				idle << TAP_LUT_IDLE_LSB |
+				events << TAP_LUT_EVENTS_LSB
+			);
+		}
+	}
+	tap_fsm_lut_valid = true;
+}
+
 #define W_IR 5
 #define IR_BYPASS 0x00
 #define IR_IDCODE 0x01
@@ -174,6 +271,7 @@ static void tck_posedge(jtag_vdtm_t *dtm) {
 	switch (dtm->tap_state) {
 	case S_RESET:
 		dtm->ir = IR_IDCODE;
+		dtm->dr_len = dr_len(dtm->ir);
 		dtm_dump_tap("TAP: RESET\n");
 		break;
 	case S_CAPTURE_IR:
@@ -185,13 +283,17 @@ static void tck_posedge(jtag_vdtm_t *dtm) {
 		break;
 	case S_UPDATE_IR:
 		dtm->ir = dtm->shifter;
+		dtm->dr_len = dr_len(dtm->ir);
 		dtm_dump_tap("TAP: UPDATE  IR <- %02x\n", dtm->ir);
 		break;
+	case S_RUN_IDLE:
+	case S_PAUSE_DR:
+	case S_PAUSE_IR:
+		if (!dtm->tms)
+			++dtm->idle_cycles;
+		break;
 	case S_CAPTURE_DR:
 		switch(dtm->ir) {
-		case IR_BYPASS:
-			dtm->shifter = 0;
-			break;
 		case IR_IDCODE:
 			dtm->shifter = dtm->idcode;
 			break;
@@ -202,12 +304,14 @@ static void tck_posedge(jtag_vdtm_t *dtm) {
 			dtm->shifter = handle_dmi_read(dtm);
 			break;
 		default:
+			// BYPASS, which is also what any unimplemented IR selects
+			dtm->shifter = 0;
 			break;
 		}
 		dtm_dump_tap("TAP: CAPTURE DR -> %011llx\n", dtm->shifter);
 		break;
 	case S_SHIFT_DR:
-		dtm->shifter = (dtm->shifter >> 1) | ((uint64_t)dtm->tdi << (dr_len(dtm->ir) - 1));
+		dtm->shifter = (dtm->shifter >> 1) | ((uint64_t)dtm->tdi << (dtm->dr_len - 1));
 		break;
 	case S_UPDATE_DR:
 		dtm_dump_tap("TAP: UPDATE  DR <- %011llx\n", dtm->shifter);
@@ -230,47 +334,358 @@ static void tck_posedge(jtag_vdtm_t *dtm) {
 	dtm->tap_state = step_tap_fsm(dtm->tap_state, dtm->tms);
 }
 
+// Extract n <= 57 bits starting at bit offset from a packed bit vector
+static inline uint64_t get_bit_run(const uint8_t *v, uint offset, uint n) {
+	uint nbytes = (offset % 8 + n + 7) / 8;
+	uint64_t x = 0;
+	for (uint i = 0; i < nbytes; ++i)
+		x |= (uint64_t)v[offset / 8 + i] << (8 * i);
+	return (x >> (offset % 8)) & ((1ull << n) - 1);
+}
+
+// OR n <= 57 bits into a packed bit vector, starting at bit offset
+static inline void put_bit_run(uint8_t *v, uint offset, uint64_t x, uint n) {
+	uint nbytes = (offset % 8 + n + 7) / 8;
+	x <<= offset % 8;
+	for (uint i = 0; i < nbytes; ++i)
+		v[offset / 8 + i] |= (uint8_t)(x >> (8 * i));
+}
+
+void jtag_vdtm_shift(jtag_vdtm_t *dtm, const uint8_t *tms, const uint8_t *tdi,
+		uint8_t *tdo, uint nbits) {
+	// Each bit is a falling edge, a TDO sample, then a rising edge. There is
+	// no need to track TCK per edge, as TDO only changes following posedge.
+	bool tdo_bit = dtm->tdo;
+	if (tdo)
+		memset(tdo, 0, (nbits + 7) / 8);
+	uint i = 0;
+	while (i < nbits) {
+		jtag_tap_state_t state = dtm->tap_state;
+		if (state == S_SHIFT_DR || state == S_SHIFT_IR) {
+			// Shift a run of bits in one go. The run ends at the first TMS=1
+			// (which still shifts, on the way to Exit1-xR) or after one full
+			// register length, so that every TDO bit comes from the captured
+			// value rather than from TDI bits inserted during the run.
+			uint len = state == S_SHIFT_IR ? W_IR : dtm->dr_len;
+			uint n = nbits - i < len ? nbits - i : len;
+			uint64_t tms_run = get_bit_run(tms, i, n);
+			if (tms_run)
+				n = __builtin_ctzll(tms_run) + 1;
+			uint64_t tdi_run = get_bit_run(tdi, i, n);
+			if (tdo)
+				put_bit_run(tdo, i, dtm->shifter & ((1ull << n) - 1), n);
+			tdo_bit = (dtm->shifter >> (n - 1)) & 1u;
+			dtm->shifter = (dtm->shifter >> n) | (tdi_run << (len - n));
+			dtm->tms = (tms_run >> (n - 1)) & 1u;
+			dtm->tdi = (tdi_run >> (n - 1)) & 1u;
+			if (dtm->tms)
+				dtm->tap_state = state == S_SHIFT_DR ? S_EXIT1_DR : S_EXIT1_IR;
+			dtm_dump_tck("SHIFT %u bits TDI=%llx -> TDO=%d\n", n, tdi_run, get_next_tdo(dtm));
+			i += n;
+			continue;
+		}
+		// Count off a run of idle cycles in one go. TDO is always 0 outside
+		// of Shift-xR.
+		if (tap_state_is_idle(state)) {
+			uint n = nbits - i < 57 ? nbits - i : 57;
+			uint64_t tms_run = get_bit_run(tms, i, n);
+			if (tms_run)
+				n = __builtin_ctzll(tms_run);
+			if (n) {
+				dtm->idle_cycles += n;
+				dtm->tms = 0;
+				dtm->tdi = (tdi[(i + n - 1) / 8] >> ((i + n - 1) % 8)) & 1u;
+				tdo_bit = 0;
+				i += n;
+				continue;
+			}
+		}
+		// Skip whole bytes of TMS in O(1) if they don't pass through any
+		// states with side effects (e.g. navigating to Shift-IR).
+		if (i % 8 == 0 && nbits - i >= 8) {
+			uint16_t entry = tap_fsm_lut[state][tms[i / 8]];
+			if (!(entry >> TAP_LUT_EVENTS_LSB)) {
+				dtm->idle_cycles += (entry >> TAP_LUT_IDLE_LSB) & TAP_LUT_IDLE_MASK;
+				dtm->tap_state = (jtag_tap_state_t)(entry & TAP_LUT_STATE_MASK);
+				dtm->tms = tms[i / 8] >> 7;
+				dtm->tdi = tdi[i / 8] >> 7;
+				tdo_bit = 0;
+				i += 8;
+				continue;
+			}
+		}
+		uint bit = i % 8;
+		dtm->tms = (tms[i / 8] >> bit) & 1u;
+		dtm->tdi = (tdi[i / 8] >> bit) & 1u;
+		tdo_bit = get_next_tdo(dtm);
+		if (tdo)
+			tdo[i / 8] |= (uint8_t)tdo_bit << bit;
+		tck_posedge(dtm);
+		dtm_dump_tck("STEP TMS=%d TDI=%d -> TDO=%d\n", dtm->tms, dtm->tdi, get_next_tdo(dtm));
+		++i;
+	}
+	// Leave the pin-level state as though the bits had been clocked through
+	// jtag_vdtm_set_tck(), so the two interfaces can be mixed.
+	dtm->tdo = tdo_bit;
+	dtm->tck = true;
+}
+
+void jtag_vdtm_idle(jtag_vdtm_t *dtm, uint ncycles) {
+	dtm->tms = 0;
+	// From anywhere other than Shift-xR, this reaches an idle state within
+	// a couple of cycles:
+	while (ncycles && !tap_state_is_idle(dtm->tap_state)) {
+		dtm->tdo = get_next_tdo(dtm);
+		tck_posedge(dtm);
+		--ncycles;
+	}
+	if (ncycles) {
+		dtm->idle_cycles += ncycles;
+		dtm->tdo = 0;
+	}
+	dtm->tck = true;
+}
+
+uint32_t jtag_vdtm_get_idle_cycles(jtag_vdtm_t *dtm) {
+	return dtm->idle_cycles;
+}
+
+bool jtag_vdtm_can_scan_dmi(jtag_vdtm_t *dtm) {
+	return dtm->tap_state == S_RUN_IDLE && dtm->ir == IR_DMI;
+}
+
+bool jtag_vdtm_is_bypassed(jtag_vdtm_t *dtm) {
+	return dtm->tap_state == S_RUN_IDLE && dr_len(dtm->ir) == 1;
+}
+
+static void scan_dmi_issue(jtag_vdtm_t *dtm, const uint64_t *dr_in, uint n);
+static void scan_dmi_complete(jtag_vdtm_t *dtm, const uint64_t *dr_in, uint64_t *dr_out, uint n);
+
+uint64_t jtag_vdtm_scan_dmi(jtag_vdtm_t *dtm, uint64_t dr_in) {
+	uint64_t captured = handle_dmi_read(dtm);
+	dtm_dump_tap("TAP: CAPTURE DR -> %011llx\n", captured);
+	dtm->shifter = dr_in & ((1ull << W_DMI) - 1);
+	dtm_dump_tap("TAP: UPDATE  DR <- %011llx\n", dtm->shifter);
+	handle_dmi_write(dtm, dtm->shifter);
+	// Pin state as left by the final Update-DR -> Run-Test/Idle cycle
+	dtm->tap_state = S_RUN_IDLE;
+	dtm->tms = 0;
+	dtm->tdo = 0;
+	dtm->tck = true;
+	return captured;
+}
+
+void jtag_vdtm_scan_dmi_batch(jtag_vdtm_t *dtm, const uint64_t *dr_in,
+		uint64_t *dr_out, uint n) {
+	while (n) {
+		uint chunk = n > JTAG_VDTM_DMI_BATCH_MAX ? JTAG_VDTM_DMI_BATCH_MAX : n;
+		scan_dmi_issue(dtm, dr_in, chunk);
+		scan_dmi_complete(dtm, dr_in, dr_out, chunk);
+		dr_in += chunk;
+		dr_out += chunk;
+		n -= chunk;
+	}
+	dtm->tap_state = S_RUN_IDLE;
+	dtm->tms = 0;
+	dtm->tdo = 0;
+	dtm->tck = true;
+}
+
+void jtag_vdtm_scan_dmi_issue(jtag_vdtm_t *dtm, const uint64_t *dr_in, uint n) {
+	if (n)
+		scan_dmi_issue(dtm, dr_in, n);
+}
+
+void jtag_vdtm_scan_dmi_complete(jtag_vdtm_t *dtm, const uint64_t *dr_in,
+		uint64_t *dr_out, uint n) {
+	if (n)
+		scan_dmi_complete(dtm, dr_in, dr_out, n);
+	dtm->tap_state = S_RUN_IDLE;
+	dtm->tms = 0;
+	dtm->tdo = 0;
+	dtm->tck = true;
+}
+
 // ----------------------------------------------------------------------------
 // DTM core implementation
 
-#define DMI_OP_WRITE 2
-#define DMI_OP_READ 1
-#define DMI_OP_NONE 0
+// DMI accesses are issued at Update-DR, and their result is collected at the
+// next Capture-DR. If there is a status callback, accesses may still be in
+// flight when the host comes back for the result, in which case we report
+// busy, as per the spec. Busy and failed statuses are sticky (and further DMI
+// ops are ignored) until cleared via dtmcs.dmireset.
+//
+// Accesses go to the backend through dmi_queue. Scans clocked through the
+// TAP queue one access at a time, whereas scan_dmi_batch() queues the
+// accesses for a whole run of scans up front.
+
+static bool dmi_batch_in_flight(jtag_vdtm_t *dtm) {
+	return dtm->status_callback && dtm->status_callback(dtm->dmi_user) == DMI_STATUS_BUSY;
+}
+
+// The backend running a batch on the other core signals an event when it
+// finishes, so sleep between polls rather than contending for the bus.
+static void wait_dmi_batch(jtag_vdtm_t *dtm) {
+	while (dtm->dmi_queued && dmi_batch_in_flight(dtm))
+		__wfe();
+}
+
+// Apply the result of one completed access. Returns false if it failed.
+static bool retire_dmi_access(jtag_vdtm_t *dtm, const jtag_vdtm_dmi_access_t *a) {
+	if (a->status != DMI_STATUS_OK) {
+		dtm_debug("DMI access failed\n");
+		if (dtm->dmistat == DMI_STATUS_OK)
+			dtm->dmistat = DMI_STATUS_FAILED;
+		return false;
+	}
+	if (a->op == DMI_OP_READ) {
+		dtm->dmi_rdata = a->data;
+		dtm_dump_dmi("DMI R %02x -> %08lx\n", a->addr, a->data);
+	} else {
+		dtm_dump_dmi("DMI W %02x <- %08lx\n", a->addr, a->data);
+	}
+	return true;
+}
+
+static void poll_dmi_status(jtag_vdtm_t *dtm) {
+	if (!dtm->dmi_queued || dmi_batch_in_flight(dtm))
+		return;
+	for (uint i = 0; i < dtm->dmi_queued; ++i) {
+		if (!retire_dmi_access(dtm, &dtm->dmi_queue[i]))
+			break;
+	}
+	dtm->dmi_queued = 0;
+}
 
 static void handle_dmi_write(jtag_vdtm_t *dtm, uint64_t dr_shifter) {
 	uint op = dr_shifter & 0x3;
 	uint32_t wdata = (dr_shifter >> 2) & 0xffffffffu;
 	dmi_addr_t addr = (dr_shifter >> 34) & ((1ull << ABITS) - 1);
 
-	if (op == DMI_OP_WRITE && dtm->write_callback) {
-		dtm->write_callback(addr, wdata);
-		dtm_dump_dmi("DMI W %02x <- %08lx\n", addr, wdata);
-	} else if (op == DMI_OP_READ && dtm->read_callback) {
-		dtm->read_callback(addr, &dtm->dmi_rdata);
-		dtm_dump_dmi("DMI R %02x -> %08lx\n", addr, dtm->dmi_rdata);
+	if (op == DMI_OP_NONE || op > DMI_OP_WRITE || !dtm->dmi_callback)
+		return;
+	if (dtm->dmistat != DMI_STATUS_OK) {
+		dtm_dump_dmi("DMI %c %02x ignored, dmistat=%u\n", "?RW?"[op], addr, dtm->dmistat);
+		return;
 	}
+	// The queue is always empty here: the Capture-DR before this Update-DR
+	// either retired the previous access, or set dmistat to busy.
+	jtag_vdtm_dmi_access_t *a = &dtm->dmi_queue[0];
+	a->op = op;
+	a->addr = addr;
+	a->status = DMI_STATUS_BUSY;
+	a->data = wdata;
+	dtm->dmi_queued = 1;
+	dtm->dmi_callback(dtm->dmi_user, a, 1);
 }
 
 static uint64_t handle_dmi_read(jtag_vdtm_t *dtm) {
-	return (uint64_t)dtm->dmi_rdata << 2;
+	poll_dmi_status(dtm);
+	if (dtm->dmi_queued && dtm->dmistat == DMI_STATUS_OK) {
+		dtm_debug("DMI busy\n");
+		dtm->dmistat = DMI_STATUS_BUSY;
+	}
+	return (uint64_t)dtm->dmi_rdata << 2 | dtm->dmistat;
+}
+
+// Together equivalent to n <= JTAG_VDTM_DMI_BATCH_MAX calls to
+// jtag_vdtm_scan_dmi(), but with all the accesses issued as one batch.
+// Completing always waits for the batch, since the captured values are
+// needed straight away.
+static void scan_dmi_issue(jtag_vdtm_t *dtm, const uint64_t *dr_in, uint n) {
+	dtm->batch_capture = handle_dmi_read(dtm);
+	uint queued = 0;
+	if (dtm->dmistat == DMI_STATUS_OK && dtm->dmi_callback) {
+		for (uint i = 0; i < n; ++i) {
+			uint op = dr_in[i] & 0x3;
+			if (op == DMI_OP_NONE || op > DMI_OP_WRITE)
+				continue;
+			jtag_vdtm_dmi_access_t *a = &dtm->dmi_queue[queued++];
+			a->op = op;
+			a->addr = (dr_in[i] >> 34) & ((1ull << ABITS) - 1);
+			a->status = DMI_STATUS_BUSY;
+			a->data = (dr_in[i] >> 2) & 0xffffffffu;
+		}
+		if (queued) {
+			dtm->dmi_queued = queued;
+			dtm->dmi_callback(dtm->dmi_user, dtm->dmi_queue, queued);
+		}
+	}
+	dtm->batch_queued = queued;
 }
 
+static void scan_dmi_complete(jtag_vdtm_t *dtm, const uint64_t *dr_in, uint64_t *dr_out, uint n) {
+	// Anything in the queue with dmistat clear was issued by scan_dmi_issue()
+	if (dtm->dmistat == DMI_STATUS_OK)
+		wait_dmi_batch(dtm);
+	dr_out[0] = dtm->batch_capture;
+	// Replay the results scan by scan, to get the same captures as if each
+	// access had completed before the next scan. Accesses were only queued
+	// if dmistat was clear, and once it is set, all further ops are ignored,
+	// so the queued accesses line up with the ops that are not ignored.
+	uint retired = 0;
+	for (uint i = 0; i < n; ++i) {
+		if (i > 0)
+			dr_out[i] = (uint64_t)dtm->dmi_rdata << 2 | dtm->dmistat;
+		uint op = dr_in[i] & 0x3;
+		if (op == DMI_OP_NONE || op > DMI_OP_WRITE || !dtm->dmi_callback)
+			continue;
+		if (dtm->dmistat != DMI_STATUS_OK) {
+			dtm_dump_dmi("DMI %c %02x ignored, dmistat=%u\n", "?RW?"[op],
+				(dmi_addr_t)((dr_in[i] >> 34) & ((1ull << ABITS) - 1)), dtm->dmistat);
+			continue;
+		}
+		(void)retire_dmi_access(dtm, &dtm->dmi_queue[retired++]);
+	}
+	// An access left in flight by an earlier scan stays queued, to be
+	// retired (or waited for by dmihardreset) once the backend is done
+	if (dtm->batch_queued)
+		dtm->dmi_queued = 0;
+	dtm->shifter = dr_in[n - 1] & ((1ull << W_DMI) - 1);
+}
+
+#define DTMCS_DMIRESET     (1u << 16)
+#define DTMCS_DMIHARDRESET (1u << 17)
+
 static void handle_dtmcs_write(jtag_vdtm_t *dtm, uint64_t dr_shifter) {
-	// TODO error handling
-	(void)dtm;
-	return;
+	if (dr_shifter & DTMCS_DMIHARDRESET) {
+		dtm_debug("DTM: dmihardreset\n");
+		// Forget about any outstanding access. The backend may still be
+		// working on it, and owns dmi_queue until it finishes, so wait for
+		// that, but discard the result.
+		wait_dmi_batch(dtm);
+		dtm->dmi_queued = 0;
+		dtm->dmistat = DMI_STATUS_OK;
+	} else if (dr_shifter & DTMCS_DMIRESET) {
+		dtm_debug("DTM: dmireset\n");
+		dtm->dmistat = DMI_STATUS_OK;
+	}
 }
 
 // version=1 means the 0.13.2 version of the debug spec (the first ratified one)
 #define DTMCS_VERSION 1ull
 #define DTMCS_ABITS ((uint64_t)ABITS)
-#define DTMCS_IDLE_HINT 0ull
 
 static uint64_t handle_dtmcs_read(jtag_vdtm_t *dtm) {
-	// TODO error handling
-	(void)dtm;
+	// Get an up-to-date dmistat if the host is polling for busy to clear
+	poll_dmi_status(dtm);
 	return
-		DTMCS_VERSION   << 0 |
-		DTMCS_ABITS     << 4 |
-		DTMCS_IDLE_HINT << 12;
+		DTMCS_VERSION            << 0 |
+		DTMCS_ABITS              << 4 |
+		(uint64_t)dtm->dmistat   << 10 |
+		(uint64_t)dtm->idle_hint << 12;
 }
+
+#ifdef JTAG_VDTM_TEST_HOOKS
+uint jtag_vdtm_test_step_tap(uint state, bool tms) {
+	return step_tap_fsm((jtag_tap_state_t)state, tms);
+}
+
+uint jtag_vdtm_test_tap_lut(uint state, uint8_t tms, uint *idle, bool *events) {
+	init_tap_fsm_lut();
+	uint16_t entry = tap_fsm_lut[state][tms];
+	*idle = (entry >> TAP_LUT_IDLE_LSB) & TAP_LUT_IDLE_MASK;
+	*events = entry >> TAP_LUT_EVENTS_LSB;
+	return entry & TAP_LUT_STATE_MASK;
+}
+#endif
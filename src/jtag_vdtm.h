@@ -19,18 +19,50 @@ typedef struct jtag_vdtm jtag_vdtm_t;
 // are required for a standard Debug Module
 typedef uint8_t dmi_addr_t;
 
-// A function for the DTM to call when it wants to perform a DMI write
-typedef void (*jtag_vdtm_write_callback)(dmi_addr_t addr, uint32_t data);
-
-// A function for the DTM to call when it wants to perform a DMI read
-typedef void (*jtag_vdtm_read_callback)(dmi_addr_t addr, uint32_t *data);
+// DMI op field values, as shifted in at Update-DR
+typedef enum jtag_vdtm_dmi_op {
+	DMI_OP_NONE  = 0,
+	DMI_OP_READ  = 1,
+	DMI_OP_WRITE = 2
+} jtag_vdtm_dmi_op_t;
+
+// Status of a DMI access. The values match the DMI op field on capture.
+typedef enum jtag_vdtm_dmi_status {
+	DMI_STATUS_OK     = 0,
+	DMI_STATUS_FAILED = 2,
+	DMI_STATUS_BUSY   = 3
+} jtag_vdtm_dmi_status_t;
+
+// One DMI access queued by the DTM. data is the write data for writes, and
+// is filled in by the backend for reads. The backend sets status to
+// DMI_STATUS_OK or DMI_STATUS_FAILED once the access is complete.
+typedef struct jtag_vdtm_dmi_access {
+	uint8_t op;
+	dmi_addr_t addr;
+	uint8_t status;
+	uint32_t data;
+} jtag_vdtm_dmi_access_t;
+
+// Maximum number of accesses passed to the DMI callback at once
+#define JTAG_VDTM_DMI_BATCH_MAX 16
+
+// A function for the DTM to call when it wants to perform a batch of DMI
+// accesses. The accesses must be performed in order, and if one fails, none
+// of the following accesses may be performed (the DTM ignores further ops
+// after a failure, so the host expects them not to have happened).
+typedef void (*jtag_vdtm_dmi_callback)(void *user, jtag_vdtm_dmi_access_t *accesses, uint n);
+
+// A function for the DTM to call to find out whether the most recently
+// issued batch of DMI accesses has completed. Returns DMI_STATUS_BUSY whilst
+// any access in the batch is still in flight.
+typedef jtag_vdtm_dmi_status_t (*jtag_vdtm_status_callback)(void *user);
 
 // Dynamically allocate a new instance, initialise it, and pass you a pointer
 // (which is opaque to you -- only the implementation file has the struct
 // definition)
 jtag_vdtm_t *jtag_vdtm_create(uint32_t idcode);
 
-void jtag_dtm_destroy(jtag_vdtm_t *dtm);
+void jtag_vdtm_destroy(jtag_vdtm_t *dtm);
 
 // IO functions. You can connect these up to e.g. JTAG bitbang macros in the
 // CMSIS-DAP JTAG_DP.c code.
@@ -42,10 +74,89 @@ void jtag_vdtm_set_tdi(jtag_vdtm_t *dtm, bool tck);
 
 bool jtag_vdtm_get_tdo(jtag_vdtm_t *dtm);
 
-// Pass in functions which will be called by the DTM to implement DMI
-// accesses. Currently these are blocking functions which always succeed.
-void jtag_vdtm_set_write_callback(jtag_vdtm_t *dtm, jtag_vdtm_write_callback cb);
-
-void jtag_vdtm_set_read_callback(jtag_vdtm_t *dtm, jtag_vdtm_read_callback cb);
+// Bulk IO function, equivalent to clocking nbits TCK cycles through the
+// functions above, but much cheaper per cycle. tms and tdi are packed bit
+// vectors, LSB-first, consumed one bit per cycle. TDO is sampled before each
+// rising edge (as JTAG_CYCLE_TDIO does) and packed into tdo the same way. tdo
+// may be NULL if you aren't interested in the result.
+void jtag_vdtm_shift(jtag_vdtm_t *dtm, const uint8_t *tms, const uint8_t *tdi,
+	uint8_t *tdo, uint nbits);
+
+// Equivalent to clocking ncycles TCK cycles with TMS=0. Cycles spent in
+// Run-Test/Idle, Pause-DR or Pause-IR are counted in O(1) rather than
+// emulated one at a time.
+void jtag_vdtm_idle(jtag_vdtm_t *dtm, uint ncycles);
+
+// Free-running count of TMS=0 cycles spent in Run-Test/Idle, Pause-DR or
+// Pause-IR, however they were clocked. The difference between two readings
+// is the idle time the host has given the DTM in between, in TCK cycles.
+uint32_t jtag_vdtm_get_idle_cycles(jtag_vdtm_t *dtm);
+
+// Fast path for callers which recognise whole DMI scans at a higher level
+// (e.g. from the shape of a CMSIS-DAP JTAG_Sequence packet). A scan here means
+// Run-Test/Idle -> Capture-DR -> Shift-DR -> Update-DR -> Run-Test/Idle with
+// IR=DMI, and the result is identical to clocking it through the IO functions.
+
+// Returns true if the TAP is in Run-Test/Idle with the DMI register selected,
+// i.e. jtag_vdtm_scan_dmi() may be used.
+bool jtag_vdtm_can_scan_dmi(jtag_vdtm_t *dtm);
+
+// Returns true if the TAP is in Run-Test/Idle with a 1-bit DR (BYPASS)
+// selected. A DR scan through it then only delays TDI by one bit, and apart
+// from the idle cycles, which can be counted with jtag_vdtm_idle(), it ends
+// up in the same state.
+bool jtag_vdtm_is_bypassed(jtag_vdtm_t *dtm);
+
+// Perform one DMI scan, shifting in dr_in and returning the value captured
+// at Capture-DR (i.e. the value that would have been shifted out on TDO).
+uint64_t jtag_vdtm_scan_dmi(jtag_vdtm_t *dtm, uint64_t dr_in);
+
+// Perform n <= JTAG_VDTM_DMI_BATCH_MAX back-to-back DMI scans, with the same
+// result as calling jtag_vdtm_scan_dmi() for each, but passing all of their
+// accesses to the DMI callback as a single batch.
+void jtag_vdtm_scan_dmi_batch(jtag_vdtm_t *dtm, const uint64_t *dr_in,
+	uint64_t *dr_out, uint n);
+
+// jtag_vdtm_scan_dmi_batch() in two halves, so that several DTMs can have
+// batches in flight at once: issue passes the accesses to the DMI callback,
+// and complete waits for them and fills in dr_out. For n <=
+// JTAG_VDTM_DMI_BATCH_MAX only, with the same dr_in and n for both, and no
+// other calls on this DTM in between.
+void jtag_vdtm_scan_dmi_issue(jtag_vdtm_t *dtm, const uint64_t *dr_in, uint n);
+
+void jtag_vdtm_scan_dmi_complete(jtag_vdtm_t *dtm, const uint64_t *dr_in,
+	uint64_t *dr_out, uint n);
+
+// Pass in a function which will be called by the DTM to implement DMI
+// accesses, and a pointer which is passed back to it (and to the status
+// callback) on every call. Without a status callback, the DMI callback must
+// complete all of its accesses before returning.
+void jtag_vdtm_set_dmi_callback(jtag_vdtm_t *dtm, jtag_vdtm_dmi_callback cb, void *user);
+
+// With a status callback, the DMI callback may return before the accesses
+// complete. The DTM reports busy (op=3) to the host if it captures the DMI
+// register while an access is in flight, and any failure or busy status is
+// sticky until the host writes dtmcs.dmireset. Batches issued by
+// jtag_vdtm_scan_dmi_batch() are always waited for before it returns.
+void jtag_vdtm_set_status_callback(jtag_vdtm_t *dtm, jtag_vdtm_status_callback cb);
+
+// Set the number of Run-Test/Idle cycles advertised to the host in
+// dtmcs.idle, in the spec's encoding: 0 means no need to enter Run-Test/Idle
+// at all, 1 means enter and leave immediately, and n > 1 means stay for n - 1
+// cycles. Clamped to the maximum encodable value of 7.
+void jtag_vdtm_set_idle_hint(jtag_vdtm_t *dtm, uint idle);
+
+#ifdef JTAG_VDTM_TEST_HOOKS
+// Internals exposed to the host unit tests. States are numbered as in
+// jtag_vdtm.c (0 = Test-Logic-Reset, 1 = Run-Test/Idle, ...).
+
+// One TCK of the reference TAP state machine
+uint jtag_vdtm_test_step_tap(uint state, bool tms);
+
+// Look up eight TCKs (TMS LSB-first) in the table used by jtag_vdtm_shift().
+// Returns the final state, the number of idle cycles counted, and whether
+// the table flags any posedge side effects.
+uint jtag_vdtm_test_tap_lut(uint state, uint8_t tms, uint *idle, bool *events);
+#endif
 
 #endif
@@ -0,0 +1,107 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+#include "latency.h"
+
+#include <string.h>
+
+#include "pico/platform.h"
+#include "hardware/sync.h"
+
+// Histograms of each core, so that recording never contends with the other
+// core. Only the tasks and IRQs of one core get in the way, which
+// latency_record() excludes by briefly disabling interrupts.
+static latency_hist_t hists[NUM_CORES][LATENCY_N_STAGES];
+
+static uint clk_mhz;
+
+#if LATENCY_STATS
+
+#include "hardware/clocks.h"
+#include "hardware/pwm.h"
+#include "hardware/timer.h"
+
+// A PWM slice that nothing else uses, counting clk_sys cycles. Both cores see
+// the same counter, unlike SysTick (which FreeRTOS owns anyway).
+#ifndef LATENCY_PWM_SLICE
+#define LATENCY_PWM_SLICE 7
+#endif
+
+// Cycle count minus time_us_32() * clk_mhz
+static uint32_t phase;
+
+void latency_init(void) {
+	// The microsecond timer extends the 16-bit counter, which only works if
+	// a microsecond is a whole number of cycles
+	uint32_t hz = clock_get_hz(clk_sys);
+	if (hz % 1000000u)
+		panic("latency: clk_sys is not a whole number of MHz");
+	clk_mhz = hz / 1000000u;
+	pwm_config cfg = pwm_get_default_config();
+	pwm_config_set_clkdiv_int(&cfg, 1);
+	pwm_config_set_wrap(&cfg, 0xffffu);
+	pwm_init(LATENCY_PWM_SLICE, &cfg, true);
+	uint32_t save = save_and_disable_interrupts();
+	uint32_t us = time_us_32();
+	uint16_t count = pwm_get_counter(LATENCY_PWM_SLICE);
+	restore_interrupts(save);
+	phase = count - us * clk_mhz;
+}
+
+uint32_t latency_now(void) {
+	// The timer gives the upper bits, to within a few cycles, and the counter
+	// the lower 16
+	uint32_t save = save_and_disable_interrupts();
+	uint32_t estimate = time_us_32() * clk_mhz + phase;
+	uint16_t count = pwm_get_counter(LATENCY_PWM_SLICE);
+	restore_interrupts(save);
+	return estimate + (int16_t)(count - (uint16_t)estimate);
+}
+
+uint32_t latency_record(latency_stage_t stage, uint32_t start) {
+	uint32_t now = latency_now();
+	uint32_t t = now - start;
+	uint bucket = t ? 31 - __builtin_clz(t) : 0;
+	latency_hist_t *h = &hists[get_core_num()][stage];
+	uint32_t save = save_and_disable_interrupts();
+	if (!h->count || t < h->min)
+		h->min = t;
+	if (t > h->max)
+		h->max = t;
+	++h->count;
+	h->sum += t;
+	++h->buckets[bucket];
+	restore_interrupts(save);
+	return now;
+}
+
+#endif
+
+// Reads race with recording on the other core, so a histogram may be a
+// sample or two out from its count. That is fine for statistics.
+void latency_get(latency_stage_t stage, latency_hist_t *hist) {
+	memset(hist, 0, sizeof(*hist));
+	if (stage >= LATENCY_N_STAGES)
+		return;
+	for (uint core = 0; core < NUM_CORES; ++core) {
+		latency_hist_t h = hists[core][stage];
+		if (!h.count)
+			continue;
+		if (!hist->count || h.min < hist->min)
+			hist->min = h.min;
+		if (h.max > hist->max)
+			hist->max = h.max;
+		hist->count += h.count;
+		hist->sum += h.sum;
+		for (uint i = 0; i < LATENCY_N_BUCKETS; ++i)
+			hist->buckets[i] += h.buckets[i];
+	}
+}
+
+void latency_clear(void) {
+	memset(hists, 0, sizeof(hists));
+}
+
+uint latency_clk_mhz(void) {
+	return clk_mhz;
+}
@@ -0,0 +1,85 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Latency histograms for each stage of a CMSIS-DAP command, from the USB
+// packet arriving to the response going back, so that a slow round trip can
+// be pinned on USB, on JTAG emulation, or on the SWD wire. Times are in
+// clk_sys cycles, and each histogram has one bucket per power of two.
+//
+// The host reads the histograms with the DAP_VENDOR_LATENCY command (see
+// dap_vendor.h), e.g. with host/probe_latency.
+
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef unsigned int uint;
+
+#ifndef LATENCY_STATS
+#define LATENCY_STATS 1
+#endif
+
+typedef enum latency_stage {
+	// Response to one command written, to the next command read: host and
+	// USB turnaround
+	LATENCY_HOST,
+	// Command read from the USB stack, to dispatch
+	LATENCY_USB_READ,
+	// Dispatch to response ready: all processing of one command
+	LATENCY_COMMAND,
+	// One call of the DTM's DMI callback, which usually just queues the
+	// batch for core 1. Only recorded with DMI_CORE1: otherwise the callback
+	// is the SWD batch itself.
+	LATENCY_DMI_CALLBACK,
+	// One batch of DMI accesses on the SWD wire, on either core
+	LATENCY_SWD_WIRE,
+	// Response ready, to tud_vendor_write() and the flush returning
+	LATENCY_USB_WRITE,
+	// Command read to response written
+	LATENCY_TOTAL,
+	LATENCY_N_STAGES
+} latency_stage_t;
+
+#define LATENCY_N_BUCKETS 32
+
+// Bucket i counts times of 2^i to 2^(i + 1) - 1 cycles (bucket 0 also
+// counts 0)
+typedef struct latency_hist {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum;
+	uint32_t buckets[LATENCY_N_BUCKETS];
+} latency_hist_t;
+
+#if LATENCY_STATS
+
+// Start the cycle counter. Call once, before anything else here.
+void latency_init(void);
+
+// Current time in clk_sys cycles. Wraps after 2^32 cycles (34 s at 125 MHz).
+uint32_t latency_now(void);
+
+// Add the time from start to now to a stage's histogram, and return now, so
+// that consecutive stages can be chained
+uint32_t latency_record(latency_stage_t stage, uint32_t start);
+
+#else
+
+static inline void latency_init(void) {}
+static inline uint32_t latency_now(void) { return 0; }
+static inline uint32_t latency_record(latency_stage_t stage, uint32_t start) { return 0; }
+
+#endif
+
+// Both cores' histograms for a stage, added together
+void latency_get(latency_stage_t stage, latency_hist_t *hist);
+
+void latency_clear(void);
+
+// clk_sys frequency in MHz, for converting cycles to time
+uint latency_clk_mhz(void);
+
+#endif
@@ -43,30 +43,13 @@
 
 #include "pico/stdio_uart.h"
 
+#include "dlog.h"
+#include "dm_regs.h"
+#include "dmi_worker.h"
+#include "jtag_dp_vdtm.h"
+#include "latency.h"
 #include "swd_dmi.h"
 
-#define DM_DATA0        0x04
-#define DM_DMCONTROL    0x10
-#define DM_DMSTATUS     0x11
-#define DM_HARTINFO     0x12
-#define DM_HALTSUM1     0x13
-#define DM_HALTSUM0     0x40
-#define DM_HAWINDOWSEL  0x14
-#define DM_HAWINDOW     0x15
-#define DM_ABSTRACTCS   0x16
-#define DM_COMMAND      0x17
-#define DM_ABSTRACTAUTO 0x18
-#define DM_CONFSTRPTR0  0x19
-#define DM_CONFSTRPTR1  0x1a
-#define DM_CONFSTRPTR2  0x1b
-#define DM_CONFSTRPTR3  0x1c
-#define DM_NEXTDM       0x1d
-#define DM_PROGBUF0     0x20
-#define DM_PROGBUF1     0x21
-#define DM_SBCS         0x38
-#define DM_SBADDRESS0   0x39
-#define DM_SBDATA0      0x3c
-
 
 
 // UART0 for Picoprobe debug
@@ -77,18 +60,29 @@ static uint8_t RxDataBuffer[CFG_TUD_HID_EP_BUFSIZE];
 
 #define THREADED 1
 
+// tud_task() blocks on a FreeRTOS queue (see TINYUSB_OPT_OS in
+// CMakeLists.txt), so it needs the scheduler running
+#if !THREADED && (CFG_TUSB_OS == OPT_OS_FREERTOS)
+#error "Build the non-threaded main loop with TINYUSB_OPT_OS=OPT_OS_PICO"
+#endif
+
 #define UART_TASK_PRIO (tskIDLE_PRIORITY + 3)
 #define TUD_TASK_PRIO  (tskIDLE_PRIORITY + 2)
 #define DAP_TASK_PRIO  (tskIDLE_PRIORITY + 1)
+#define DLOG_TASK_PRIO (tskIDLE_PRIORITY)
 
-static TaskHandle_t dap_taskhandle, tud_taskhandle;
+static TaskHandle_t dap_taskhandle, tud_taskhandle, dlog_taskhandle;
 
 void usb_thread(void *ptr)
 {
     do {
+        // Sleeps until the USB interrupt queues an event, with the FreeRTOS
+        // OSAL. Otherwise (an SDK which ignores TINYUSB_OPT_OS) it returns
+        // straight away, so give the lower priority tasks a look in.
         tud_task();
-        // Trivial delay to save power
+#if CFG_TUSB_OS != OPT_OS_FREERTOS
         vTaskDelay(1);
+#endif
     } while (1);
 }
 
@@ -97,26 +91,54 @@ void usb_thread(void *ptr)
 #define tud_vendor_flush(x) ((void)0)
 #endif
 
+// Print deferred log messages (dlog.h) when there is nothing else to do
+void dlog_thread(void *ptr)
+{
+    do {
+        dlog_drain();
+        vTaskDelay(pdMS_TO_TICKS(10));
+    } while (1);
+}
+
 void dap_thread(void *ptr)
 {
     uint32_t resp_len;
+    // Stage timestamps for the latency histograms (latency.h)
+    uint32_t t_written = latency_now();
     do {
         if (tud_vendor_available()) {
+            uint32_t t_read = latency_record(LATENCY_HOST, t_written);
             tud_vendor_read(RxDataBuffer, sizeof(RxDataBuffer));
-            resp_len = DAP_ProcessCommand(RxDataBuffer, TxDataBuffer);
+            uint32_t t = latency_record(LATENCY_USB_READ, t_read);
+            resp_len = vdtm_process_command(RxDataBuffer, TxDataBuffer);
+            if (!resp_len)
+                resp_len = DAP_ProcessCommand(RxDataBuffer, TxDataBuffer);
+            t = latency_record(LATENCY_COMMAND, t);
             tud_vendor_write(TxDataBuffer, resp_len);
             tud_vendor_flush();
+            t_written = latency_record(LATENCY_USB_WRITE, t);
+            (void)latency_record(LATENCY_TOTAL, t_read);
         } else {
-            // Trivial delay to save power
-            vTaskDelay(2);
+            // Sleep until tud_vendor_rx_cb() says a command has arrived. A
+            // notification given since the check above is not lost.
+            (void)ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
         }
     } while (1);
 }
 
+// Called from tud_task() when a packet arrives on the vendor (CMSIS-DAP v2)
+// interface
+void tud_vendor_rx_cb(uint8_t itf)
+{
+    (void)itf;
+    if (dap_taskhandle)
+        xTaskNotifyGive(dap_taskhandle);
+}
+
 static int test_swd_dmi(void) {
     probe_init();
 
-    swd_dmi_t *dmi = swd_dmi_create(0, 0);
+    swd_dmi_t *dmi = swd_dmi_create(&PROBE_SWD_LINK, NULL, 0, 0);
     printf("\n\nIssuing connect sequence...\n");
     int rc = swd_dmi_connect(dmi);
     if (rc) {
@@ -166,6 +188,7 @@ int main(void) {
     uint32_t resp_len;
 
     stdio_uart_init();
+    latency_init();
     (void)test_swd_dmi();
 
 
@@ -178,8 +201,15 @@ int main(void) {
     probe_init();
 #else
     DAP_Setup();
+    // One set of virtual TAPs per SWD port
+    void *swd_ports[PROBE_SWD_PORTS];
+    for (uint i = 0; i < swd_link_n_ports; ++i)
+        swd_ports[i] = (void *)&swd_link_ports[i];
+    vdtm_set_swd_ports(&PROBE_SWD_LINK, swd_ports, swd_link_n_ports);
 #endif
     led_init();
+    // SWD DMI accesses run on core 1, everything else stays on core 0
+    dmi_worker_launch();
 
     picoprobe_info("Welcome to Picoprobe!\n");
 
@@ -189,19 +219,24 @@ int main(void) {
         xTaskCreate(usb_thread, "TUD", configMINIMAL_STACK_SIZE, NULL, TUD_TASK_PRIO, &tud_taskhandle);
         /* Lowest priority thread is debug - need to shuffle buffers before we can toggle swd... */
         xTaskCreate(dap_thread, "DAP", configMINIMAL_STACK_SIZE, NULL, DAP_TASK_PRIO, &dap_taskhandle);
+        /* snprintf() wants more stack than the minimum */
+        xTaskCreate(dlog_thread, "DLOG", 2 * configMINIMAL_STACK_SIZE, NULL, DLOG_TASK_PRIO, &dlog_taskhandle);
         vTaskStartScheduler();
     }
 
     while (!THREADED) {
         tud_task();
         cdc_task();
+        dlog_drain();
 #if (PICOPROBE_DEBUG_PROTOCOL == PROTO_OPENOCD_CUSTOM)
         probe_task();
         led_task();
 #elif (PICOPROBE_DEBUG_PROTOCOL == PROTO_DAP_V2)
         if (tud_vendor_available()) {
             tud_vendor_read(RxDataBuffer, sizeof(RxDataBuffer));
-            resp_len = DAP_ProcessCommand(RxDataBuffer, TxDataBuffer);
+            resp_len = vdtm_process_command(RxDataBuffer, TxDataBuffer);
+            if (!resp_len)
+                resp_len = DAP_ProcessCommand(RxDataBuffer, TxDataBuffer);
             tud_vendor_write(TxDataBuffer, resp_len);
         }
 #endif
@@ -33,8 +33,10 @@
 #endif
 
 
+// Deferred, as it is called in the SWD transfer paths (see dlog.h)
 #if true
-#define picoprobe_debug(format,args...) printf(format, ## args)
+#include "dlog.h"
+#define picoprobe_debug(format,args...) dlog(format, ## args)
 #else
 #define picoprobe_debug(format,...) ((void)0)
 #endif
@@ -52,6 +54,36 @@
 #define PROBE_PIN_SWCLK (PROBE_PIN_OFFSET + 0) // 2
 #define PROBE_PIN_SWDIO (PROBE_PIN_OFFSET + 1) // 3
 
+// Whole-packet SWD engine (swd_packet.pio), for SWD_Transfer and the DMI
+// links. Opt-in (cmake -DSWD_PACKET_ENGINE=ON) until it has been proven on
+// hardware. Without it, SWD_Transfer uses probe.pio and the DMI links are
+// bitbanged. Needs its own PIO block, as probe.pio takes up most of pio0's
+// instruction memory.
+#ifndef SWD_PACKET_ENGINE
+#define SWD_PACKET_ENGINE 0
+#endif
+#define SWD_PACKET_PIO pio1
+#define SWD_PACKET_SM 0
+
+#if SWD_PACKET_ENGINE
+#define PROBE_SWD_LINK swd_link_pio
+#else
+#define PROBE_SWD_LINK swd_link_bitbang
+#endif
+
+// Number of SWD ports for the virtual JTAG DTM, each presented as its own
+// TAP(s). Port 0 is PROBE_PIN_SWCLK/PROBE_PIN_SWDIO, and the others are on
+// the pins below, each using the next state machine of SWD_PACKET_PIO.
+#ifndef PROBE_SWD_PORTS
+#define PROBE_SWD_PORTS 1
+#endif
+#define PROBE_PIN_SWCLK_1 10
+#define PROBE_PIN_SWDIO_1 11
+#define PROBE_PIN_SWCLK_2 12
+#define PROBE_PIN_SWDIO_2 13
+#define PROBE_PIN_SWCLK_3 14
+#define PROBE_PIN_SWDIO_3 15
+
 // Target reset config
 #define PROBE_PIN_RESET 6
 
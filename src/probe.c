@@ -87,14 +87,19 @@ struct __attribute__((__packed__)) probe_pkt_hdr {
     uint32_t total_packet_length;
 };
 
-void probe_set_swclk_freq(uint freq_khz) {
+void probe_set_swclk_freq_quiet(uint freq_khz) {
         uint clk_sys_freq_khz = clock_get_hz(clk_sys) / 1000;
-        picoprobe_info("Set swclk freq %dKHz sysclk %dkHz\n", freq_khz, clk_sys_freq_khz);
         // Worked out with saleae
         uint32_t divider = clk_sys_freq_khz / freq_khz / 2;
         pio_sm_set_clkdiv_int_frac(pio0, PROBE_SM, divider, 0);
 }
 
+void probe_set_swclk_freq(uint freq_khz) {
+        uint clk_sys_freq_khz = clock_get_hz(clk_sys) / 1000;
+        picoprobe_info("Set swclk freq %dKHz sysclk %dkHz\n", freq_khz, clk_sys_freq_khz);
+        probe_set_swclk_freq_quiet(freq_khz);
+}
+
 void probe_assert_reset(bool state)
 {
     /* Change the direction to out to drive pin to 0 or to in to emulate open drain */
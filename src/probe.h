@@ -27,6 +27,8 @@
 #define PROBE_H_
 
 void probe_set_swclk_freq(uint freq_khz);
+// Same, without logging, for the DMI link's connect path (see swd_link_pio.c)
+void probe_set_swclk_freq_quiet(uint freq_khz);
 void probe_write_bits(uint bit_count, uint32_t data_byte);
 uint32_t probe_read_bits(uint bit_count);
 
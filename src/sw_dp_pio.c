@@ -24,10 +24,18 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "DAP_config.h"
 #include "DAP.h"
 #include "probe.h"
+#if SWD_PACKET_ENGINE
+#include "swd_pio.h"
+#else
+/* Only probe.pio drives the SWD pins */
+#define swd_pio_set_swclk_freq(port, freq_khz) ((void)0)
+#define swd_pio_release_pins(port)             ((void)0)
+#endif
 
 /* Slight hack - we're not bitbashing so we need to set baudrate off the DAP's delay cycles.
  * Ideally we don't want calls to udiv everywhere... */
@@ -37,6 +45,18 @@ volatile uint32_t cached_delay = 0;
 /* Hack to stub out all raw SWD functions when JTAG-DTM emulation is in use: */
 volatile bool disable_raw_swj_access = false;
 
+/* Both the probe.pio program and the SWD packet engine follow the DAP clock,
+ * in SWD mode only. With JTAG-DTM emulation, the pins and state machines of
+ * every SWD port belong to the DMI links (possibly running on core 1), which
+ * all keep their own SWCLK frequency, so none of them follow the DAP clock. */
+static void update_swclk_freq (void) {
+  if (DAP_Data.clock_delay != cached_delay) {
+    probe_set_swclk_freq(MAKE_KHZ(DAP_Data.clock_delay));
+    swd_pio_set_swclk_freq(NULL, MAKE_KHZ(DAP_Data.clock_delay));
+    cached_delay = DAP_Data.clock_delay;
+  }
+}
+
 // Generate SWJ Sequence
 //   count:  sequence bit count
 //   data:   pointer to sequence bit data
@@ -46,9 +66,9 @@ void SWJ_Sequence (uint32_t count, const uint8_t *data) {
   uint32_t bits;
   uint32_t n;
 
-  if (DAP_Data.clock_delay != cached_delay) {
-    probe_set_swclk_freq(MAKE_KHZ(DAP_Data.clock_delay));
-    cached_delay = DAP_Data.clock_delay;
+  if (!disable_raw_swj_access) {
+    update_swclk_freq();
+    swd_pio_release_pins(NULL);
   }
   picoprobe_debug("SWJ sequence count = %d FDB=0x%2x\n", count, data[0]);
   n = count;
@@ -73,15 +93,20 @@ void SWD_Sequence (uint32_t info, const uint8_t *swdo, uint8_t *swdi) {
   uint32_t bits;
   uint32_t n;
 
-  if (DAP_Data.clock_delay != cached_delay) {
-    probe_set_swclk_freq(MAKE_KHZ(DAP_Data.clock_delay));
-    cached_delay = DAP_Data.clock_delay;
-  }
   picoprobe_debug("SWD sequence\n");
   n = info & SWD_SEQUENCE_CLK;
   if (n == 0U) {
     n = 64U;
   }
+  if (disable_raw_swj_access) {
+    /* The pins belong to the DMI links: don't touch them, and read zeros */
+    if (info & SWD_SEQUENCE_DIN) {
+      memset(swdi, 0, (n + 7U) / 8U);
+    }
+    return;
+  }
+  update_swclk_freq();
+  swd_pio_release_pins(NULL);
   bits = n;
   if (info & SWD_SEQUENCE_DIN) {
     while (n > 0) {
@@ -105,7 +130,62 @@ void SWD_Sequence (uint32_t info, const uint8_t *swdo, uint8_t *swdi) {
 }
 #endif
 
+#if (DAP_SWD != 0) && SWD_PACKET_ENGINE
+// SWD Transfer I/O using the whole-packet PIO engine. Only supports one
+// turnaround cycle.
+//   request: A[3:2] RnW APnDP
+//   data:    DATA[31:0]
+//   prq:     packet header
+//   return:  ACK[2:0]
+static uint8_t SWD_TransferPacket (uint32_t request, uint32_t *data, uint8_t prq) {
+  uint32_t val = 0U;
+  uint32_t ack;
+  uint32_t n;
+
+  swd_pio_claim_pins(NULL);
+  if (request & DAP_TRANSFER_RnW) {
+    ack = swd_pio_transfer(NULL, prq, &val, DAP_Data.swd_conf.data_phase);
+  } else {
+    ack = swd_pio_transfer(NULL, prq, data, DAP_Data.swd_conf.data_phase);
+  }
+  if (ack == SWD_PIO_PARITY_ERROR) {
+    ack = DAP_TRANSFER_ERROR;
+  }
+
+  if ((ack == DAP_TRANSFER_OK) || (ack == DAP_TRANSFER_ERROR)) {
+    if ((request & DAP_TRANSFER_RnW) && data) {
+      *data = val;
+    }
+    /* Capture Timestamp */
+    if (request & DAP_TRANSFER_TIMESTAMP) {
+      swd_pio_flush(NULL);
+      DAP_Data.timestamp = time_us_32();
+    }
+
+    /* Idle cycles - drive 0 for N clocks */
+    if (DAP_Data.transfer.idle_cycles) {
+      swd_pio_release_pins(NULL);
+      for (n = DAP_Data.transfer.idle_cycles; n; ) {
+        if (n > 32) {
+          probe_write_bits(32, 0);
+          n -= 32;
+        } else {
+          probe_write_bits(n, 0);
+          n -= n;
+        }
+      }
+    }
+    return ((uint8_t)ack);
+  }
+
+  /* WAIT, FAULT or protocol error: the engine has already done any data
+     phase or back-off */
+  return ((uint8_t)ack);
+}
+#endif
+
 #if (DAP_SWD != 0)
+
 // SWD Transfer I/O
 //   request: A[3:2] RnW APnDP
 //   data:    DATA[31:0]
@@ -118,11 +198,7 @@ uint8_t SWD_Transfer (uint32_t request, uint32_t *data) {
   uint32_t parity = 0;
   uint32_t n;
 
-  if (DAP_Data.clock_delay != cached_delay) {
-    probe_set_swclk_freq(MAKE_KHZ(DAP_Data.clock_delay));
-    cached_delay = DAP_Data.clock_delay;
-  }
-  picoprobe_debug("SWD_transfer\n");
+  update_swclk_freq();
   /* Generate the request packet */
   prq |= (1 << 0); /* Start Bit */
   for (n = 1; n < 5; n++) {
@@ -133,6 +209,13 @@ uint8_t SWD_Transfer (uint32_t request, uint32_t *data) {
   prq |= (parity & 0x1) << 5; /* Parity Bit */
   prq |= (0 << 6); /* Stop Bit */
   prq |= (1 << 7); /* Park bit */
+
+#if SWD_PACKET_ENGINE
+  if (DAP_Data.swd_conf.turnaround == 1U) {
+    return SWD_TransferPacket(request, data, prq);
+  }
+#endif
+  swd_pio_release_pins(NULL);
   probe_write_bits(8, prq);
 
   /* Turnaround (ignore read bits) */
@@ -154,8 +237,6 @@ uint8_t SWD_Transfer (uint32_t request, uint32_t *data) {
       }
       if (data)
         *data = val;
-      picoprobe_debug("Read %02x ack %02x 0x%08x parity %01x\n",
-                      prq, ack, val, bit);
       /* Turnaround for line idle */
       probe_read_bits(DAP_Data.swd_conf.turnaround);
       probe_write_mode();
@@ -170,8 +251,6 @@ uint8_t SWD_Transfer (uint32_t request, uint32_t *data) {
       parity = __builtin_popcount(val);
       /* Write Parity Bit */
       probe_write_bits(1, parity & 0x1);
-      picoprobe_debug("write %02x ack %02x 0x%08x parity %01x\n",
-                      prq, ack, val, parity);
     }
     /* Capture Timestamp */
     if (request & DAP_TRANSFER_TIMESTAMP) {
@@ -2,137 +2,139 @@
 // SPDX-License-Identifier: Apache-2.0 
 
 #include "swd_dmi.h"
-
-#include "probe.h"
-#include "hardware/gpio.h"
+#include "dmi_capture.h"
 
 #include <stdlib.h>
 #include <string.h>
 
-#define DMI_DEBUG 1
+// Logging is deferred (see dlog.h). Debug messages come with every access,
+// which would overflow the dlog ring under any real load, so they are off
+// by default.
+#ifndef DMI_DEBUG
+#define DMI_DEBUG 0
+#endif
+#ifndef DMI_INFO
 #define DMI_INFO 1
+#endif
 
 #if DMI_DEBUG || DMI_INFO
-#include <stdio.h>
+#include "dlog.h"
 #endif
 
 #if DMI_DEBUG
-#define dmi_debug(...) printf(__VA_ARGS__)
+#define dmi_debug(...) dlog(__VA_ARGS__)
 #else
 #define dmi_debug(...) ((void)0)
 #endif
 
 #if DMI_INFO
-#define dmi_info(...) printf(__VA_ARGS__)
+#define dmi_info(...) dlog(__VA_ARGS__)
 #else
 #define dmi_info(...) ((void)0)
 #endif
 
 #define PWRUP_ACK_TIMEOUT 10000
 
+// Overruns tolerated per write burst before giving up on the link
+#define WRITE_BURST_RETRIES 4
+
+// WAIT responses tolerated per access before giving up on the link
+#define WAIT_RETRIES 64
+
+// Limit on idle cycles inserted after a DRW access (see drw_access())
+#define IDLE_MAX 1024
+// Number of WAIT-free DRW accesses before trying one fewer idle cycle
+#define IDLE_DECAY_PERIOD 256
+
 struct swd_dmi {
+	const swd_link_ops_t *link;
+	void *link_ctx;
+	// Running count of SWCLK cycles, for measuring access latency
+	uint32_t swclk_count;
+	// Predicted TAR value, valid if addr_cache_valid
 	uint32_t addr_cache;
 	uint32_t targetsel;
 	uint apsel;
 	bool addr_cache_valid;
+	// CSW as found at connect, with AddrInc cleared
+	uint32_t csw;
+	bool addr_inc;
+	bool last_addr_valid;
+	uint32_t last_addr;
+	uint32_t last_access_cycles;
+	uint32_t *posted;
+	// Idle cycles to insert after each DRW read [0] and write [1], and the
+	// number of WAIT-free accesses since each last changed
+	uint idle[2];
+	uint idle_run[2];
+	// Type of the most recent DRW access, which is what any WAIT is for
+	bool last_drw_write;
+	// WAITs so far for the current ap_access(), for the capture buffer
+	uint retry;
+	swd_dmi_stats_t stats;
+	// Identity of the DP at the last successful connection, whose AP has
+	// been checked and whose CSW is in csw
+	bool connected;
+	uint32_t dpidr;
+	// DMIs for the DPs on one multi-drop link form a ring, and at most one
+	// of them has its DP selected at a time
+	swd_dmi_t *next_on_link;
+	bool selected;
 };
 
-swd_dmi_t *swd_dmi_create(uint32_t targetsel, uint apsel) {
+swd_dmi_t *swd_dmi_create(const swd_link_ops_t *link, void *link_ctx, uint32_t targetsel, uint apsel) {
 	swd_dmi_t *dmi = malloc(sizeof(swd_dmi_t));
 	if (!dmi)
 		return dmi;
 	memset(dmi, 0, sizeof(*dmi));
+	dmi->link = link;
+	dmi->link_ctx = link_ctx;
 	dmi->targetsel = targetsel;
 	dmi->apsel = apsel;
+	dmi->next_on_link = dmi;
+	return dmi;
+}
+
+swd_dmi_t *swd_dmi_create_shared(swd_dmi_t *other, uint32_t targetsel, uint apsel) {
+	swd_dmi_t *dmi = swd_dmi_create(other->link, other->link_ctx, targetsel, apsel);
+	if (!dmi)
+		return dmi;
+	dmi->next_on_link = other->next_on_link;
+	other->next_on_link = dmi;
 	return dmi;
 }
 
 void swd_dmi_destroy(swd_dmi_t *dmi) {
+	swd_dmi_t *prev = dmi;
+	while (prev->next_on_link != dmi)
+		prev = prev->next_on_link;
+	prev->next_on_link = dmi->next_on_link;
 	free(dmi);
 }
 
 // ----------------------------------------------------------------------------
 // IO functions
 
-// TODO these should probably be passed as a function table to swd_dmi_create()
-// TODO use PIO instead of bitbang
-
-#define PROBE_PIN_SWCLK 2
-#define PROBE_PIN_SWDIO 3
-
-static inline void set_swdo(bool x) {
-	gpio_put(PROBE_PIN_SWDIO, x);
-}
-
-static inline void set_swdo_en(bool x) {
-	gpio_set_dir(PROBE_PIN_SWDIO, x);
-}
-
-static inline void set_swclk(bool x) {
-	gpio_put(PROBE_PIN_SWCLK, x);
-}
-
-static inline bool get_swdi(void) {
-	return gpio_get(PROBE_PIN_SWDIO);
-}
-
-static inline void bitbang_delay(void) {
-	// 12 cycles (~0.1 us @ 125 MHz) -> ~5 MHz SWCLK
-	asm volatile (
-		"   b 1f\n"
-		"1: b 1f\n"
-		"1: b 1f\n"
-		"1: b 1f\n"
-		"1: b 1f\n"
-		"1: b 1f\n"
-		"1     :\n"
-	);
+static inline void put_bits(swd_dmi_t *dmi, const uint8_t *tx, uint n_bits) {
+	dmi->swclk_count += n_bits;
+	dmi->link->put_bits(dmi->link_ctx, tx, n_bits);
 }
 
-static void put_bits(const uint8_t *tx, int n_bits) {
-	set_swdo_en(1);
-	uint8_t shifter = 0;
-	for (int i = 0; i < n_bits; ++i) {
-		if (i % 8 == 0)
-			shifter = tx[i / 8];
-		else
-			shifter >>= 1;
-		set_swdo(shifter & 1u);
-		bitbang_delay();
-		set_swclk(1);
-		bitbang_delay();
-		set_swclk(0);
-	}
-
+static inline void get_bits(swd_dmi_t *dmi, uint8_t *rx, uint n_bits) {
+	dmi->swclk_count += n_bits;
+	dmi->link->get_bits(dmi->link_ctx, rx, n_bits);
 }
 
-static void get_bits(uint8_t *rx, int n_bits) {
-	uint8_t shifter = 0;
-	set_swdo_en(0);
-	for (int i = 0; i < n_bits; ++i) {
-		bitbang_delay();
-		bool sample = get_swdi();
-		set_swclk(1);
-		bitbang_delay();
-		set_swclk(0);
-
-		shifter = (shifter >> 1) | (sample << 7);
-		if (i % 8 == 7)
-			rx[i / 8] = shifter;
-	}
-	if (n_bits % 8 != 0) {
-		rx[n_bits / 8] = shifter >> (8 - n_bits % 8);
-	}
+static inline void hiz_clocks(swd_dmi_t *dmi, uint n_bits) {
+	dmi->swclk_count += n_bits;
+	dmi->link->hiz_clocks(dmi->link_ctx, n_bits);
 }
 
-static void hiz_clocks(int n_bits) {
-	set_swdo_en(0);
-	for (int i = 0; i < n_bits; ++i) {
-		bitbang_delay();
-		set_swclk(1);
-		bitbang_delay();
-		set_swclk(0);
-	}
+// SWCLK with SWDIO driven low, at most IDLE_MAX cycles
+static inline void idle_clocks(swd_dmi_t *dmi, uint n_bits) {
+	static const uint8_t zeroes[IDLE_MAX / 8] = {0};
+	if (n_bits)
+		put_bits(dmi, zeroes, n_bits);
 }
 
 // ----------------------------------------------------------------------------
@@ -165,64 +167,102 @@ static uint8_t swd_header(ap_dp_t ap_ndp, bool read_nwrite, uint8_t addr) {
 		1u << 7;                    // Park
 }
 
-static void swd_targetsel(uint32_t id) {
+static void swd_targetsel(swd_dmi_t *dmi, uint32_t id) {
 	uint8_t header = swd_header(DP, 0, 3);
-	put_bits(&header, 8);
+	put_bits(dmi, &header, 8);
 	// No response to TARGETSEL.
-	hiz_clocks(5);
+	hiz_clocks(dmi, 5);
 	uint8_t txbuf[4];
 	for (int i = 0; i < 4; ++i)
 		txbuf[i] = (id >> i * 8) & 0xff;
-	put_bits(txbuf, 32);
+	put_bits(dmi, txbuf, 32);
 	// Parity
 	txbuf[0] = 0;
 	for (int i = 0; i < 32; ++i)
 		txbuf[0] ^= (id >> i) & 0x1;
-	put_bits(txbuf, 1);
+	put_bits(dmi, txbuf, 1);
 }
 
 // Only support ORUNDETECT=1 reads and writes (i.e. the good ones) -- this is
 // safe because the writes required to set ORUNDETECT can be constructed to
 // not fault.
-static inline swd_status_t swd_read(ap_dp_t ap_ndp, uint8_t addr, uint32_t *data) {
-	uint8_t header = swd_header(ap_ndp, 1, addr);
-	put_bits(&header, 8);
-	hiz_clocks(1);
+
+// Header, turnaround, ACK, 33-bit data phase, turnaround (on either side of
+// the data phase, depending on direction)
+#define PACKET_CYCLES (8 + 1 + 3 + 33 + 1)
+
+static swd_status_t swd_read_bits(swd_dmi_t *dmi, uint8_t header, uint32_t *data) {
+	put_bits(dmi, &header, 8);
+	hiz_clocks(dmi, 1);
 	uint8_t status;
-	get_bits(&status, 3);
+	get_bits(dmi, &status, 3);
 	uint8_t rxbuf[4];
-	get_bits(rxbuf, 32);
+	get_bits(dmi, rxbuf, 32);
 	*data = 0;
 	for (int i = 0; i < 4; ++i)
 		*data = (*data >> 8) | ((uint32_t)rxbuf[i] << 24);
 	// Just discard parity bit -- have a separate test for that.
-	get_bits(rxbuf, 1);
+	get_bits(dmi, rxbuf, 1);
 	// Turnaround for next packet header
-	hiz_clocks(1);
-	dmi_debug("  SWD R %cP:%x -> %08lx\n", "DA"[(int)ap_ndp], 4 * addr, *data);
+	hiz_clocks(dmi, 1);
 	return (swd_status_t)status;
 }
 
-static inline swd_status_t swd_write(ap_dp_t ap_ndp, uint8_t addr, uint32_t data) {
-	uint8_t header = swd_header(ap_ndp, 0, addr);
-	put_bits(&header, 8);
-	hiz_clocks(1);
+static swd_status_t swd_write_bits(swd_dmi_t *dmi, uint8_t header, uint32_t data) {
+	put_bits(dmi, &header, 8);
+	hiz_clocks(dmi, 1);
 	uint8_t status;
-	get_bits(&status, 3);
-	hiz_clocks(1);
+	get_bits(dmi, &status, 3);
+	hiz_clocks(dmi, 1);
 	uint8_t txbuf[4];
 	for (int i = 0; i < 4; ++i)
 		txbuf[i] = (data >> i * 8) & 0xff;
-	put_bits(txbuf, 32);
+	put_bits(dmi, txbuf, 32);
 	// Parity
 	txbuf[0] = 0;
 	for (int i = 0; i < 32; ++i)
 		txbuf[0] ^= (data >> i) & 0x1;
-	put_bits(txbuf, 1);
-	dmi_debug("  SWD W %cP:%x <- %08lx\n", "DA"[(int)ap_ndp], 4 * addr, data);
+	put_bits(dmi, txbuf, 1);
 	return (swd_status_t)status;
 }
 
+static inline void count_ack(swd_dmi_t *dmi, uint8_t header, swd_status_t status, uint32_t data) {
+	if (status == WAIT)
+		++dmi->stats.wait;
+	else if (status == FAULT)
+		++dmi->stats.fault;
+	dmi_capture_put(CAPTURE_SWD, CAPTURE_TAP_NONE, header,
+		(uint8_t)status | (dmi->retry < 15 ? dmi->retry : 15) << 4, data);
+}
+
+static inline swd_status_t swd_read(swd_dmi_t *dmi, ap_dp_t ap_ndp, uint8_t addr, uint32_t *data) {
+	uint8_t header = swd_header(ap_ndp, 1, addr);
+	swd_status_t status;
+	if (dmi->link->transfer) {
+		dmi->swclk_count += PACKET_CYCLES;
+		status = (swd_status_t)dmi->link->transfer(dmi->link_ctx, header, data);
+	} else {
+		status = swd_read_bits(dmi, header, data);
+	}
+	count_ack(dmi, header, status, *data);
+	dmi_debug("  SWD R %cP:%x -> %08lx\n", "DA"[(int)ap_ndp], 4 * addr, *data);
+	return status;
+}
+
+static inline swd_status_t swd_write(swd_dmi_t *dmi, ap_dp_t ap_ndp, uint8_t addr, uint32_t data) {
+	uint8_t header = swd_header(ap_ndp, 0, addr);
+	swd_status_t status;
+	if (dmi->link->transfer) {
+		dmi->swclk_count += PACKET_CYCLES;
+		status = (swd_status_t)dmi->link->transfer(dmi->link_ctx, header, &data);
+	} else {
+		status = swd_write_bits(dmi, header, data);
+	}
+	count_ack(dmi, header, status, data);
+	dmi_debug("  SWD W %cP:%x <- %08lx\n", "DA"[(int)ap_ndp], 4 * addr, data);
+	return status;
+}
+
 // ----------------------------------------------------------------------------
 // DMI implementation
 
@@ -236,16 +276,24 @@ static inline swd_status_t swd_write(ap_dp_t ap_ndp, uint8_t addr, uint32_t data
 //
 // Connection sequence is as follows:
 //
-// - A line reset, then SWD-to-Dormant. (If the link is up, down it.)
-// - Dormant-to-SWD
-// - Line reset
-// - TARGETSEL using provided value
-// - Read DPIDR to exit reset state
+// - Line reset, TARGETSEL, and DPIDR read. If the DP is already in SWD mode
+//   (e.g. we have just lost it to a target reset) that is all it needs.
+//   Otherwise:
+//   - A line reset, then SWD-to-Dormant. (If the link is up, down it.)
+//   - Dormant-to-SWD
+//   - Line reset
+//   - TARGETSEL using provided value
+//   - Read DPIDR to exit reset state
 // - Write all ABORT bits
-// - Write CDBGPWRUPREQ, CSYSPWRUPREQ, ORUNDETECT = 1
-// - Poll for CDBGPWRUPACK/CSYSPWRUPACK (max _n_ times)
-// - Check AP ID register indicates a Mem-AP
+// - If this is the DP we last connected to, and CTRL/STAT shows it is still
+//   powered up with ORUNDETECT set, skip straight to restoring CSW.
+//   Otherwise:
+//   - Write CDBGPWRUPREQ, CSYSPWRUPREQ, ORUNDETECT = 1
+//   - Poll for CDBGPWRUPACK/CSYSPWRUPACK (max _n_ times)
+//   - Check AP ID register indicates a Mem-AP
+//   - Read CSW
 // - Set up SELECT to point to the useful Mem-AP  registers (CSW TAR DRW)
+// - Write CSW, with AddrInc off
 //
 // Reference: ADIv5.2 spec IHI0031F Figure B5-4
 // "SWJ-DP selection of JTAG, SWD, and dormant states"
@@ -263,8 +311,17 @@ static inline swd_status_t swd_write(ap_dp_t ap_ndp, uint8_t addr, uint32_t data
 #define DP_CTRL_STAT_CSYSPWRUPREQ (1u << 30)
 #define DP_CTRL_STAT_CDBGPWRUPACK (1u << 29)
 #define DP_CTRL_STAT_CDBGPWRUPREQ (1u << 28)
+#define DP_CTRL_STAT_PWRUPREQ_BITS (DP_CTRL_STAT_CSYSPWRUPREQ | DP_CTRL_STAT_CDBGPWRUPREQ)
+#define DP_CTRL_STAT_PWRUPACK_BITS (DP_CTRL_STAT_CSYSPWRUPACK | DP_CTRL_STAT_CDBGPWRUPACK)
+#define DP_CTRL_STAT_WDATAERR     (1u << 7)
+#define DP_CTRL_STAT_STICKYERR    (1u << 5)
+#define DP_CTRL_STAT_STICKYORUN   (1u << 1)
 #define DP_CTRL_STAT_ORUNDETECT   (1u << 0)
 
+// ORUNERRCLR, WDERRCLR, STKERRCLR, STKCMPCLR
+#define DP_ABORT_CLEAR_ERRORS     0x1eu
+#define DP_ABORT_ORUNERRCLR       (1u << 4)
+
 #define AP_REG_CSW   0
 #define AP_REG_TAR   1
 #define AP_REG_DRW   3
@@ -275,6 +332,12 @@ static inline swd_status_t swd_write(ap_dp_t ap_ndp, uint8_t addr, uint32_t data
 #define AP_BANK_DRW  (0 << 4)
 #define AP_BANK_IDR  (0xf << 4)
 
+#define AP_CSW_ADDRINC_BITS   (3u << 4)
+#define AP_CSW_ADDRINC_SINGLE (1u << 4)
+
+// TAR auto-increment is only guaranteed within a 1 kB block
+#define TAR_INC_MASK 0x3ffu
+
 // CLASS=8 (Mem-AP) TYPE=2 (APB2/APB3)
 #define APIDR_EXPECTED_MASK 0x1e00f
 #define APIDR_EXPECTED_DATA 0x10002
@@ -299,59 +362,99 @@ static const uint8_t link_down_up[] = {
 
 static const uint link_down_up_bits = sizeof(link_down_up) * 8 - 4;
 
-int swd_dmi_connect(swd_dmi_t *dmi) {
-	dmi_debug("swd_dmi_connect targetsel=%08lx apsel=%u\n", dmi->targetsel, dmi->apsel);
-
-	gpio_init(PROBE_PIN_SWDIO);
-	gpio_init(PROBE_PIN_SWCLK);
-	gpio_set_dir(PROBE_PIN_SWCLK, 1);
+static const uint8_t line_reset[] = {
+	// At least 50 cycles high, then some zeroes
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x03
+};
 
-	dmi->addr_cache_valid = false;
-	// Drive the fixed link cycling sequence, which should put us in Reset
-	put_bits(link_down_up, link_down_up_bits);
+static const uint line_reset_bits = sizeof(line_reset) * 8;
 
+// From the Reset state (i.e. just after a line reset)
+static swd_status_t select_dp(swd_dmi_t *dmi, uint32_t *dpidr) {
 	// TARGETSEL puts any non-matching DPs in the Reset state into the
 	// Deselected state (which is functionally similar to the lockout state).
 	// Note there is no response to TARGETSEL.
 	if (dmi->targetsel != 0)
-		swd_targetsel(dmi->targetsel);
+		swd_targetsel(dmi, dmi->targetsel);
 
-	// DPIDR read required to leave Reset state -- ignore the value, since
-	// anything that responds after TARGETSEL is assumed the correct target.
-	uint32_t data;
-	swd_status_t status = swd_read(DP, DP_REG_DPIDR, &data);
-	if (status != OK) {
-		dmi_debug("DPIDR read failed\n");
-		return -1;
+	// DPIDR read required to leave Reset state -- anything that responds
+	// after TARGETSEL is assumed the correct target.
+	return swd_read(dmi, DP, DP_REG_DPIDR, dpidr);
+}
+
+// A WAIT means the AP is still busy with its previous DRW access, so give
+// accesses of that type more idle cycles afterwards. This avoids paying for
+// the WAIT and retry next time. Drift back down every so often, in case the
+// WAIT was a one-off.
+
+static void idle_wait(swd_dmi_t *dmi) {
+	uint t = dmi->last_drw_write;
+	uint idle = dmi->idle[t] + dmi->idle[t] / 2 + 1;
+	dmi->idle[t] = idle < IDLE_MAX ? idle : IDLE_MAX;
+	dmi->idle_run[t] = 0;
+	// Give the AP a chance to finish before retrying
+	idle_clocks(dmi, dmi->idle[t]);
+}
+
+static void idle_after_drw(swd_dmi_t *dmi, bool write) {
+	dmi->last_drw_write = write;
+	if (!dmi->idle[write])
+		return;
+	idle_clocks(dmi, dmi->idle[write]);
+	if (++dmi->idle_run[write] >= IDLE_DECAY_PERIOD) {
+		--dmi->idle[write];
+		dmi->idle_run[write] = 0;
 	}
-	dmi_debug("Read DPIDR: %08lx\n", data);
+}
 
-	// Clear any outstanding errors via ABORT so that SELECT becomes writable
-	status = swd_write(DP, DP_REG_ABORT, 0x1e);
-	if (status != OK) {
-		return -1;
+// An AP access, or an RDBUF read (which waits for the AP in the same way),
+// retried on WAIT. With ORUNDETECT=1, a WAIT also sets STICKYORUN, which has
+// to be cleared before the AP will accept anything again.
+static swd_status_t ap_access(swd_dmi_t *dmi, ap_dp_t ap_ndp, bool read, uint8_t addr, uint32_t *data) {
+	swd_status_t status;
+	for (dmi->retry = 0; ; ++dmi->retry) {
+		status = read ? swd_read(dmi, ap_ndp, addr, data) : swd_write(dmi, ap_ndp, addr, *data);
+		if (status != WAIT || dmi->retry == WAIT_RETRIES)
+			break;
+		++dmi->stats.retries;
+		idle_wait(dmi);
+		status = swd_write(dmi, DP, DP_REG_ABORT, DP_ABORT_ORUNERRCLR);
+		if (status != OK)
+			break;
 	}
+	dmi->retry = 0;
+	return status;
+}
+
+// The IDR read during connect has the same A[3:2] as DRW (in another bank),
+// so only accesses made through here count towards the DRW idle cycles.
+static swd_status_t drw_access(swd_dmi_t *dmi, bool read, uint32_t *data) {
+	swd_status_t status = ap_access(dmi, AP, read, AP_REG_DRW, data);
+	if (status == OK)
+		idle_after_drw(dmi, !read);
+	return status;
+}
 
+static int power_up(swd_dmi_t *dmi) {
 	// Power up before attempting AP accesses (also take this opportunity to
 	// set ORUNDETECT as we don't support legacy SWDv1 fault handling)
-	const uint32_t pwr_req_bits = DP_CTRL_STAT_CSYSPWRUPREQ | DP_CTRL_STAT_CDBGPWRUPREQ;
-	const uint32_t pwr_ack_bits = DP_CTRL_STAT_CSYSPWRUPACK | DP_CTRL_STAT_CDBGPWRUPACK;
-	status = swd_write(DP, DP_REG_SELECT, DP_BANK_CTRL_STAT);
+	swd_status_t status = swd_write(dmi, DP, DP_REG_SELECT, DP_BANK_CTRL_STAT);
 	if (status != OK) {
 		return -1;
 	}
-	status = swd_write(DP, DP_REG_CTRL_STAT,
-		pwr_req_bits | DP_CTRL_STAT_ORUNDETECT);
+	status = swd_write(dmi, DP, DP_REG_CTRL_STAT,
+		DP_CTRL_STAT_PWRUPREQ_BITS | DP_CTRL_STAT_ORUNDETECT);
 	if (status != OK) {
 		return -1;
 	}
 	int timeout = 0;
 	for (; timeout < PWRUP_ACK_TIMEOUT; ++timeout) {
-		status = swd_read(DP, DP_REG_CTRL_STAT, &data);
+		uint32_t data;
+		status = swd_read(dmi, DP, DP_REG_CTRL_STAT, &data);
 		if (status != OK) {
 			return -1;
 		}
-		if ((data & pwr_ack_bits) == pwr_ack_bits) {
+		if ((data & DP_CTRL_STAT_PWRUPACK_BITS) == DP_CTRL_STAT_PWRUPACK_BITS) {
 			break;
 		}
 	}
@@ -359,12 +462,15 @@ int swd_dmi_connect(swd_dmi_t *dmi) {
 		dmi_info("PWRUPACK timed out\n");
 		return -1;
 	}
+	return 0;
+}
 
+static int identify_ap(swd_dmi_t *dmi) {
 	// Have a quick squint at the designated AP and check it is a Mem-AP
-	(void)swd_write(DP, DP_REG_SELECT, AP_BANK_IDR | (dmi->apsel << 24));
-	// TODO from this point forward we should be checking WAIT responses
-	(void)swd_read(AP, AP_REG_IDR, &data);
-	status = swd_read(DP, DP_REG_RDBUF, &data);
+	uint32_t data;
+	(void)swd_write(dmi, DP, DP_REG_SELECT, AP_BANK_IDR | (dmi->apsel << 24));
+	(void)ap_access(dmi, AP, true, AP_REG_IDR, &data);
+	swd_status_t status = ap_access(dmi, DP, true, DP_REG_RDBUF, &data);
 	if (status != OK) {
 		return -1;
 	}
@@ -377,37 +483,341 @@ int swd_dmi_connect(swd_dmi_t *dmi) {
 	// Set up SELECT to point to CSW/TAR/DRW. Note we don't use the BDx
 	// registers as they seem unlikely to be profitable based on the RISC-V
 	// DM memory map, and on the additional AP bank switching they entail.
-	status = swd_write(DP, DP_REG_SELECT, AP_BANK_CSW | (dmi->apsel << 24));
+	status = swd_write(dmi, DP, DP_REG_SELECT, AP_BANK_CSW | (dmi->apsel << 24));
 	if (status != OK) {
 		return -1;
 	}
 
+	// Keep the rest of CSW as we find it, but start with AddrInc off, since
+	// it may have been left on by a previous connection.
+	(void)ap_access(dmi, AP, true, AP_REG_CSW, &data);
+	status = ap_access(dmi, DP, true, DP_REG_RDBUF, &data);
+	if (status != OK) {
+		return -1;
+	}
+	dmi->csw = data & ~AP_CSW_ADDRINC_BITS;
 	return 0;
 }
 
-static inline void set_addr(swd_dmi_t *dmi, uint32_t addr) {
-	if (dmi->addr_cache_valid && dmi->addr_cache == addr) {
+// Multi-drop: before talking to another DP on the link, collect any posted
+// read from the one currently selected, since that needs its RDBUFF.
+static void release_link(swd_dmi_t *dmi) {
+	for (swd_dmi_t *other = dmi->next_on_link; other != dmi; other = other->next_on_link) {
+		if (other->selected) {
+			(void)swd_dmi_flush(other);
+			other->selected = false;
+		}
+	}
+}
+
+// Switching DPs doesn't disturb their registers, so each DMI's SELECT, CSW
+// and TAR state is still good when it is selected again, and switching is
+// just a line reset, TARGETSEL and DPIDR read. If the DPIDR has changed, or
+// this DMI never connected, leave it to swd_dmi_connect().
+static int select_target(swd_dmi_t *dmi) {
+	if (dmi->selected)
+		return 0;
+	release_link(dmi);
+	if (!dmi->connected)
+		return -1;
+	uint32_t dpidr;
+	put_bits(dmi, line_reset, line_reset_bits);
+	dmi->selected = select_dp(dmi, &dpidr) == OK && dpidr == dmi->dpidr;
+	dmi_debug("Select targetsel=%08lx: ok=%u\n", dmi->targetsel, dmi->selected);
+	++dmi->stats.switches;
+	return dmi->selected ? 0 : -1;
+}
+
+int swd_dmi_connect(swd_dmi_t *dmi) {
+	dmi_debug("swd_dmi_connect targetsel=%08lx apsel=%u\n", dmi->targetsel, dmi->apsel);
+
+	release_link(dmi);
+	dmi->link->init(dmi->link_ctx);
+
+	dmi->addr_cache_valid = false;
+	dmi->posted = NULL;
+	bool was_connected = dmi->connected;
+	dmi->connected = false;
+	dmi->selected = false;
+
+	uint32_t dpidr;
+	put_bits(dmi, line_reset, line_reset_bits);
+	swd_status_t status = select_dp(dmi, &dpidr);
+	if (status != OK) {
+		// Drive the fixed link cycling sequence, which should put us in Reset
+		dmi_debug("No response after line reset, trying dormant-to-SWD\n");
+		put_bits(dmi, link_down_up, link_down_up_bits);
+		status = select_dp(dmi, &dpidr);
+	}
+	if (status != OK) {
+		dmi_debug("DPIDR read failed\n");
+		return -1;
+	}
+	dmi_debug("Read DPIDR: %08lx\n", dpidr);
+
+	// Clear any outstanding errors via ABORT so that SELECT becomes writable
+	status = swd_write(dmi, DP, DP_REG_ABORT, DP_ABORT_CLEAR_ERRORS);
+	if (status != OK) {
+		return -1;
+	}
+
+	// The DP doesn't lose CTRL/STAT without a power cycle, which would also
+	// clear the bits we set. If they are still set, and it's the same DP,
+	// then the AP we checked last time is still there and powered.
+	bool warm = was_connected && dpidr == dmi->dpidr;
+	if (warm) {
+		const uint32_t expect = DP_CTRL_STAT_PWRUPREQ_BITS | DP_CTRL_STAT_PWRUPACK_BITS |
+			DP_CTRL_STAT_ORUNDETECT;
+		uint32_t data;
+		// DPBANKSEL is 0 in this SELECT value, so CTRL/STAT is visible too
+		status = swd_write(dmi, DP, DP_REG_SELECT, AP_BANK_CSW | (dmi->apsel << 24));
+		if (status == OK)
+			status = swd_read(dmi, DP, DP_REG_CTRL_STAT, &data);
+		if (status != OK) {
+			return -1;
+		}
+		warm = (data & expect) == expect;
+	}
+	if (!warm) {
+		dmi->dpidr = dpidr;
+		if (power_up(dmi) || identify_ap(dmi)) {
+			return -1;
+		}
+	}
+	dmi_debug("Connect warm=%u\n", warm);
+
+	// Both paths leave SELECT pointing to CSW/TAR/DRW
+	status = ap_access(dmi, AP, false, AP_REG_CSW, &dmi->csw);
+	if (status != OK) {
+		return -1;
+	}
+	dmi->addr_inc = false;
+	dmi->last_addr_valid = false;
+	dmi->connected = true;
+	dmi->selected = true;
+
+	return 0;
+}
+
+// TAR is cached, and with CSW.AddrInc set, the AP increments it after every
+// DRW access, so a run of sequential accesses (e.g. progbuf or data uploads)
+// needs no TAR writes at all. Repeated accesses to one address (e.g. sbdata0
+// streaming, or status polling) want AddrInc off instead. The mode follows
+// whichever pattern caused the most recent TAR miss; switching costs one CSW
+// write.
+
+// ADI only defines AddrInc within a 1 kB block. What TAR does after the
+// last word of a block is up to the AP, so don't predict it.
+static inline bool tar_inc_defined(uint32_t addr) {
+	return (addr & TAR_INC_MASK) != TAR_INC_MASK - 3;
+}
+
+static inline bool tar_hit(swd_dmi_t *dmi, uint32_t addr) {
+	return dmi->addr_cache_valid && dmi->addr_cache == addr;
+}
+
+// Point TAR at addr, with AddrInc set as requested
+static swd_status_t set_tar(swd_dmi_t *dmi, uint32_t addr, bool inc) {
+	swd_status_t status;
+	if (inc != dmi->addr_inc) {
+		uint32_t csw = dmi->csw | (inc ? AP_CSW_ADDRINC_SINGLE : 0);
+		status = ap_access(dmi, AP, false, AP_REG_CSW, &csw);
+		if (status != OK) {
+			dmi->addr_cache_valid = false;
+			return status;
+		}
+		dmi->addr_inc = inc;
+	}
+	if (tar_hit(dmi, addr))
+		return OK;
+	// dmi_debug("TAR <- %08lx\n", addr);
+	status = ap_access(dmi, AP, false, AP_REG_TAR, &addr);
+	dmi->addr_cache_valid = status == OK;
+	dmi->addr_cache = addr;
+	return status;
+}
+
+static swd_status_t set_addr(swd_dmi_t *dmi, uint32_t addr) {
+	if (tar_hit(dmi, addr)) {
 		// dmi_debug("TAR cache hit\n");
-	} else {
-		// dmi_debug("TAR <- %08lx\n", addr);
-		swd_write(AP, AP_REG_TAR, addr);
-		dmi->addr_cache_valid = true;
-		dmi->addr_cache = addr;
+		return OK;
 	}
+	bool want_inc = dmi->addr_inc;
+	if (dmi->last_addr_valid && addr == dmi->last_addr)
+		want_inc = false;
+	else if (dmi->last_addr_valid && tar_inc_defined(dmi->last_addr) && addr == dmi->last_addr + 4)
+		want_inc = true;
+	return set_tar(dmi, addr, want_inc);
 }
 
-void swd_dmi_write(swd_dmi_t *dmi, uint32_t addr, uint32_t data) {
+// Track TAR after a DRW access
+static inline void drw_done(swd_dmi_t *dmi, uint32_t addr, swd_status_t status) {
+	dmi->last_addr = addr;
+	dmi->last_addr_valid = status == OK;
+	if (status != OK || (dmi->addr_inc && !tar_inc_defined(addr))) {
+		dmi->addr_cache_valid = false;
+		dmi->last_addr_valid = false;
+	} else if (dmi->addr_inc) {
+		dmi->addr_cache = addr + 4;
+	}
+}
+
+// AP reads are posted: each DRW read returns the result of the previous AP
+// read, and RDBUF returns the most recent one without starting another.
+// Back-to-back DMI reads therefore cost one packet each, plus one RDBUF read
+// at the end. dmi->posted is where the result of the read currently in the
+// AP should go, if any.
+
+int swd_dmi_flush(swd_dmi_t *dmi) {
+	if (!dmi->posted)
+		return 0;
+	uint32_t start = dmi->swclk_count;
+	swd_status_t status = ap_access(dmi, DP, true, DP_REG_RDBUF, dmi->posted);
+	dmi->posted = NULL;
+	dmi->last_access_cycles += dmi->swclk_count - start;
+	return status == OK ? 0 : -1;
+}
+
+int swd_dmi_write(swd_dmi_t *dmi, uint32_t addr, uint32_t data) {
+	uint32_t start = dmi->swclk_count;
+	if (select_target(dmi) || swd_dmi_flush(dmi))
+		return -1;
 	addr <<= 2;
-	// TODO wait states -- leaving them out for now as the internal DMI is
-	// assumed to have pretty fast access. It's just an APB bus going
-	// straight to the DM.
-	set_addr(dmi, addr);
-	(void)swd_write(AP, AP_REG_DRW, data);
-};
+	swd_status_t status = set_addr(dmi, addr);
+	if (status == OK) {
+		status = drw_access(dmi, false, &data);
+		drw_done(dmi, addr, status);
+	}
+	dmi->last_access_cycles = dmi->swclk_count - start;
+	return status == OK ? 0 : -1;
+}
+
+// DRW writes back to back, ignoring the ACKs until the end. Returns the
+// index of the first write that was not ACKed OK, or n. Idle cycles can't
+// be slotted in between the link's own burst writes, so once the AP has
+// needed them, go one write at a time, stopping at the first failure so
+// that nothing after it reaches the target before the replay.
+static uint drw_write_burst(swd_dmi_t *dmi, const uint32_t *data, uint n) {
+	if (dmi->link->write_burst && !dmi->idle[1]) {
+		dmi->swclk_count += n * PACKET_CYCLES;
+		dmi->last_drw_write = true;
+		dmi_debug("  SWD W AP:%x <- burst of %u\n", 4 * AP_REG_DRW, n);
+		uint8_t header = swd_header(AP, 0, AP_REG_DRW);
+		uint ok = dmi->link->write_burst(dmi->link_ctx, header, data, n);
+		// The link doesn't say what the bad ACK was
+		dmi_capture_put(CAPTURE_SWD_BURST, CAPTURE_TAP_NONE, header,
+			ok == n ? OK : FAULT, n | ok << 16);
+		return ok;
+	}
+	for (uint i = 0; i < n; ++i) {
+		uint32_t wdata = data[i];
+		if (drw_access(dmi, false, &wdata) != OK)
+			return i;
+	}
+	return n;
+}
 
-void swd_dmi_read(swd_dmi_t *dmi, uint32_t addr, uint32_t *data) {
+// Write bursts rely on ORUNDETECT: once a write gets a WAIT, STICKYORUN is
+// set and the DP FAULTs every AP access after it, but the data phases still
+// happen, so the writes can be queued without looking at their ACKs. If any
+// ACK in the burst was not OK, one CTRL/STAT read at the end says why. After
+// an overrun (or a write data parity error), clear it and replay from the
+// first write that did not complete.
+
+uint swd_dmi_write_burst(swd_dmi_t *dmi, uint32_t addr, const uint32_t *data, uint n, bool incr) {
+	uint32_t start = dmi->swclk_count;
+	if (select_target(dmi) || swd_dmi_flush(dmi))
+		return 0;
 	addr <<= 2;
-	set_addr(dmi, addr);
-	(void)swd_read(AP, AP_REG_DRW, data);
-	(void)swd_read(DP, DP_REG_RDBUF, data);
+	uint done = 0;
+	uint retries = 0;
+	while (done < n) {
+		uint32_t chunk_addr = incr ? addr + 4 * done : addr;
+		uint chunk = n - done;
+		// Don't rely on TAR incrementing across a 1 kB boundary
+		if (incr && chunk > (TAR_INC_MASK + 1 - (chunk_addr & TAR_INC_MASK)) / 4)
+			chunk = (TAR_INC_MASK + 1 - (chunk_addr & TAR_INC_MASK)) / 4;
+		if (set_tar(dmi, chunk_addr, incr) != OK)
+			break;
+		uint ok = drw_write_burst(dmi, data + done, chunk);
+		if (ok == chunk) {
+			drw_done(dmi, incr ? chunk_addr + 4 * (chunk - 1) : chunk_addr, OK);
+			done += chunk;
+			continue;
+		}
+		dmi->addr_cache_valid = false;
+		dmi->last_addr_valid = false;
+		uint32_t ctrl_stat;
+		if (swd_read(dmi, DP, DP_REG_CTRL_STAT, &ctrl_stat) != OK)
+			break;
+		dmi_debug("Write burst error at %u/%u, CTRL/STAT = %08lx\n", done + ok, n, ctrl_stat);
+		if (!(ctrl_stat & (DP_CTRL_STAT_STICKYORUN | DP_CTRL_STAT_WDATAERR))) {
+			// A bus error won't go away by retrying, and with no sticky flag
+			// at all it was a protocol error, so there is no telling which
+			// of the later writes the DP saw.
+			if (ctrl_stat & DP_CTRL_STAT_STICKYERR)
+				(void)swd_write(dmi, DP, DP_REG_ABORT, DP_ABORT_CLEAR_ERRORS);
+			done += ok;
+			break;
+		}
+		// A bad write data parity is only reported by the next ACK, so the
+		// write before the first bad ACK did not complete either.
+		if ((ctrl_stat & DP_CTRL_STAT_WDATAERR) && ok > 0)
+			--ok;
+		done += ok;
+		if (ctrl_stat & DP_CTRL_STAT_STICKYORUN) {
+			// The link's burst doesn't report which ACKs were WAITs, but at
+			// least one was
+			++dmi->stats.wait;
+			idle_wait(dmi);
+		}
+		if (swd_write(dmi, DP, DP_REG_ABORT, DP_ABORT_CLEAR_ERRORS) != OK)
+			break;
+		if (++retries > WRITE_BURST_RETRIES)
+			break;
+		++dmi->stats.retries;
+	}
+	dmi->last_access_cycles = dmi->swclk_count - start;
+	return done;
+}
+
+int swd_dmi_read_posted(swd_dmi_t *dmi, uint32_t addr, uint32_t *data) {
+	uint32_t start = dmi->swclk_count;
+	if (select_target(dmi))
+		return -1;
+	addr <<= 2;
+	// Changing TAR or CSW is an AP write, so collect any pending result first
+	if (!tar_hit(dmi, addr) && swd_dmi_flush(dmi))
+		return -1;
+	swd_status_t status = set_addr(dmi, addr);
+	uint32_t prev;
+	if (status == OK) {
+		status = drw_access(dmi, true, &prev);
+		drw_done(dmi, addr, status);
+	}
+	if (status == OK && dmi->posted)
+		*dmi->posted = prev;
+	dmi->posted = status == OK ? data : NULL;
+	dmi->last_access_cycles = dmi->swclk_count - start;
+	return status == OK ? 0 : -1;
+}
+
+int swd_dmi_read(swd_dmi_t *dmi, uint32_t addr, uint32_t *data) {
+	if (swd_dmi_read_posted(dmi, addr, data))
+		return -1;
+	return swd_dmi_flush(dmi);
+}
+
+uint32_t swd_dmi_get_last_access_cycles(swd_dmi_t *dmi) {
+	return dmi->last_access_cycles;
+}
+
+void swd_dmi_get_stats(swd_dmi_t *dmi, swd_dmi_stats_t *stats) {
+	*stats = dmi->stats;
+	stats->idle_read = dmi->idle[0];
+	stats->idle_write = dmi->idle[1];
+}
+
+uint swd_dmi_get_swclk_khz(swd_dmi_t *dmi) {
+	return dmi->link->swclk_khz;
 }
@@ -13,14 +13,37 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-typedef unsigned int uint;
+#include "swd_link.h"
 
 struct swd_dmi;
 typedef struct swd_dmi swd_dmi_t;
 
+typedef struct swd_dmi_stats {
+	// Totals since creation, including during connection
+	uint32_t wait;
+	uint32_t fault;
+	// Accesses reissued after a WAIT, and write bursts replayed after an
+	// overrun
+	uint32_t retries;
+	// Times this DMI had to reselect its DP on a multi-drop link, after
+	// another DMI had used it
+	uint32_t switches;
+	// Idle cycles currently inserted after each DRW read and write, learned
+	// from WAIT responses
+	uint idle_read;
+	uint idle_write;
+} swd_dmi_stats_t;
+
 // Dynamically allocate a DMI instance, and initialise its members (but do not
-// attempt to connect the SWD link).
-swd_dmi_t *swd_dmi_create(uint32_t targetid, uint apsel);
+// attempt to connect the SWD link). All SWD IO goes through link, with
+// link_ctx passed back to each call.
+swd_dmi_t *swd_dmi_create(const swd_link_ops_t *link, void *link_ctx, uint32_t targetid, uint apsel);
+
+// Allocate a DMI for another DP on the same multi-drop link as other, with
+// its own TARGETSEL. The DMIs on a link may be used in any order, but not
+// concurrently: each access reselects its DP if another DMI has used the link
+// in the meantime.
+swd_dmi_t *swd_dmi_create_shared(swd_dmi_t *other, uint32_t targetsel, uint apsel);
 
 void swd_dmi_destroy(swd_dmi_t *dmi);
 
@@ -28,12 +51,39 @@ void swd_dmi_destroy(swd_dmi_t *dmi);
 // return 0. (Main reason for failure will be no target being connected!)
 int swd_dmi_connect(swd_dmi_t *dmi);
 
-// TODO errors
-
 // Note these functions scale their addresses by four (Mem-AP uses byte
-// addresses, and DM registers are nominally word-addressed)
-void swd_dmi_write(swd_dmi_t *dmi, uint32_t addr, uint32_t data);
+// addresses, and DM registers are nominally word-addressed). WAIT responses
+// are retried. Return 0 on success, or nonzero if the target did not respond
+// OK, in which case the link may need to be reconnected.
+int swd_dmi_write(swd_dmi_t *dmi, uint32_t addr, uint32_t data);
+
+int swd_dmi_read(swd_dmi_t *dmi, uint32_t addr, uint32_t *data);
+
+// Write n words back to back, to addr, addr + 1, ... if incr is true, or all
+// to addr otherwise. The ACKs are not checked until the end of the burst;
+// writes which hit an overrun are replayed. Returns the number of writes
+// known to have completed, which is n on success.
+uint swd_dmi_write_burst(swd_dmi_t *dmi, uint32_t addr, const uint32_t *data, uint n, bool incr);
+
+// Batched reads: start a read whose result is written to *data later, at the
+// latest by the next swd_dmi_flush(), swd_dmi_write() or swd_dmi_read().
+// Consecutive posted reads use SWD posted AP reads, so cost one packet each
+// rather than two. If any call fails, the result of a read posted before it
+// may never be written.
+int swd_dmi_read_posted(swd_dmi_t *dmi, uint32_t addr, uint32_t *data);
+
+// Collect the result of the last posted read, if it is still outstanding
+int swd_dmi_flush(swd_dmi_t *dmi);
+
+// Number of SWCLK cycles taken by the most recent swd_dmi_write(),
+// swd_dmi_read(), swd_dmi_read_posted() or swd_dmi_write_burst(), including
+// any TAR update, and
+// any swd_dmi_flush() since.
+uint32_t swd_dmi_get_last_access_cycles(swd_dmi_t *dmi);
+
+void swd_dmi_get_stats(swd_dmi_t *dmi, swd_dmi_stats_t *stats);
 
-void swd_dmi_read(swd_dmi_t *dmi, uint32_t addr, uint32_t *data);
+// Nominal SWCLK frequency of the link, for converting cycles to time
+uint swd_dmi_get_swclk_khz(swd_dmi_t *dmi);
 
 #endif
@@ -0,0 +1,72 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Physical SWD link used by swd_dmi.c. Each backend supplies a table of IO
+// functions, which swd_dmi_create() takes along with a context pointer that
+// is passed back to every call:
+//
+//   swd_link_bitbang: GPIO bitbang, processor-timed (swd_link_bitbang.c)
+//   swd_link_pio:     whole-packet PIO engine, plus probe.pio for raw
+//                     sequences (swd_link_pio.c, only built with
+//                     SWD_PACKET_ENGINE)
+//   sim_swd_link:     host builds only, drives the simulated DPs directly
+//                     (host/sim_swd.c)
+//
+// The context is a swd_link_port_t, saying which SWD port to use, or NULL
+// for the probe's own SWD pins.
+
+#ifndef _SWD_LINK_H
+#define _SWD_LINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef unsigned int uint;
+
+// Not a real ACK: returned by transfer() for an OK read with bad parity
+#define SWD_LINK_PARITY_ERROR 8u
+
+// One physical SWD port. Links on different ports share no state, so they
+// can be used from different cores at the same time.
+typedef struct swd_link_port {
+	uint pin_swclk;
+	uint pin_swdio;
+	// swd_packet.pio state machine, for swd_link_pio
+	uint sm;
+} swd_link_port_t;
+
+typedef struct swd_link_ops {
+	// Take over the SWD pins. Called at the start of every connection attempt.
+	void (*init)(void *ctx);
+	// Drive n_bits from tx onto SWDIO, LSB-first, one per SWCLK cycle.
+	void (*put_bits)(void *ctx, const uint8_t *tx, uint n_bits);
+	// Sample n_bits from SWDIO into rx, LSB-first, one per SWCLK cycle. Only
+	// required if transfer is NULL.
+	void (*get_bits)(void *ctx, uint8_t *rx, uint n_bits);
+	// Clock SWCLK n_bits times with SWDIO undriven.
+	void (*hiz_clocks)(void *ctx, uint n_bits);
+	// Optional: run one whole packet, with a single-cycle turnaround and a
+	// data phase regardless of ACK (ORUNDETECT=1). header is the 8-bit packet
+	// header as it appears on the wire. Returns the 3-bit ACK, or
+	// SWD_LINK_PARITY_ERROR. If NULL, swd_dmi.c builds packets from the bit
+	// functions above.
+	uint (*transfer)(void *ctx, uint8_t header, uint32_t *data);
+	// Optional: run n write packets with the same header back to back,
+	// without waiting for each ACK before starting the next (ORUNDETECT=1).
+	// Returns the index of the first write whose ACK was not OK, or n if all
+	// were OK. If NULL, swd_dmi.c issues the writes one at a time.
+	uint (*write_burst)(void *ctx, uint8_t header, const uint32_t *data, uint n);
+	// Nominal SWCLK frequency, for converting cycle counts to time
+	uint swclk_khz;
+	const char *name;
+} swd_link_ops_t;
+
+extern const swd_link_ops_t swd_link_bitbang;
+extern const swd_link_ops_t swd_link_pio;
+
+// The probe's SWD ports, as configured by PROBE_SWD_PORTS in
+// picoprobe_config.h. Port 0 is the probe's own SWD pins.
+extern const swd_link_port_t swd_link_ports[];
+extern const uint swd_link_n_ports;
+
+#endif
@@ -0,0 +1,133 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+#include "swd_link.h"
+
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+
+#include "picoprobe_config.h"
+
+// Nominal SWCLK frequency (see bitbang_delay())
+#define BITBANG_SWCLK_KHZ 5000
+
+// Here rather than in swd_link_pio.c, which is only built with
+// SWD_PACKET_ENGINE
+const swd_link_port_t swd_link_ports[] = {
+	{PROBE_PIN_SWCLK,   PROBE_PIN_SWDIO,   SWD_PACKET_SM},
+#if PROBE_SWD_PORTS > 1
+	{PROBE_PIN_SWCLK_1, PROBE_PIN_SWDIO_1, SWD_PACKET_SM + 1},
+#endif
+#if PROBE_SWD_PORTS > 2
+	{PROBE_PIN_SWCLK_2, PROBE_PIN_SWDIO_2, SWD_PACKET_SM + 2},
+#endif
+#if PROBE_SWD_PORTS > 3
+	{PROBE_PIN_SWCLK_3, PROBE_PIN_SWDIO_3, SWD_PACKET_SM + 3},
+#endif
+};
+
+const uint swd_link_n_ports = sizeof(swd_link_ports) / sizeof(swd_link_ports[0]);
+
+// A NULL context is the probe's own SWD pins
+static inline const swd_link_port_t *get_port(void *ctx) {
+	return ctx ? (const swd_link_port_t *)ctx : &swd_link_ports[0];
+}
+
+static inline void set_swdo(const swd_link_port_t *port, bool x) {
+	gpio_put(port->pin_swdio, x);
+}
+
+static inline void set_swdo_en(const swd_link_port_t *port, bool x) {
+	gpio_set_dir(port->pin_swdio, x);
+}
+
+static inline void set_swclk(const swd_link_port_t *port, bool x) {
+	gpio_put(port->pin_swclk, x);
+}
+
+static inline bool get_swdi(const swd_link_port_t *port) {
+	return gpio_get(port->pin_swdio);
+}
+
+static inline void bitbang_delay(void) {
+#ifdef __arm__
+	// 12 cycles (~0.1 us @ 125 MHz) -> ~5 MHz SWCLK
+	asm volatile (
+		"   b 1f\n"
+		"1: b 1f\n"
+		"1: b 1f\n"
+		"1: b 1f\n"
+		"1: b 1f\n"
+		"1: b 1f\n"
+		"1     :\n"
+	);
+#else
+	// Host build: the pins are simulated, so there is nothing to wait for
+#endif
+}
+
+static void bitbang_init(void *ctx) {
+	const swd_link_port_t *port = get_port(ctx);
+	gpio_init(port->pin_swdio);
+	gpio_init(port->pin_swclk);
+	gpio_set_dir(port->pin_swclk, 1);
+}
+
+static void bitbang_put_bits(void *ctx, const uint8_t *tx, uint n_bits) {
+	const swd_link_port_t *port = get_port(ctx);
+	set_swdo_en(port, 1);
+	uint8_t shifter = 0;
+	for (uint i = 0; i < n_bits; ++i) {
+		if (i % 8 == 0)
+			shifter = tx[i / 8];
+		else
+			shifter >>= 1;
+		set_swdo(port, shifter & 1u);
+		bitbang_delay();
+		set_swclk(port, 1);
+		bitbang_delay();
+		set_swclk(port, 0);
+	}
+}
+
+static void bitbang_get_bits(void *ctx, uint8_t *rx, uint n_bits) {
+	const swd_link_port_t *port = get_port(ctx);
+	uint8_t shifter = 0;
+	set_swdo_en(port, 0);
+	for (uint i = 0; i < n_bits; ++i) {
+		bitbang_delay();
+		bool sample = get_swdi(port);
+		set_swclk(port, 1);
+		bitbang_delay();
+		set_swclk(port, 0);
+
+		shifter = (shifter >> 1) | (sample << 7);
+		if (i % 8 == 7)
+			rx[i / 8] = shifter;
+	}
+	if (n_bits % 8 != 0) {
+		rx[n_bits / 8] = shifter >> (8 - n_bits % 8);
+	}
+}
+
+static void bitbang_hiz_clocks(void *ctx, uint n_bits) {
+	const swd_link_port_t *port = get_port(ctx);
+	set_swdo_en(port, 0);
+	for (uint i = 0; i < n_bits; ++i) {
+		bitbang_delay();
+		set_swclk(port, 1);
+		bitbang_delay();
+		set_swclk(port, 0);
+	}
+}
+
+const swd_link_ops_t swd_link_bitbang = {
+	.init        = bitbang_init,
+	.put_bits    = bitbang_put_bits,
+	.get_bits    = bitbang_get_bits,
+	.hiz_clocks  = bitbang_hiz_clocks,
+	.transfer    = NULL,
+	.write_burst = NULL,
+	.swclk_khz   = BITBANG_SWCLK_KHZ,
+	.name        = "bitbang"
+};
@@ -0,0 +1,89 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Packets go through the swd_packet.pio engine. Raw sequences (connect,
+// TARGETSEL) are rare, so on the probe's own SWD pins they use probe.pio,
+// which means switching the pins between the two PIO blocks. The other SWD
+// ports have no probe.pio state machine, and bitbang raw sequences instead.
+
+#include "swd_link.h"
+#include "swd_pio.h"
+#include "probe.h"
+#include "picoprobe_config.h"
+
+#include "hardware/gpio.h"
+
+#ifndef SWD_LINK_PIO_SWCLK_KHZ
+#define SWD_LINK_PIO_SWCLK_KHZ 12500
+#endif
+
+static inline bool is_probe_port(void *ctx) {
+	return !ctx || ((const swd_link_port_t *)ctx)->pin_swclk == PROBE_PIN_SWCLK;
+}
+
+// Runs on every connect, including warm reconnects on core 1, so this only
+// takes the pins back and sets the clocks. probe.pio must already be loaded
+// by probe_init(), which PORT_JTAG_SETUP does before connecting.
+static void pio_link_init(void *ctx) {
+	swd_pio_release_pins(ctx);
+	if (is_probe_port(ctx)) {
+		// Also undoes the bitbang link's gpio_init(), if that was used before
+		probe_gpio_init();
+		// SWD mode may have left probe.pio at the DAP clock
+		probe_set_swclk_freq_quiet(SWD_LINK_PIO_SWCLK_KHZ);
+	} else {
+		swd_link_bitbang.init(ctx);
+		gpio_pull_up(((const swd_link_port_t *)ctx)->pin_swdio);
+	}
+	swd_pio_init(ctx);
+	swd_pio_set_swclk_freq(ctx, SWD_LINK_PIO_SWCLK_KHZ);
+}
+
+static void pio_link_put_bits(void *ctx, const uint8_t *tx, uint n_bits) {
+	swd_pio_release_pins(ctx);
+	if (!is_probe_port(ctx)) {
+		swd_link_bitbang.put_bits(ctx, tx, n_bits);
+		return;
+	}
+	for (uint i = 0; i < n_bits; i += 32) {
+		uint n = n_bits - i < 32 ? n_bits - i : 32;
+		uint32_t data = 0;
+		for (uint j = 0; j < (n + 7) / 8; ++j)
+			data |= (uint32_t)tx[i / 8 + j] << 8 * j;
+		probe_write_bits(n, data);
+	}
+}
+
+static void pio_link_hiz_clocks(void *ctx, uint n_bits) {
+	swd_pio_release_pins(ctx);
+	if (!is_probe_port(ctx)) {
+		swd_link_bitbang.hiz_clocks(ctx, n_bits);
+		return;
+	}
+	probe_read_mode();
+	for (uint i = 0; i < n_bits; i += 32)
+		(void)probe_read_bits(n_bits - i < 32 ? n_bits - i : 32);
+	probe_write_mode();
+}
+
+static uint pio_link_transfer(void *ctx, uint8_t header, uint32_t *data) {
+	swd_pio_claim_pins(ctx);
+	uint ack = swd_pio_transfer(ctx, header, data, true);
+	return ack == SWD_PIO_PARITY_ERROR ? SWD_LINK_PARITY_ERROR : ack;
+}
+
+static uint pio_link_write_burst(void *ctx, uint8_t header, const uint32_t *data, uint n) {
+	swd_pio_claim_pins(ctx);
+	return swd_pio_write_burst(ctx, header, data, n);
+}
+
+const swd_link_ops_t swd_link_pio = {
+	.init        = pio_link_init,
+	.put_bits    = pio_link_put_bits,
+	.get_bits    = NULL,
+	.hiz_clocks  = pio_link_hiz_clocks,
+	.transfer    = pio_link_transfer,
+	.write_burst = pio_link_write_burst,
+	.swclk_khz   = SWD_LINK_PIO_SWCLK_KHZ,
+	.name        = "pio"
+};
@@ -0,0 +1,193 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+#include "swd_pio.h"
+#include "picoprobe_config.h"
+
+#include "hardware/clocks.h"
+#include "hardware/gpio.h"
+#include "hardware/pio.h"
+
+#include "swd_packet.pio.h"
+
+#define SWD_PIN_MASK(port) ((1u << (port)->pin_swclk) | (1u << (port)->pin_swdio))
+
+// The program is loaded once, and shared by all the ports' state machines.
+// Everything else is per state machine, so ports on different cores don't
+// interfere.
+static struct {
+	uint offset;
+	bool loaded;
+	bool initted[NUM_PIO_STATE_MACHINES];
+	uint freq_khz[NUM_PIO_STATE_MACHINES];
+} swd_pio = {.freq_khz = {[0 ... NUM_PIO_STATE_MACHINES - 1] = 1000}};
+
+static inline const swd_link_port_t *get_port(const swd_link_port_t *port) {
+	return port ? port : &swd_link_ports[0];
+}
+
+void swd_pio_set_swclk_freq(const swd_link_port_t *port, uint freq_khz) {
+	port = get_port(port);
+	swd_pio.freq_khz[port->sm] = freq_khz;
+	if (!swd_pio.initted[port->sm])
+		return;
+	// Two instructions per SWCLK period, as for probe.pio
+	uint divider = clock_get_hz(clk_sys) / 1000 / freq_khz / 2;
+	if (divider < 1)
+		divider = 1;
+	pio_sm_set_clkdiv_int_frac(SWD_PACKET_PIO, port->sm, divider, 0);
+}
+
+void swd_pio_init(const swd_link_port_t *port) {
+	port = get_port(port);
+	if (swd_pio.initted[port->sm])
+		return;
+	PIO pio = SWD_PACKET_PIO;
+	const uint sm = port->sm;
+	if (!swd_pio.loaded) {
+		swd_pio.offset = pio_add_program(pio, &swd_packet_program);
+		swd_pio.loaded = true;
+	}
+	pio_sm_config c = swd_packet_program_get_default_config(swd_pio.offset);
+	sm_config_set_sideset_pins(&c, port->pin_swclk);
+	sm_config_set_out_pins(&c, port->pin_swdio, 1);
+	sm_config_set_set_pins(&c, port->pin_swdio, 1);
+	sm_config_set_in_pins(&c, port->pin_swdio);
+	// SWD is LSB-first in both directions, no autopush/autopull
+	sm_config_set_out_shift(&c, true, false, 32);
+	sm_config_set_in_shift(&c, true, false, 32);
+	// SWCLK low, SWDIO driven high, until the first packet
+	pio_sm_set_pins_with_mask(pio, sm, 1u << port->pin_swdio, SWD_PIN_MASK(port));
+	pio_sm_set_pindirs_with_mask(pio, sm, SWD_PIN_MASK(port), SWD_PIN_MASK(port));
+	pio_sm_init(pio, sm, swd_pio.offset, &c);
+	swd_pio.initted[sm] = true;
+	swd_pio_set_swclk_freq(port, swd_pio.freq_khz[sm]);
+	pio_sm_set_enabled(pio, sm, true);
+}
+
+// The pins are claimed if their function is this PIO. Checking the hardware
+// rather than keeping a flag means other code (e.g. swd_dmi.c reclaiming the
+// pins as GPIOs) can't leave this out of date.
+static inline bool pins_claimed(const swd_link_port_t *port) {
+	return gpio_get_function(port->pin_swdio) == GPIO_FUNC_PIO0 + pio_get_index(SWD_PACKET_PIO);
+}
+
+void swd_pio_claim_pins(const swd_link_port_t *port) {
+	port = get_port(port);
+	if (pins_claimed(port))
+		return;
+	swd_pio_init(port);
+	pio_gpio_init(SWD_PACKET_PIO, port->pin_swclk);
+	pio_gpio_init(SWD_PACKET_PIO, port->pin_swdio);
+}
+
+void swd_pio_flush(const swd_link_port_t *port) {
+	port = get_port(port);
+	if (!swd_pio.initted[port->sm])
+		return;
+	// The state machine is idle once it stalls on an empty TX FIFO. (Write
+	// data is always in the FIFO by the time swd_pio_transfer() returns, so
+	// the stall waiting for write data doesn't count.)
+	const uint32_t stall_mask = 1u << (PIO_FDEBUG_TXSTALL_LSB + port->sm);
+	SWD_PACKET_PIO->fdebug = stall_mask;
+	while (!(SWD_PACKET_PIO->fdebug & stall_mask))
+		;
+}
+
+void swd_pio_release_pins(const swd_link_port_t *port) {
+	port = get_port(port);
+	if (!pins_claimed(port))
+		return;
+	swd_pio_flush(port);
+	if (port->pin_swclk == PROBE_PIN_SWCLK) {
+		pio_gpio_init(pio0, PROBE_PIN_SWCLK);
+		pio_gpio_init(pio0, PROBE_PIN_SWDIO);
+	} else {
+		// Same levels as the state machine leaves between packets
+		gpio_put(port->pin_swclk, 0);
+		gpio_put(port->pin_swdio, 1);
+		gpio_set_dir(port->pin_swclk, GPIO_OUT);
+		gpio_set_dir(port->pin_swdio, GPIO_OUT);
+		gpio_set_function(port->pin_swclk, GPIO_FUNC_SIO);
+		gpio_set_function(port->pin_swdio, GPIO_FUNC_SIO);
+	}
+}
+
+static inline void force_jmp(uint sm, uint label_offset) {
+	pio_sm_exec(SWD_PACKET_PIO, sm, pio_encode_jmp(swd_pio.offset + label_offset));
+}
+
+static inline uint32_t ctrl_word(uint8_t header, uint ok, uint not_ok) {
+	return header | (swd_pio.offset + not_ok) << 8 | (swd_pio.offset + ok) << 13;
+}
+
+static inline uint get_ack(uint sm) {
+	return pio_sm_get_blocking(SWD_PACKET_PIO, sm) >> 29;
+}
+
+uint swd_pio_transfer(const swd_link_port_t *port, uint8_t header, uint32_t *data, bool data_phase) {
+	PIO pio = SWD_PACKET_PIO;
+	const uint sm = get_port(port)->sm;
+	bool read = header & 0x4u;
+	uint32_t ctrl;
+	if (read) {
+		ctrl = ctrl_word(header, swd_packet_offset_read,
+			data_phase ? swd_packet_offset_read : swd_packet_offset_start);
+	} else {
+		ctrl = ctrl_word(header, swd_packet_offset_write,
+			data_phase ? swd_packet_offset_write_not_ok : swd_packet_offset_start);
+		ctrl |= (uint32_t)__builtin_parity(*data) << 18;
+	}
+	pio_sm_put_blocking(pio, sm, ctrl);
+	// With ORUNDETECT, write data goes out whatever the ACK, so don't wait for it
+	if (!read && data_phase)
+		pio_sm_put_blocking(pio, sm, *data);
+	uint ack = get_ack(sm);
+	if (ack != SWD_PIO_ACK_OK && !data_phase) {
+		// The state machine is stalled waiting for us to pick a continuation
+		if (ack != SWD_PIO_ACK_WAIT && ack != SWD_PIO_ACK_FAULT) {
+			force_jmp(sm, swd_packet_offset_read);
+			(void)pio_sm_get_blocking(pio, sm);
+			(void)pio_sm_get_blocking(pio, sm);
+		} else {
+			force_jmp(sm, swd_packet_offset_turnaround);
+		}
+		return ack;
+	}
+	if (read) {
+		uint32_t rdata = pio_sm_get_blocking(pio, sm);
+		uint32_t parity = pio_sm_get_blocking(pio, sm) >> 31;
+		if (ack != SWD_PIO_ACK_OK)
+			return ack;
+		*data = rdata;
+		if (parity != (uint32_t)__builtin_parity(rdata))
+			return SWD_PIO_PARITY_ERROR;
+	} else if (!data_phase) {
+		pio_sm_put_blocking(pio, sm, *data);
+	}
+	return ack;
+}
+
+uint swd_pio_write_burst(const swd_link_port_t *port, uint8_t header, const uint32_t *data, uint n) {
+	PIO pio = SWD_PACKET_PIO;
+	const uint sm = get_port(port)->sm;
+	const uint32_t ctrl = ctrl_word(header, swd_packet_offset_write, swd_packet_offset_write_not_ok);
+	uint first_bad = n;
+	uint n_acks = 0;
+	for (uint i = 0; i < n; ++i) {
+		pio_sm_put_blocking(pio, sm, ctrl | (uint32_t)__builtin_parity(data[i]) << 18);
+		pio_sm_put_blocking(pio, sm, data[i]);
+		// Keep the RX FIFO drained so the state machine never stalls on a push
+		while (!pio_sm_is_rx_fifo_empty(pio, sm)) {
+			if (get_ack(sm) != SWD_PIO_ACK_OK && first_bad == n)
+				first_bad = n_acks;
+			++n_acks;
+		}
+	}
+	while (n_acks < n) {
+		if (get_ack(sm) != SWD_PIO_ACK_OK && first_bad == n)
+			first_bad = n_acks;
+		++n_acks;
+	}
+	return first_bad;
+}
@@ -0,0 +1,73 @@
+// Copyright (c) Luke Wren 2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Whole-packet SWD engine on a PIO state machine (see swd_packet.pio). The
+// processor supplies a header and gets back an ACK, with all the bit timing,
+// turnarounds and ACK checking done by the PIO.
+//
+// Each SWD port (see swd_link.h) has its own state machine, all running the
+// same program on SWD_PACKET_PIO. Every function takes the port, with NULL
+// meaning the probe's own SWD pins, and ports can be driven from different
+// cores at once.
+//
+// The probe's own pins are shared with the probe.pio program, which is still
+// used for raw sequences. The pins are switched between the two PIO blocks
+// with swd_pio_claim_pins() and swd_pio_release_pins(). Other ports have no
+// probe.pio state machine, so they are released to SIO instead, for raw
+// sequences to be bitbanged.
+
+#ifndef _SWD_PIO_H
+#define _SWD_PIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico/stdlib.h"
+
+#include "swd_link.h"
+
+#define SWD_PIO_ACK_OK           1u
+#define SWD_PIO_ACK_WAIT         2u
+#define SWD_PIO_ACK_FAULT        4u
+// Not a real ACK: returned when the ACK was OK but read data parity was bad
+#define SWD_PIO_PARITY_ERROR     8u
+
+// Load the program and start the port's state machine, if not already done.
+// Does not take the pins.
+void swd_pio_init(const swd_link_port_t *port);
+
+void swd_pio_set_swclk_freq(const swd_link_port_t *port, uint freq_khz);
+
+// Route the SWD pins to the packet engine. Cheap if already done. Calls
+// swd_pio_init() if required.
+void swd_pio_claim_pins(const swd_link_port_t *port);
+
+// Wait for any packet in progress to finish, then hand the pins back to the
+// probe.pio program, or to SIO with SWCLK low and SWDIO driven high. Does
+// nothing if the pins are not currently claimed.
+void swd_pio_release_pins(const swd_link_port_t *port);
+
+// Wait for any packet in progress to finish
+void swd_pio_flush(const swd_link_port_t *port);
+
+// Run one packet: header is the 8-bit packet header as it appears on the
+// wire. Returns the ACK, or SWD_PIO_PARITY_ERROR. *data is written for reads
+// only if the ACK is OK. The pins must be claimed.
+//
+// data_phase is the ORUNDETECT setting: if true, any ACK is followed by a
+// data phase (with the read data discarded if the ACK is not OK), and write
+// data is queued without waiting for the ACK. If false, a WAIT or FAULT ends
+// the packet, and any other ACK is treated as a protocol error and backed off
+// with a read-length data phase.
+//
+// Returns as soon as the result is known, so the trailing turnaround of a
+// read, or the data phase of a write, may still be in progress. This
+// overlaps with the next packet's setup; use swd_pio_flush() to wait for it.
+uint swd_pio_transfer(const swd_link_port_t *port, uint8_t header, uint32_t *data, bool data_phase);
+
+// Run n write packets with the same header back to back, queueing each one
+// without waiting for the previous ACK. Requires ORUNDETECT=1. Returns the
+// index of the first write whose ACK was not OK, or n if all were OK.
+uint swd_pio_write_burst(const swd_link_port_t *port, uint8_t header, const uint32_t *data, uint n);
+
+#endif
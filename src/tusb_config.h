@@ -41,9 +41,7 @@
 
 #define CFG_TUSB_RHPORT0_MODE     OPT_MODE_DEVICE
 
-#ifndef CFG_TUSB_OS
-#define CFG_TUSB_OS                 OPT_OS_PICO
-#endif
+// CFG_TUSB_OS comes from the SDK, see TINYUSB_OPT_OS in CMakeLists.txt
 
 #ifndef CFG_TUSB_MEM_SECTION
 #define CFG_TUSB_MEM_SECTION